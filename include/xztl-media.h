@@ -55,6 +55,7 @@ enum xztl_media_opcodes {
     /* I/O commands */
     XZTL_CMD_WRITE 	 = 0x01,
     XZTL_CMD_READ  	 = 0x02,
+    XZTL_CMD_COPY	 = 0x19, /* Simple Copy, synchronous only */
     XZTL_CMD_WRITE_OCSSD = 0x91,
     XZTL_CMD_READ_OCSSD  = 0x92,
 
@@ -78,6 +79,8 @@ enum xztl_media_opcodes {
     XZTL_MISC_ASYNCH_WAIT = 0x5
 };
 
+/* Each context completes its commands in its own completion thread, so
+ * callbacks of a context never run concurrently */
 struct xztl_mthread_ctx {
     uint16_t 	    tid;
     xztl_thread    *comp_th;
@@ -85,6 +88,12 @@ struct xztl_mthread_ctx {
     int             comp_active;
     pthread_spinlock_t       qpair_spin;
     struct xnvme_queue *asynch;
+
+    /* Completion queues, drained by the completion thread */
+    pthread_spinlock_t       cb_spin;
+    STAILQ_HEAD (xztl_io_cb_head, xztl_io_mcmd) cb_head;
+    STAILQ_HEAD (xztl_zn_cb_head, xztl_zn_mcmd) zn_cb_head;
+    struct xztl_poll	     cb_poll;
 };
 
 struct xztl_io_mcmd {
@@ -97,6 +106,7 @@ struct xztl_io_mcmd {
      uint16_t 		status;
      uint64_t 		nsec[XZTL_MAX_MADDR];
      struct xztl_maddr 	addr[XZTL_MAX_MADDR];
+     struct xztl_maddr	addr_dst;	/* Destination of XZTL_CMD_COPY */
      uint64_t		prp[XZTL_MAX_MADDR];
      uint64_t 		paddr[XZTL_MAX_MADDR];
      xztl_callback     *callback;
@@ -115,9 +125,21 @@ struct xztl_io_mcmd {
 struct xztl_zn_mcmd {
     uint8_t		 opcode;
     uint8_t 		 status;
+    uint8_t		 asynch; /* Opt-in, zone report is always synchronous */
     struct xztl_maddr	 addr;
     uint32_t 		 nzones;
     void		*opaque;
+
+    /* Asynchronous zone management, the callback runs in the completion
+     * thread of async_ctx */
+    xztl_callback	    *callback;
+    struct xztl_mthread_ctx *async_ctx;
+
+    /* For latency */
+    uint64_t us_start;
+
+    /* Completion queue */
+    STAILQ_ENTRY(xztl_zn_mcmd) entry;
 };
 
 struct xztl_misc_cmd {
@@ -147,6 +169,10 @@ struct xztl_mgeo {
     uint32_t	sec_zn;	    /* Sectors per zone */
     uint32_t	nbytes;	    /* Per sector */
     uint32_t	nbytes_oob; /* Per sector */
+    uint32_t	zn_open;    /* Max open zones (0: no limit) */
+    uint32_t	zn_active;  /* Max active zones (0: no limit) */
+    uint32_t	sec_mcmd;   /* Max sectors per command (0: no limit) */
+    uint32_t	sec_wgran;  /* Optimal write granularity in sectors */
 
     /* Calculated values */
     uint32_t    zn_dev;     /* Total zones in device */
@@ -178,4 +204,28 @@ struct xztl_media {
     xztl_media_cmd_fn       *cmd_exec;
 };
 
+/* Media layers intercept commands between the ZTL and the media backend.
+ * Submit functions run in the order layers were added, a non-zero return
+ * fails the command without reaching the media. Done functions run in
+ * reverse order once a command completes or fails. Functions left NULL are
+ * not part of the chain. Layers are added before I/O starts and removed by
+ * xztl_exit */
+
+#define XZTL_MEDIA_LAYERS 8
+
+typedef void (xztl_media_io_done_fn) (struct xztl_io_mcmd *cmd);
+typedef void (xztl_media_zn_done_fn) (struct xztl_zn_mcmd *cmd);
+
+struct xztl_media_layer {
+    const char            *name;
+    xztl_media_io_fn      *submit_io;
+    xztl_media_io_done_fn *io_done;
+    xztl_media_zn_fn      *submit_zn;
+    xztl_media_zn_done_fn *zn_done;
+};
+
+int  xztl_media_layer_add (struct xztl_media_layer *layer);
+void xztl_media_io_done   (struct xztl_io_mcmd *cmd);
+void xztl_media_zn_done   (struct xztl_zn_mcmd *cmd);
+
 #endif /* XZTL_MEDIA_H */
@@ -62,6 +62,9 @@ struct xztl_mp_pool_i {
     pthread_spinlock_t	spin;
     xztl_mp_alloc      *alloc_fn;
     xztl_mp_free       *free_fn;
+    void	       *slab;    /* Entries and default-allocated data */
+    size_t		slab_sz;
+    int32_t		node;    /* NUMA node of the slab, -1: any */
     STAILQ_HEAD (mp_head, xztl_mp_entry) head;
 };
 
@@ -93,9 +96,9 @@ w *
  * @param entries Number of entries in the memory pool
  * @param ent_sz Size of each entry
  * @param alloc User-defined memory allocation function
- * 		Use NULL for standard malloc
+ * 		Use NULL to allocate from the pool slab (NUMA local)
  * @param free User-defined memory deallocation function
- * 		Use NULL for standard free
+ * 		Use NULL to allocate from the pool slab (NUMA local)
  *
  * @return Returns zero if the call succeeds, or a negative value if it fails
  */
@@ -143,4 +146,14 @@ void xztl_mempool_put (struct xztl_mp_entry *ent, uint32_t type, uint16_t tid);
  */
 int xztl_mempool_left (uint32_t type, uint16_t tid);
 
+/**
+ * Find a thread ID without a memory pool of the given type. IDs are
+ * searched from the highest, low IDs are left to the application
+ *
+ * @param type Mempool type. Check enum xztl_mp_types
+ *
+ * @return Returns the thread ID, or a negative value if all IDs are in use
+ */
+int xztl_mempool_free_tid (uint32_t type);
+
 #endif /* XZTLMEMPOOL */
@@ -38,19 +38,47 @@
 #define ZTL_MPE_PG_SEC	 8
 
 /* Small mapping always follows this granularity */
-#define ZTL_MPE_CPGS	 256
+#define ZTL_MPE_CPGS	 512
 
-/* Media minimum/maximum write size in sectors */
-#define ZTL_WCA_SEC_MCMD 	16
+/* Status of map reads of IDs that are not mapped, errors are negative */
+#define ZTL_MAP_NOT_FOUND	1
+
+/* Objects up to ZTL_MAP_TINY_BYTES are kept inline in the tiny table */
+#define ZTL_MAP_TINY_BYTES	56
+#define ZTL_MAP_TINY_ENTS	65536
+
+/* The values below are defaults, see struct xztl_config */
+
+/* Media command sizes in sectors. 0 sizes commands from the media transfer
+ * limits, capped by ZTL_SEC_MCMD_MAX. ZTL_SEC_MCMD_DEF is used if the media
+ * does not report a limit */
+#define ZTL_WCA_SEC_MCMD 	0
 #define ZTL_WCA_SEC_MCMD_MIN	1
+#define ZTL_READ_SEC_MCMD	0
+#define ZTL_SEC_MCMD_DEF	16
+#define ZTL_SEC_MCMD_MAX	256
+
+/* Writes slower than this (us) are logged with their stage breakdown */
+#define ZTL_WCA_SLOW_USEC	100000
 
-/* Media maximum read size in sectors */
-#define ZTL_READ_SEC_MCMD	16
+/* Writes up to this size (bytes) are coalesced in the write-cache. Larger
+ * writes are not copied. 0 disables coalescing */
+#define ZTL_WCA_COAL_MAX	16384
+
+/* Staging defaults. Slots and buffers are bounded by the _MAX values */
+#define ZTL_WCA_COAL_USEC	100 /* Max time an object waits in staging */
+#define ZTL_WCA_COAL_SLOTS	8   /* Levels staged at the same time */
+#define ZTL_WCA_COAL_SLOTS_MAX	64
+#define ZTL_WCA_COAL_BUFS	16  /* Staging buffers, more than slots */
+#define ZTL_WCA_COAL_BUFS_MAX	256
 
 /* Set ZTL_WRITE_AFFINITY to 1 to enable thread affinity to a single core */
 #define ZTL_WRITE_AFFINITY 1
 #define ZTL_WRITE_CORE     0
 
+/* Mapping cache pages, 256 MB per cache with 32KB page */
+#define ZTL_MAP_BUF_PGS	   8192
+
 enum xztl_mod_types {
     ZTLMOD_BAD = 0x0,
     ZTLMOD_ZMD = 0x1,
@@ -116,14 +144,18 @@ struct app_zmd_entry {
     uint64_t		 wptr_inflight; /* In-flight writing LBAs (not completed yet) */
     uint32_t             ndeletes;
     uint32_t		 npieces;
+    uint64_t		 birth; /* Zone open time (us), for data lifetime */
 
     /* If we implement recovery at the ZTL, we need to decide how to store
      * mapping pieces information here as a list */
     /* INFO: Make this struct packed if we flush to flash */
 };
 
+/* Tiny table entry. The mapping tiny table keeps small objects inline,
+ * 'id' is the owner of the value (AND64 if the entry is free) */
 struct app_tiny_entry {
-        struct xztl_maddr   addr;
+        uint64_t            id;
+        uint8_t             data[ZTL_MAP_TINY_BYTES];
 } __attribute__((packed));
 
 struct app_tiny_tbl {
@@ -155,6 +187,27 @@ struct app_map_entry {
     };
 }; /* 8 bytes entry */
 
+/* Byte extent of a ZTL-managed object. Objects packed by the write-cache
+ * start 'boff' bytes within the first mapped sector. A zero extent maps
+ * the full sectors of the entry. Inline objects are mapped with no sectors
+ * and the tiny table index as offset */
+struct app_map_ext {
+    union {
+	struct {
+	    uint64_t len  : 48; /* Object length in bytes */
+	    uint64_t boff : 16; /* Byte offset within the first sector */
+	} g;
+
+	uint64_t val;
+    };
+};
+
+/* Mapping pages are arrays of slots */
+struct app_map_slot {
+    struct app_map_entry ent;
+    struct app_map_ext   ext;
+}; /* 16 bytes slot */
+
 struct app_mpe {
     struct app_magic byte;
     uint32_t         entries;
@@ -162,7 +215,7 @@ struct app_mpe {
 
     uint8_t             *tbl;
     uint32_t             ent_per_pg;
-    struct app_tiny_tbl  tiny;   /* This is the 'tiny' table for checkpoint */
+    struct app_tiny_tbl  tiny;   /* Inline objects, persisted with the map */
 
     pthread_mutex_t     *entry_mutex;
 } __attribute__((packed));
@@ -199,8 +252,10 @@ struct app_pro_addr {
     struct xztl_maddr    addr[APP_PRO_MAX_OFFS];
     uint32_t 		 nsec[APP_PRO_MAX_OFFS];
     uint16_t             naddr;
+    uint32_t		 grp_map; /* Bitmap of groups used by the context */
     uint16_t 		 thread_id;
     uint16_t 		 ptype;
+    uint16_t		 level; /* User level, ptype is chosen by placement */
 
     struct xztl_mp_entry *mp_entry;
 };
@@ -212,6 +267,8 @@ typedef void    (app_grp_exit)(void);
 typedef struct app_group *
 	        (app_grp_get)(uint16_t gid);
 typedef int     (app_grp_get_list)(struct app_group **lgrp, uint16_t ngrps);
+typedef struct app_group *
+	        (app_grp_get_by_offset)(uint64_t offset);
 
 typedef int     (app_zmd_create)(struct app_group *grp);
 typedef int     (app_zmd_flush) (struct app_group *grp);
@@ -232,6 +289,7 @@ typedef int     (app_pro_put_zone)    (struct app_group *grp, uint32_t zid);
 typedef struct app_pro_addr *
 	        (app_pro_new)  (uint32_t naddr, uint16_t type, uint8_t multi);
 typedef void    (app_pro_free) (struct app_pro_addr *ctx);
+typedef void    (app_pro_death) (struct app_zmd_entry *zmd, uint16_t level);
 
 typedef int  (app_mpe_create) (void);
 typedef int  (app_mpe_load)   (void);
@@ -245,7 +303,15 @@ typedef void     (app_map_exit) (void);
 typedef void     (app_map_persist) (void);
 typedef int      (app_map_upsert) (uint64_t id, uint64_t addr,
 					uint64_t *old, uint64_t old_caller);
-typedef uint64_t (app_map_read) (uint64_t id);
+typedef int      (app_map_read) (uint64_t id, uint64_t *val);
+typedef int      (app_map_upsert_ext) (uint64_t id, uint64_t addr,
+					uint64_t ext, uint64_t *old);
+typedef int      (app_map_read_ext) (uint64_t id, struct app_map_entry *ent,
+					struct app_map_ext *ext);
+typedef int      (app_map_upsert_tiny) (uint64_t id, void *buf, uint32_t len,
+					uint64_t *old);
+typedef int      (app_map_read_tiny) (uint64_t id, uint64_t off, void *buf,
+					size_t size);
 typedef int      (app_map_upsert_md) (uint64_t index, uint64_t addr,
 							uint64_t old_addr);
 
@@ -253,12 +319,14 @@ typedef int  (app_wca_init) (void);
 typedef void (app_wca_exit) (void);
 typedef int  (app_wca_submit) (struct xztl_io_ucmd *ucmd);
 typedef void (app_wca_callback) (struct xztl_io_mcmd *mcmd);
+typedef uint32_t (app_wca_outstanding) (void);
 
 struct app_groups {
     app_grp_init         *init_fn;
     app_grp_exit         *exit_fn;
     app_grp_get          *get_fn;
     app_grp_get_list     *get_list_fn;
+    app_grp_get_by_offset *get_by_offset_fn;
 };
 
 struct app_zmd_mod {
@@ -282,6 +350,7 @@ struct app_pro_mod {
     app_pro_put_zone    *put_zone_fn;
     app_pro_new	        *new_fn;
     app_pro_free	*free_fn;
+    app_pro_death	*death_fn;
 };
 
 struct app_mpe_mod {
@@ -302,6 +371,10 @@ struct app_map_mod {
     app_map_persist	*persist_fn;
     app_map_upsert	*upsert_fn;
     app_map_read	*read_fn;
+    app_map_upsert_ext	*upsert_ext_fn;
+    app_map_read_ext	*read_ext_fn;
+    app_map_upsert_tiny	*upsert_tiny_fn;
+    app_map_read_tiny	*read_tiny_fn;
     app_map_upsert_md	*upsert_md_fn;
 };
 
@@ -312,6 +385,7 @@ struct app_wca_mod {
     app_wca_exit	*exit_fn;
     app_wca_submit	*submit_fn;
     app_wca_callback	*callback_fn;
+    app_wca_outstanding *outstanding_fn;
 };
 
 struct app_global {
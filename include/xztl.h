@@ -47,6 +47,7 @@
 } while ( 0 )
 
 #define XZTL_PROMETHEUS 1
+#define XZTL_PROMETHEUS_PORT 0 /* Opt-in /metrics port (e.g. 9464), 0: off */
 
 #define log_erra(format, ...)         syslog(LOG_ERR, format, ## __VA_ARGS__)
 #define log_infoa(format, ...)        syslog(LOG_INFO, format, ## __VA_ARGS__)
@@ -54,15 +55,80 @@
 #define log_info(format)              syslog(LOG_INFO, format)
 
 #define GET_NANOSECONDS(ns,ts) do {                                     \
-            clock_gettime(CLOCK_REALTIME,&ts);                          \
+            clock_gettime(CLOCK_MONOTONIC_RAW,&ts);                     \
             (ns) = ((ts).tv_sec * 1000000000 + (ts).tv_nsec);           \
 } while ( 0 )
 
 #define GET_MICROSECONDS(us,ts) do {                                    \
-            clock_gettime(CLOCK_REALTIME,&ts);                          \
+            clock_gettime(CLOCK_MONOTONIC_RAW,&ts);                     \
             (us) = ( ((ts).tv_sec * 1000000) + ((ts).tv_nsec / 1000) ); \
 } while ( 0 )
 
+/* Monotonic time for the I/O path. The TSC is used when it is invariant,
+ * converted with a multiplier calibrated by xztl_time_init against
+ * CLOCK_MONOTONIC_RAW. Other systems read CLOCK_MONOTONIC_RAW directly */
+#define XZTL_TIME_SHIFT 32
+
+struct xztl_time_cal {
+    uint64_t tsc_base;
+    uint64_t ns_base;
+    uint64_t mult;     /* Nanoseconds per tick << XZTL_TIME_SHIFT */
+    uint8_t  tsc;
+};
+
+extern struct xztl_time_cal xztl_time_cal;
+
+void     xztl_time_init (void);
+uint64_t xztl_time_ns_sys (void);
+
+static inline uint64_t xztl_time_ns (void)
+{
+#if defined(__x86_64__)
+    if (xztl_time_cal.tsc) {
+	__extension__ unsigned __int128 ticks;
+
+	ticks = __builtin_ia32_rdtsc () - xztl_time_cal.tsc_base;
+	return xztl_time_cal.ns_base +
+		(uint64_t) ((ticks * xztl_time_cal.mult) >> XZTL_TIME_SHIFT);
+    }
+#endif
+
+    return xztl_time_ns_sys ();
+}
+
+static inline uint64_t xztl_time_us (void)
+{
+    return xztl_time_ns () / 1000;
+}
+
+/* Adaptive polling for worker threads. An idle poller busy-polls, then
+ * yields, then parks on a futex until a producer wakes it or the park
+ * timeout expires. Producers publish work before calling xztl_poll_wake,
+ * pollers take a key before checking for work */
+#define XZTL_POLL_SPIN  4096 /* Empty polls before yielding */
+#define XZTL_POLL_YIELD 256  /* Yields before parking */
+
+struct xztl_poll {
+    uint32_t seq;    /* Futex word, advanced by every wake */
+    uint32_t parked; /* Pollers sleeping on seq */
+};
+
+void xztl_poll_idle     (struct xztl_poll *p, uint32_t key, uint32_t *idle,
+							uint64_t park_us);
+void xztl_poll_wake_all (struct xztl_poll *p);
+
+static inline uint32_t xztl_poll_key (struct xztl_poll *p)
+{
+    return __atomic_load_n (&p->seq, __ATOMIC_ACQUIRE);
+}
+
+static inline void xztl_poll_wake (struct xztl_poll *p)
+{
+    __atomic_add_fetch (&p->seq, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n (&p->parked, __ATOMIC_SEQ_CST))
+	xztl_poll_wake_all (p);
+}
+
 #define TV_ELAPSED_USEC(tvs,tve,usec) do {                              \
             (usec) = ((tve).tv_sec*(uint64_t)1000000+(tve).tv_usec) -   \
             ((tvs).tv_sec*(uint64_t)1000000+(tvs).tv_usec);             \
@@ -111,6 +177,59 @@ struct xztl_maddr {
 #define XZTL_IO_MAX_MCMD     65536 /* 4KB sectors : 16 GB user buffers */
 				   /* 512b sectors: 2 GB user buffers */
 
+#define XZTL_CTX_NVME_DEPTH  64    /* Default device queue depth per context */
+
+#define XZTL_CPUS_LEN        64    /* Thread placement string size */
+
+/* Runtime configuration. Defaults are filled by xztl_config_default and
+ * environment variables (in parentheses) override the values given to
+ * xztl_init_config.
+ *
+ * Thread placements are CPU lists ("2,4-7") or "node:N" for the CPUs of
+ * NUMA node N. An empty write placement uses write_core, an empty
+ * completion placement uses the NUMA node of the write thread, without
+ * the CPUs sharing an L2 cache or an SMT core with it (not pinned if none
+ * is left). Background threads are not pinned by
+ * default. With write_affinity 0 only explicit placements are applied */
+struct xztl_config {
+    uint32_t pro_stripe;     /* Max zones per write stripe (XZTL_PRO_STRIPE) */
+    uint32_t wca_sec_mcmd;   /* Write sectors, 0: media (XZTL_WCA_SEC_MCMD) */
+    uint32_t read_sec_mcmd;  /* Read sectors, 0: media (XZTL_READ_SEC_MCMD) */
+    uint32_t nvme_depth;     /* Queue depth per context (XZTL_NVME_DEPTH) */
+    uint32_t map_buf_pgs;    /* Mapping cache pages (XZTL_MAP_BUF_PGS) */
+    uint32_t write_core;     /* Core of write threads (XZTL_WRITE_CORE) */
+    uint32_t write_affinity; /* Pin write threads (XZTL_WRITE_AFFINITY) */
+    uint32_t prom_port;      /* Metrics port, 0: off (XZTL_PROM_PORT) */
+    uint32_t slow_write_us;  /* Log slow writes, 0: off (XZTL_SLOW_WRITE_US) */
+    char write_cpus[XZTL_CPUS_LEN]; /* Write thread (XZTL_WRITE_CPUS) */
+    char comp_cpus[XZTL_CPUS_LEN];  /* Completion threads (XZTL_COMP_CPUS) */
+    char bg_cpus[XZTL_CPUS_LEN];    /* Background threads (XZTL_BG_CPUS) */
+    uint32_t reset_pool;     /* Zones reset ahead per group (XZTL_RESET_POOL) */
+    uint32_t coal_max_bytes; /* Coalesce up to, 0: off (XZTL_COAL_MAX_BYTES) */
+    uint32_t coal_usec;      /* Max staging time (XZTL_COAL_USEC) */
+    uint32_t coal_slots;     /* Levels staged at once (XZTL_COAL_SLOTS) */
+    uint32_t coal_bufs;      /* Staging buffers (XZTL_COAL_BUFS) */
+};
+
+enum xztl_thread_roles {
+    XZTL_THREAD_WRITE = 0,
+    XZTL_THREAD_COMP,
+    XZTL_THREAD_BG,
+    XZTL_THREAD_ROLES
+};
+
+/* Timestamps (us) taken along the write path of a user command */
+enum xztl_ucmd_stages {
+    XZTL_UCMD_SUBMIT = 0,  /* Queued to the write-cache */
+    XZTL_UCMD_DEQUEUE,     /* Picked by the write thread */
+    XZTL_UCMD_PROV,        /* Zone space provisioned (or staged and flushed) */
+    XZTL_UCMD_MSUBMIT,     /* Last media command being submitted */
+    XZTL_UCMD_MDONE,       /* Last media command completed by the device */
+    XZTL_UCMD_CALLBACK,    /* Completion handed to the write-cache */
+    XZTL_UCMD_MAPPED,      /* Mapping and zone metadata updated */
+    XZTL_UCMD_STAGES
+};
+
 struct xztl_io_ucmd {
     uint64_t 	   id;
     void	  *buf;
@@ -134,11 +253,15 @@ struct xztl_io_ucmd {
     pthread_spinlock_t inflight_spin;
     volatile uint8_t minflight[256];
 
+    uint64_t	   us_stage[XZTL_UCMD_STAGES];
+
     STAILQ_ENTRY (xztl_io_ucmd)	entry;
 };
 
 struct xztl_core {
     struct xztl_media *media;
+    struct xztl_config config;    /* Effective configuration */
+    int32_t            numa_node; /* Device NUMA node, -1: unknown */
 };
 
 enum xztl_status {
@@ -166,6 +289,8 @@ enum xztl_status {
     XZTL_ZTL_APPEND_ERR = 0x15,
     XZTL_ZTL_WCA_S_ERR  = 0x16,
     XZTL_ZTL_WCA_S2_ERR = 0x17,
+    XZTL_CONFIG_ERR	= 0x18,
+    XZTL_MEDIA_LAYER_ERR = 0x19,
 
     XZTL_MEDIA_ERROR	= 0x100,
 };
@@ -183,7 +308,50 @@ enum xztl_stats_io_types {
     XZTL_STATS_APPEND_UCMD,
 
     XZTL_STATS_RECYCLED_BYTES,
-    XZTL_STATS_RECYCLED_ZONES
+    XZTL_STATS_RECYCLED_ZONES,
+
+    XZTL_STATS_COPY_BYTES,
+    XZTL_STATS_COPY_MCMD,
+
+    /* Open zone budget, the first two are gauges */
+    XZTL_STATS_OPEN_ZONES,
+    XZTL_STATS_OPEN_BUDGET,
+    XZTL_STATS_OPEN_FINISH,
+
+    /* Small writes coalesced by the write-cache */
+    XZTL_STATS_COAL_UCMD,
+    XZTL_STATS_COAL_MCMD,
+
+    XZTL_STATS_IO_TYPES /* Number of types, keep last */
+};
+
+/* Latency histograms, recorded in microseconds */
+enum xztl_stats_lat_types {
+    XZTL_STATS_LAT_READ = 0,
+    XZTL_STATS_LAT_WRITE,
+    XZTL_STATS_LAT_APPEND,
+    XZTL_STATS_LAT_RESET,
+    XZTL_STATS_LAT_FINISH,
+
+    /* Write pipeline stages, between consecutive xztl_ucmd_stages */
+    XZTL_STATS_LAT_W_QUEUE,
+    XZTL_STATS_LAT_W_PROV,
+    XZTL_STATS_LAT_W_SUBMIT,
+    XZTL_STATS_LAT_W_DEVICE,
+    XZTL_STATS_LAT_W_HANDOFF,
+    XZTL_STATS_LAT_W_MAP,
+    XZTL_STATS_LAT_W_TOTAL
+};
+
+#define XZTL_STATS_LAT_TYPES 12
+
+struct xztl_stats_lat {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t p50;
+    uint64_t p99;
+    uint64_t p999;
+    uint64_t max;
 };
 
 /* Compare and swap atomic operations */
@@ -201,6 +369,29 @@ int xztl_media_set (struct xztl_media *media);
 
 /* Initialize XApp instance */
 int xztl_init (const char *device_name);
+int xztl_init_config (const char *device_name, const struct xztl_config *cfg);
+
+/* Runtime configuration */
+void xztl_config_default (struct xztl_config *cfg);
+void xztl_config_get (struct xztl_config *cfg);
+
+/* Thread placement. Pins the calling thread following its role */
+void xztl_thread_place (uint32_t role);
+int  xztl_cpus_check   (const char *name, const char *cpus);
+
+/* NUMA placement of I/O memory. The device node is kept in core.numa_node */
+#define XZTL_NUMA_MAX_NODES 64
+
+struct xztl_numa_policy {
+    int           mode;
+    unsigned long mask;
+};
+
+int  xztl_numa_dev_node (const char *dev_name);
+int  xztl_numa_node     (void);
+void xztl_numa_bind     (void *addr, size_t len, int node);
+int  xztl_numa_prefer   (int node, struct xztl_numa_policy *old);
+void xztl_numa_restore  (struct xztl_numa_policy *old);
 
 /* Safe shut down */
 int xztl_exit (void);
@@ -227,14 +418,48 @@ int  xztl_stats_init (void);
 void xztl_stats_exit (void);
 void xztl_stats_add_io (struct xztl_io_mcmd *cmd);
 void xztl_stats_inc (uint32_t type, uint64_t val);
+void xztl_stats_set (uint32_t type, uint64_t val);
+uint64_t xztl_stats_get (uint32_t type);
+void xztl_stats_lat_add (uint32_t type, uint64_t usec);
+void xztl_stats_lat_get (uint32_t type, struct xztl_stats_lat *lat);
 void xztl_stats_print_io (void);
 void xztl_stats_print_io_simple (void);
 
+/* Media command trace. A trace file holds a struct xztl_trace_hdr followed
+ * by struct xztl_trace_rec entries, in per-thread order */
+#define XZTL_TRACE_MAGIC   0x314352544c545a58ULL /* "XZTLTRC1" */
+#define XZTL_TRACE_VERSION 1
+
+enum xztl_trace_events {
+    XZTL_TRACE_IO_SUBMIT = 0x1,
+    XZTL_TRACE_IO_DONE   = 0x2,
+    XZTL_TRACE_ZN_SUBMIT = 0x3,
+    XZTL_TRACE_ZN_DONE   = 0x4
+};
+
+struct xztl_trace_hdr {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t nbytes;   /* Sector size */
+    uint32_t rec_sz;
+    uint32_t rsv[11];
+};
+
+struct xztl_trace_rec {
+    uint64_t us;       /* xztl_time_us */
+    uint64_t addr;     /* First address (struct xztl_maddr) */
+    uint64_t tag;      /* Pairs submissions and completions */
+    uint32_t nsec;     /* Sectors, or zones for zone commands */
+    uint8_t  event;
+    uint8_t  opcode;
+    uint16_t status;
+};
+
+int  xztl_trace_init (void);
+void xztl_trace_exit (void);
+
 /* Prometheus */
 int  xztl_prometheus_init (void);
 void xztl_prometheus_exit (void);
-void xztl_prometheus_add_io (struct xztl_io_mcmd *cmd);
-void xztl_prometheus_add_wa (uint64_t user_writes, uint64_t zns_writes);
-void xztl_prometheus_add_read_latency (uint64_t usec);
 
 #endif /* XZTL_H */
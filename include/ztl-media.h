@@ -42,6 +42,12 @@ struct znd_media {
     struct xnvme_dev 	   *dev;
     const struct xnvme_geo *devgeo;
     struct xztl_media 	    media;
+
+    /* Simple Copy support. If 'scopy' is zero, copies are emulated */
+    uint8_t		    scopy;
+    uint32_t		    scopy_mssrl; /* Max sectors per source range */
+    uint32_t		    scopy_mcl;	 /* Max sectors per copy command */
+    uint32_t		    scopy_msrc;	 /* Max source ranges per command */
 };
 
 struct znd_log_cmd {
@@ -24,7 +24,28 @@
 
 #define ZTL_PRO_TYPES    64  /* Number of provisioning types */
 #define ZTL_PRO_MP_SZ    32  /* Mempool size per thread */
-#define ZTL_PRO_STRIPE	 32  /* Number of zones for parallel write */
+#define ZTL_PRO_STRIPE	 64  /* Maximum zones for parallel write */
+#define ZTL_PRO_STRIPE_SEC 64 /* Minimum sectors per zone in a stripe */
+#define ZTL_PRO_BUCKETS	 32  /* Free space buckets (log2 of free sectors) */
+#define ZTL_PRO_PUNITS	 8   /* Free lists per group (xztl_maddr.g.punit) */
+
+/* Default number of empty zones kept reset ahead of provisioning per group.
+ * Configurable at runtime (xztl_config.reset_pool) */
+#define ZTL_PRO_RESET_POOL	16
+#define ZTL_PRO_RESET_USEC	100 /* Reset thread poke interval, zone cmds */
+
+/* Lifetime-aware placement. Types below ZTL_PRO_PLACE_CLASSES hold data by
+ * predicted lifetime (log2 of milliseconds), the remaining types are used
+ * by levels with less than ZTL_PRO_PLACE_SAMPLES lifetime samples */
+#define ZTL_PRO_PLACE_CLASSES	32
+#define ZTL_PRO_PLACE_SAMPLES	16
+
+/* Open zone budget. Zone open retries while finishes release the budget */
+#define ZTL_PRO_BUDGET_RETRY	10000
+
+/* Media context used for asynchronous zone management. It takes the highest
+ * free mempool thread ID (xztl_mempool_free_tid) */
+#define ZTL_PRO_CTX_DEPTH	64
 
 enum ztl_pro_type_list {
     ZTL_PRO_TUSER = 0x0
@@ -36,22 +57,51 @@ struct ztl_pro_zone {
     uint64_t 			capacity;
     uint8_t 			lock;
     uint8_t 			state;
+    uint8_t			avlb;   /* Zone is in a free space bucket */
+    uint8_t			bucket;
+    struct app_group	       *grp;
+
+    /* A single zone management command in-flight per zone */
+    struct xztl_zn_mcmd		zn_cmd;
+    volatile uint8_t		zn_inflight;
+
     TAILQ_ENTRY (ztl_pro_zone) entry;
     TAILQ_ENTRY (ztl_pro_zone) open_entry;
+    TAILQ_ENTRY (ztl_pro_zone) avlb_entry;
 };
 
 struct ztl_pro_grp {
     struct ztl_pro_zone *vzones;
     uint32_t nfree;
     uint32_t nused;
+    uint32_t nreset;
+    uint32_t nreset_inflight;
+    uint32_t nzn_inflight;	/* In-flight zone management commands */
     uint32_t nopen[ZTL_PRO_TYPES];
 
-    TAILQ_HEAD (free_list, ztl_pro_zone) free_head;
+    struct xztl_mthread_ctx *tctx;
+
+    /* New zones are opened round-robin across parallel units */
+    uint16_t npu;
+    uint16_t pu_next;
+
+    /* Free zones are empty and ready to write. Zones returned to
+     * provisioning wait in the reset list until the reset thread
+     * resets them in background */
+    TAILQ_HEAD (free_list, ztl_pro_zone) free_head[ZTL_PRO_PUNITS];
     TAILQ_HEAD (used_list, ztl_pro_zone) used_head;
+    TAILQ_HEAD (reset_list, ztl_pro_zone) reset_head;
 
     /* Open zones for distinct provisioning types */
     TAILQ_HEAD (open_list, ztl_pro_zone) open_head[ZTL_PRO_TYPES];
 
+    /* Unlocked open zones indexed by free space. Bucket 'b' holds zones
+     * with [2^b, 2^(b+1)) free sectors, bit 'b' of avlb_map is set if
+     * the bucket is not empty */
+    TAILQ_HEAD (avlb_list, ztl_pro_zone)
+			avlb_head[ZTL_PRO_TYPES][ZTL_PRO_BUCKETS];
+    uint32_t avlb_map[ZTL_PRO_TYPES];
+
     pthread_spinlock_t spin;
 };
 
@@ -65,11 +115,21 @@ struct map_md_addr {
     };
 };
 
-int  ztl_pro_grp_init (struct app_group *grp);
+void     ztl_pro_place_init (void);
+uint16_t ztl_pro_place_type (uint16_t level);
+void     ztl_pro_place_death (struct app_zmd_entry *zmde, uint16_t level);
+
+void ztl_pro_reset_wake (void);
+void ztl_pro_grp_budget_init (void);
+void ztl_pro_grp_retire (uint16_t type);
+int  ztl_pro_grp_init (struct app_group *grp, struct xztl_mthread_ctx *tctx);
 void ztl_pro_grp_exit (struct app_group *grp);
 int  ztl_pro_grp_put_zone (struct app_group *grp, uint32_t zone_i);
 int  ztl_pro_grp_finish_zn (struct app_group *grp, uint32_t zid, uint8_t type);
+int  ztl_pro_grp_reset_pool (struct app_group *grp);
+uint32_t ztl_pro_grp_stripe (uint32_t nsec);
 int  ztl_pro_grp_get (struct app_group *grp, struct app_pro_addr *ctx,
-			    uint32_t nsec, uint16_t ptype, uint8_t multi);
+			    uint32_t nsec, uint16_t ptype, uint8_t multi,
+			    uint32_t stripe);
 void ztl_pro_grp_free (struct app_group *grp, uint32_t zone_i,
 					    uint32_t nsec, uint16_t type);
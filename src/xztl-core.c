@@ -18,14 +18,37 @@
 */
 
 #include <syslog.h>
+#include <sched.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <xztl.h>
 #include <xztl-media.h>
 #include <xztl-ztl.h>
-
-struct xztl_core core = {NULL};
+#include <ztl.h>
+
+/* Defaults also apply to layers started without xztl_init (tests) */
+struct xztl_core core = {
+    .media  = NULL,
+    .config = {
+	.pro_stripe     = ZTL_PRO_STRIPE,
+	.wca_sec_mcmd   = ZTL_WCA_SEC_MCMD,
+	.read_sec_mcmd  = ZTL_READ_SEC_MCMD,
+	.nvme_depth     = XZTL_CTX_NVME_DEPTH,
+	.map_buf_pgs    = ZTL_MAP_BUF_PGS,
+	.write_core     = ZTL_WRITE_CORE,
+	.write_affinity = ZTL_WRITE_AFFINITY,
+	.prom_port      = XZTL_PROMETHEUS_PORT,
+	.slow_write_us  = ZTL_WCA_SLOW_USEC,
+	.reset_pool     = ZTL_PRO_RESET_POOL,
+	.coal_max_bytes = ZTL_WCA_COAL_MAX,
+	.coal_usec      = ZTL_WCA_COAL_USEC,
+	.coal_slots     = ZTL_WCA_COAL_SLOTS,
+	.coal_bufs      = ZTL_WCA_COAL_BUFS,
+    },
+    .numa_node = -1,
+};
 
 void xztl_atomic_int8_update (uint8_t *ptr, uint8_t value)
 {
@@ -83,9 +106,22 @@ void xztl_print_mcmd (struct xztl_io_mcmd *cmd)
 
 static xztl_register_media_fn *media_fn = NULL;
 
+/* Buffers prefer the device node when it is known. The policy is set
+ * around the backend allocation, so pages the allocator touches follow it */
 void *xztl_media_dma_alloc (size_t bytes, uint64_t *phys)
 {
-    return core.media->dma_alloc (bytes, phys);
+    struct xztl_numa_policy pol;
+    void *buf;
+    int prefer;
+
+    prefer = !xztl_numa_prefer (core.numa_node, &pol);
+
+    buf = core.media->dma_alloc (bytes, phys);
+
+    if (prefer)
+	xztl_numa_restore (&pol);
+
+    return buf;
 }
 
 void xztl_media_dma_free (void *ptr)
@@ -93,7 +129,8 @@ void xztl_media_dma_free (void *ptr)
     core.media->dma_free (ptr);
 }
 
-int xztl_media_submit_io (struct xztl_io_mcmd *cmd)
+/* Debug printing and statistics are the first layer of every chain */
+static int xztl_media_core_io (struct xztl_io_mcmd *cmd)
 {
     if (ZDEBUG_MEDIA_W && (cmd->opcode == XZTL_CMD_WRITE))
 	xztl_print_mcmd (cmd);
@@ -101,12 +138,121 @@ int xztl_media_submit_io (struct xztl_io_mcmd *cmd)
 	xztl_print_mcmd (cmd);
 
     xztl_stats_add_io (cmd);
-    return core.media->submit_io (cmd);
+
+    return 0;
+}
+
+static struct xztl_media_layer media_layer_core = {
+    .name      = "core",
+    .submit_io = xztl_media_core_io,
+};
+
+/* Per function arrays keep the submission path free of disabled stages */
+struct xztl_media_chain {
+    struct xztl_media_layer *layer[XZTL_MEDIA_LAYERS];
+    xztl_media_io_fn        *submit_io[XZTL_MEDIA_LAYERS];
+    xztl_media_io_done_fn   *io_done[XZTL_MEDIA_LAYERS];
+    xztl_media_zn_fn        *submit_zn[XZTL_MEDIA_LAYERS];
+    xztl_media_zn_done_fn   *zn_done[XZTL_MEDIA_LAYERS];
+    uint32_t nlayers;
+    uint32_t nsubmit_io;
+    uint32_t nio_done;
+    uint32_t nsubmit_zn;
+    uint32_t nzn_done;
+};
+
+static struct xztl_media_chain media_chain = {
+    .layer      = { &media_layer_core },
+    .submit_io  = { xztl_media_core_io },
+    .nlayers    = 1,
+    .nsubmit_io = 1,
+};
+
+static void xztl_media_layer_reset (void)
+{
+    memset (&media_chain, 0x0, sizeof (struct xztl_media_chain));
+    xztl_media_layer_add (&media_layer_core);
+}
+
+int xztl_media_layer_add (struct xztl_media_layer *layer)
+{
+    struct xztl_media_chain *ch = &media_chain;
+
+    if (ch->nlayers == XZTL_MEDIA_LAYERS) {
+	log_erra ("core: Media layer %s not added, chain is full.",
+								layer->name);
+	return XZTL_MEDIA_LAYER_ERR;
+    }
+
+    ch->layer[ch->nlayers++] = layer;
+
+    if (layer->submit_io)
+	ch->submit_io[ch->nsubmit_io++] = layer->submit_io;
+    if (layer->io_done)
+	ch->io_done[ch->nio_done++] = layer->io_done;
+    if (layer->submit_zn)
+	ch->submit_zn[ch->nsubmit_zn++] = layer->submit_zn;
+    if (layer->zn_done)
+	ch->zn_done[ch->nzn_done++] = layer->zn_done;
+
+    log_infoa ("core: Media layer %s added.", layer->name);
+
+    return XZTL_OK;
+}
+
+void xztl_media_io_done (struct xztl_io_mcmd *cmd)
+{
+    uint32_t i = media_chain.nio_done;
+
+    while (i--)
+	media_chain.io_done[i] (cmd);
+}
+
+void xztl_media_zn_done (struct xztl_zn_mcmd *cmd)
+{
+    uint32_t i = media_chain.nzn_done;
+
+    while (i--)
+	media_chain.zn_done[i] (cmd);
+}
+
+int xztl_media_submit_io (struct xztl_io_mcmd *cmd)
+{
+    struct xztl_media_chain *ch = &media_chain;
+    uint8_t synch = cmd->synch;
+    uint32_t i;
+    int ret = 0;
+
+    for (i = 0; i < ch->nsubmit_io && !ret; i++)
+	ret = ch->submit_io[i] (cmd);
+
+    if (!ret)
+	ret = core.media->submit_io (cmd);
+
+    /* Asynchronous completions are reported by the media callback */
+    if (synch || ret)
+	xztl_media_io_done (cmd);
+
+    return ret;
 }
 
 int xztl_media_submit_zn (struct xztl_zn_mcmd *cmd)
 {
-    return core.media->zone_fn (cmd);
+    struct xztl_media_chain *ch = &media_chain;
+    uint8_t asynch = cmd->asynch;
+    uint32_t i;
+    int ret = 0;
+
+    for (i = 0; i < ch->nsubmit_zn && !ret; i++)
+	ret = ch->submit_zn[i] (cmd);
+
+    if (!ret)
+	ret = core.media->zone_fn (cmd);
+
+    if (!asynch || ret)
+	xztl_media_zn_done (cmd);
+
+    return ret;
 }
 
 int xztl_media_submit_misc (struct xztl_misc_cmd *cmd)
@@ -114,6 +260,38 @@ int xztl_media_submit_misc (struct xztl_misc_cmd *cmd)
     return core.media->cmd_exec (cmd);
 }
 
+/* Command sizes set to 0 follow the media transfer limits. Full write
+ * commands are kept aligned to the media write granularity */
+static uint32_t xztl_config_mcmd (const char *name, uint32_t val, int write)
+{
+    struct xztl_mgeo *g = &core.media->geo;
+
+    if (!val) {
+	val = (g->sec_mcmd) ? MIN (g->sec_mcmd, ZTL_SEC_MCMD_MAX) :
+							ZTL_SEC_MCMD_DEF;
+	if (write && g->sec_wgran && val > g->sec_wgran)
+	    val -= val % g->sec_wgran;
+    } else if (g->sec_mcmd && val > g->sec_mcmd) {
+	log_infoa ("core: Config %s %u exceeds media transfer limit. "
+					"Using %u", name, val, g->sec_mcmd);
+	val = g->sec_mcmd;
+    }
+
+    return val;
+}
+
+static void xztl_config_media (void)
+{
+    struct xztl_config *c = &core.config;
+
+    c->wca_sec_mcmd  = xztl_config_mcmd ("wca_sec_mcmd", c->wca_sec_mcmd, 1);
+    c->read_sec_mcmd = xztl_config_mcmd ("read_sec_mcmd",
+							c->read_sec_mcmd, 0);
+
+    log_infoa ("core: Command size. write %u, read %u sectors",
+					c->wca_sec_mcmd, c->read_sec_mcmd);
+}
+
 int xztl_media_init (void)
 {
     if (!core.media)
@@ -122,6 +300,8 @@ int xztl_media_init (void)
     if (!core.media->init_fn)
 	return XZTL_NOINIT;
 
+    xztl_config_media ();
+
     return core.media->init_fn ();
 }
 
@@ -217,6 +397,9 @@ int xztl_exit (void)
     if (ret)
 	log_err ("core: Could not exit media.");
 
+    xztl_trace_exit ();
+    xztl_media_layer_reset ();
+
     xztl_mempool_exit ();
 
     if (core.media) {
@@ -232,7 +415,147 @@ int xztl_exit (void)
     return ret;
 }
 
+void xztl_config_default (struct xztl_config *cfg)
+{
+    cfg->pro_stripe     = ZTL_PRO_STRIPE;
+    cfg->wca_sec_mcmd   = ZTL_WCA_SEC_MCMD;
+    cfg->read_sec_mcmd  = ZTL_READ_SEC_MCMD;
+    cfg->nvme_depth     = XZTL_CTX_NVME_DEPTH;
+    cfg->map_buf_pgs    = ZTL_MAP_BUF_PGS;
+    cfg->write_core     = ZTL_WRITE_CORE;
+    cfg->write_affinity = ZTL_WRITE_AFFINITY;
+    cfg->prom_port      = XZTL_PROMETHEUS_PORT;
+    cfg->slow_write_us  = ZTL_WCA_SLOW_USEC;
+    cfg->reset_pool     = ZTL_PRO_RESET_POOL;
+    cfg->coal_max_bytes = ZTL_WCA_COAL_MAX;
+    cfg->coal_usec      = ZTL_WCA_COAL_USEC;
+    cfg->coal_slots     = ZTL_WCA_COAL_SLOTS;
+    cfg->coal_bufs      = ZTL_WCA_COAL_BUFS;
+    memset (cfg->write_cpus, 0x0, XZTL_CPUS_LEN);
+    memset (cfg->comp_cpus, 0x0, XZTL_CPUS_LEN);
+    memset (cfg->bg_cpus, 0x0, XZTL_CPUS_LEN);
+}
+
+void xztl_config_get (struct xztl_config *cfg)
+{
+    memcpy (cfg, &core.config, sizeof (struct xztl_config));
+}
+
+static int xztl_config_check (const char *name, uint32_t val,
+					    uint32_t min, uint32_t max)
+{
+    if (val < min || val > max) {
+	log_erra ("core: Invalid config %s: %u. Range [%u, %u]",
+						    name, val, min, max);
+	return -1;
+    }
+
+    return 0;
+}
+
+/* Invalid environment values are ignored */
+static void xztl_config_env (const char *name, uint32_t *val,
+					    uint32_t min, uint32_t max)
+{
+    unsigned long env_val;
+    char *str, *end;
+
+    str = getenv (name);
+    if (!str)
+	return;
+
+    env_val = strtoul (str, &end, 0);
+    if (end == str || *end != '\0' || env_val > UINT32_MAX ||
+		    xztl_config_check (name, env_val, min, max))
+	return;
+
+    *val = env_val;
+}
+
+static void xztl_config_env_cpus (const char *name, char *cpus)
+{
+    char *str;
+
+    str = getenv (name);
+    if (!str || strlen (str) >= XZTL_CPUS_LEN ||
+		    xztl_cpus_check (name, str))
+	return;
+
+    strcpy (cpus, str);
+}
+
+static int xztl_config_set (const struct xztl_config *cfg)
+{
+    struct xztl_config *c = &core.config;
+
+    if (cfg)
+	memcpy (c, cfg, sizeof (struct xztl_config));
+    else
+	xztl_config_default (c);
+
+    xztl_config_env ("XZTL_PRO_STRIPE", &c->pro_stripe,
+					    1, APP_PRO_MAX_OFFS / 2);
+    xztl_config_env ("XZTL_WCA_SEC_MCMD", &c->wca_sec_mcmd, 0, 4096);
+    xztl_config_env ("XZTL_READ_SEC_MCMD", &c->read_sec_mcmd, 0, 4096);
+    xztl_config_env ("XZTL_NVME_DEPTH", &c->nvme_depth, 1, 4096);
+    xztl_config_env ("XZTL_MAP_BUF_PGS", &c->map_buf_pgs, 1, 1 << 24);
+    xztl_config_env ("XZTL_WRITE_CORE", &c->write_core, 0, CPU_SETSIZE - 1);
+    xztl_config_env ("XZTL_WRITE_AFFINITY", &c->write_affinity, 0, 1);
+    xztl_config_env ("XZTL_PROM_PORT", &c->prom_port, 0, 65535);
+    xztl_config_env ("XZTL_SLOW_WRITE_US", &c->slow_write_us, 0, UINT32_MAX);
+    xztl_config_env ("XZTL_RESET_POOL", &c->reset_pool, 1, 65536);
+    xztl_config_env ("XZTL_COAL_MAX_BYTES", &c->coal_max_bytes, 0, 1 << 20);
+    xztl_config_env ("XZTL_COAL_USEC", &c->coal_usec, 0, 1000000);
+    xztl_config_env ("XZTL_COAL_SLOTS", &c->coal_slots,
+					    1, ZTL_WCA_COAL_SLOTS_MAX);
+    xztl_config_env ("XZTL_COAL_BUFS", &c->coal_bufs,
+					    2, ZTL_WCA_COAL_BUFS_MAX);
+    xztl_config_env_cpus ("XZTL_WRITE_CPUS", c->write_cpus);
+    xztl_config_env_cpus ("XZTL_COMP_CPUS", c->comp_cpus);
+    xztl_config_env_cpus ("XZTL_BG_CPUS", c->bg_cpus);
+
+    if (xztl_config_check ("pro_stripe", c->pro_stripe,
+					    1, APP_PRO_MAX_OFFS / 2) ||
+	xztl_config_check ("wca_sec_mcmd", c->wca_sec_mcmd, 0, 4096) ||
+	xztl_config_check ("read_sec_mcmd", c->read_sec_mcmd, 0, 4096) ||
+	xztl_config_check ("nvme_depth", c->nvme_depth, 1, 4096) ||
+	xztl_config_check ("map_buf_pgs", c->map_buf_pgs, 1, 1 << 24) ||
+	xztl_config_check ("write_core", c->write_core, 0, CPU_SETSIZE - 1) ||
+	xztl_config_check ("write_affinity", c->write_affinity, 0, 1) ||
+	xztl_config_check ("prom_port", c->prom_port, 0, 65535) ||
+	xztl_config_check ("reset_pool", c->reset_pool, 1, 65536) ||
+	xztl_config_check ("coal_max_bytes", c->coal_max_bytes, 0, 1 << 20) ||
+	xztl_config_check ("coal_usec", c->coal_usec, 0, 1000000) ||
+	xztl_config_check ("coal_slots", c->coal_slots,
+					    1, ZTL_WCA_COAL_SLOTS_MAX) ||
+	xztl_config_check ("coal_bufs", c->coal_bufs,
+				c->coal_slots + 1, ZTL_WCA_COAL_BUFS_MAX) ||
+	xztl_cpus_check ("write_cpus", c->write_cpus) ||
+	xztl_cpus_check ("comp_cpus", c->comp_cpus) ||
+	xztl_cpus_check ("bg_cpus", c->bg_cpus))
+	return XZTL_CONFIG_ERR;
+
+    log_infoa ("core: Config. stripe %u, wca_sec %u, read_sec %u, depth %u, "
+		"map_pgs %u, core %u, affinity %u, prom_port %u, slow_write %u, "
+		"reset_pool %u, coal_max %u, coal_usec %u, coal_slots %u, "
+		"coal_bufs %u",
+		c->pro_stripe, c->wca_sec_mcmd, c->read_sec_mcmd,
+		c->nvme_depth, c->map_buf_pgs, c->write_core,
+		c->write_affinity, c->prom_port, c->slow_write_us,
+		c->reset_pool, c->coal_max_bytes, c->coal_usec,
+		c->coal_slots, c->coal_bufs);
+    log_infoa ("core: Threads. write '%s', completion '%s', background '%s'",
+		c->write_cpus, c->comp_cpus, c->bg_cpus);
+
+    return XZTL_OK;
+}
+
 int xztl_init (const char *dev_name)
+{
+    return xztl_init_config (dev_name, NULL);
+}
+
+int xztl_init_config (const char *dev_name, const struct xztl_config *cfg)
 {
     int ret;
 
@@ -240,6 +563,12 @@ int xztl_init (const char *dev_name)
 
     log_info ("core: Starting xZTL...");
 
+    xztl_time_init ();
+
+    ret = xztl_config_set (cfg);
+    if (ret)
+	return ret;
+
     if (!media_fn)
 	return XZTL_NOMEDIA;
 
@@ -251,27 +580,35 @@ int xztl_init (const char *dev_name)
     if (ret)
 	return ret;
 
+    /* Media layers are in place before any media I/O */
+    if (xztl_trace_init ())
+	log_err ("core: Media trace not started.");
+
     ret = xztl_media_init ();
     if (ret)
-	goto MP;
+	goto TRACE;
 
-    ret = ztl_init ();
+    /* Statistics are started first to keep the values set by the ZTL
+     * startup (e.g. the open zone budget) */
+    ret = xztl_stats_init ();
     if (ret)
 	goto MEDIA;
 
-    ret = xztl_stats_init ();
+    ret = ztl_init ();
     if (ret)
-	goto ZTL;
+	goto STATS;
 
     log_info ("core: xZTL started successfully.");
 
     return XZTL_OK;
 
-ZTL:
-    ztl_exit();
+STATS:
+    xztl_stats_exit ();
 MEDIA:
     xztl_media_exit ();
-MP:
+TRACE:
+    xztl_trace_exit ();
+    xztl_media_layer_reset ();
     xztl_mempool_exit ();
     return ret;
 }
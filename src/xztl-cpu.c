@@ -0,0 +1,382 @@
+/* xZTL: Zone Translation Layer User-space Library
+ *
+ * Copyright 2020 Samsung Electronics
+ *
+ * Written by Ivan L. Picoli <i.picoli@samsung.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+*/
+
+#include <xztl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+
+#define XZTL_SYSFS         "/sys"
+#define XZTL_CPU_SYSFS     XZTL_SYSFS "/devices/system"
+#define XZTL_CPU_BUF       4096
+#define XZTL_CPU_MAX_CACHE 8
+
+extern struct xztl_core core;
+
+static const char *xztl_thread_names[] = {
+    "write", "completion", "background"
+};
+
+/* Parses a CPU list such as "0,2-5" */
+static int xztl_cpu_list (const char *str, cpu_set_t *set)
+{
+    unsigned long first, last;
+    char *end;
+
+    CPU_ZERO (set);
+
+    while (*str && *str != '\n') {
+	if (*str < '0' || *str > '9')
+	    return -1;
+
+	first = last = strtoul (str, &end, 10);
+	if (*end == '-') {
+	    str = end + 1;
+	    if (*str < '0' || *str > '9')
+		return -1;
+	    last = strtoul (str, &end, 10);
+	}
+
+	if (last < first || last >= CPU_SETSIZE)
+	    return -1;
+
+	for (; first <= last; first++)
+	    CPU_SET (first, set);
+
+	str = end;
+	if (*str == ',')
+	    str++;
+	else if (*str && *str != '\n')
+	    return -1;
+    }
+
+    return 0;
+}
+
+static int xztl_cpu_sysfs (const char *path, char *buf)
+{
+    FILE *fp;
+    int ret = 0;
+
+    fp = fopen (path, "r");
+    if (!fp)
+	return -1;
+
+    if (!fgets (buf, XZTL_CPU_BUF, fp))
+	ret = -1;
+
+    fclose (fp);
+    return ret;
+}
+
+/* A CPU list, or "node:N" for the CPUs of NUMA node N */
+static int xztl_cpu_spec (const char *spec, cpu_set_t *set)
+{
+    char path[128], buf[XZTL_CPU_BUF];
+    unsigned long node;
+    char *end;
+
+    if (!strncmp (spec, "node:", 5)) {
+	node = strtoul (spec + 5, &end, 10);
+	if (end == spec + 5 || *end)
+	    return -1;
+
+	snprintf (path, sizeof (path),
+			XZTL_CPU_SYSFS "/node/node%lu/cpulist", node);
+	if (xztl_cpu_sysfs (path, buf))
+	    return -1;
+	spec = buf;
+    }
+
+    if (xztl_cpu_list (spec, set) || !CPU_COUNT (set))
+	return -1;
+
+    return 0;
+}
+
+/* CPUs sharing the L2 cache with cpu, from the unified or data cache */
+static int xztl_cpu_l2 (uint32_t cpu, cpu_set_t *set)
+{
+    char path[128], buf[XZTL_CPU_BUF];
+    uint32_t idx;
+
+    for (idx = 0; idx < XZTL_CPU_MAX_CACHE; idx++) {
+	snprintf (path, sizeof (path),
+		XZTL_CPU_SYSFS "/cpu/cpu%u/cache/index%u/level", cpu, idx);
+	if (xztl_cpu_sysfs (path, buf))
+	    return -1;
+	if (atoi (buf) != 2)
+	    continue;
+
+	snprintf (path, sizeof (path),
+		XZTL_CPU_SYSFS "/cpu/cpu%u/cache/index%u/type", cpu, idx);
+	if (xztl_cpu_sysfs (path, buf) || !strncmp (buf, "Instruction", 11))
+	    continue;
+
+	snprintf (path, sizeof (path), XZTL_CPU_SYSFS
+		"/cpu/cpu%u/cache/index%u/shared_cpu_list", cpu, idx);
+	if (xztl_cpu_sysfs (path, buf))
+	    return -1;
+
+	return xztl_cpu_list (buf, set);
+    }
+
+    return -1;
+}
+
+/* SMT siblings of cpu, including cpu */
+static int xztl_cpu_smt (uint32_t cpu, cpu_set_t *set)
+{
+    char path[128], buf[XZTL_CPU_BUF];
+
+    snprintf (path, sizeof (path), XZTL_CPU_SYSFS
+			"/cpu/cpu%u/topology/thread_siblings_list", cpu);
+    if (xztl_cpu_sysfs (path, buf))
+	return -1;
+
+    return xztl_cpu_list (buf, set);
+}
+
+/* CPUs of the NUMA node holding cpu. Node numbers may have holes, the
+ * online nodes are listed as a CPU list */
+static int xztl_cpu_node (uint32_t cpu, cpu_set_t *set)
+{
+    char path[128], buf[XZTL_CPU_BUF];
+    cpu_set_t nodes;
+    uint32_t node;
+
+    if (xztl_cpu_sysfs (XZTL_CPU_SYSFS "/node/online", buf) ||
+					    xztl_cpu_list (buf, &nodes))
+	return -1;
+
+    for (node = 0; node < CPU_SETSIZE; node++) {
+	if (!CPU_ISSET (node, &nodes))
+	    continue;
+
+	snprintf (path, sizeof (path),
+			XZTL_CPU_SYSFS "/node/node%u/cpulist", node);
+	if (xztl_cpu_sysfs (path, buf))
+	    continue;
+
+	if (!xztl_cpu_list (buf, set) && CPU_ISSET (cpu, set))
+	    return 0;
+    }
+
+    return -1;
+}
+
+static int xztl_cpu_exclude (cpu_set_t *set, const cpu_set_t *excl)
+{
+    uint32_t cpu;
+
+    for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+	if (CPU_ISSET (cpu, excl))
+	    CPU_CLR (cpu, set);
+    }
+
+    return CPU_COUNT (set);
+}
+
+/* Completion threads default to the writer's NUMA node, without the CPUs
+ * sharing an L2 cache or a core (SMT) with any writer CPU */
+static int xztl_cpu_near (const cpu_set_t *wset, cpu_set_t *set)
+{
+    cpu_set_t excl, shared;
+    uint32_t cpu, first = CPU_SETSIZE;
+
+    CPU_ZERO (&excl);
+    CPU_OR (&excl, &excl, wset);
+
+    for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+	if (!CPU_ISSET (cpu, wset))
+	    continue;
+	if (first == CPU_SETSIZE)
+	    first = cpu;
+
+	if (!xztl_cpu_l2 (cpu, &shared))
+	    CPU_OR (&excl, &excl, &shared);
+	if (!xztl_cpu_smt (cpu, &shared))
+	    CPU_OR (&excl, &excl, &shared);
+    }
+
+    if (first == CPU_SETSIZE || xztl_cpu_node (first, set))
+	return -1;
+
+    return (xztl_cpu_exclude (set, &excl)) ? 0 : -1;
+}
+
+int xztl_cpus_check (const char *name, const char *cpus)
+{
+    cpu_set_t set;
+
+    if (!memchr (cpus, '\0', XZTL_CPUS_LEN)) {
+	log_erra ("core: Config %s is too long.", name);
+	return -1;
+    }
+
+    if (*cpus && xztl_cpu_spec (cpus, &set)) {
+	log_erra ("core: Invalid config %s: %s", name, cpus);
+	return -1;
+    }
+
+    return 0;
+}
+
+void xztl_thread_place (uint32_t role)
+{
+    struct xztl_config *c = &core.config;
+    cpu_set_t wset, set;
+    int wvalid = 0;
+
+    if (role >= XZTL_THREAD_ROLES)
+	return;
+
+    if (c->write_cpus[0]) {
+	wvalid = !xztl_cpu_spec (c->write_cpus, &wset);
+    } else if (c->write_affinity) {
+	CPU_ZERO (&wset);
+	CPU_SET (c->write_core, &wset);
+	wvalid = 1;
+    }
+
+    switch (role) {
+	case XZTL_THREAD_WRITE:
+	    if (!wvalid)
+		return;
+	    memcpy (&set, &wset, sizeof (cpu_set_t));
+	    break;
+	case XZTL_THREAD_COMP:
+	    if (c->comp_cpus[0]) {
+		if (xztl_cpu_spec (c->comp_cpus, &set))
+		    return;
+	    } else if (!wvalid || xztl_cpu_near (&wset, &set)) {
+		return;
+	    }
+	    break;
+	case XZTL_THREAD_BG:
+	    if (!c->bg_cpus[0] || xztl_cpu_spec (c->bg_cpus, &set))
+		return;
+	    break;
+    }
+
+    if (pthread_setaffinity_np (pthread_self (), sizeof (cpu_set_t), &set))
+	log_erra ("xztl-cpu: %s thread not placed.", xztl_thread_names[role]);
+}
+
+/* NUMA node of a device opened by path (/dev/nvme0n1, /dev/ng0n1) or by
+ * PCI address (0000:01:00.0). Returns -1 if unknown */
+int xztl_numa_dev_node (const char *dev_name)
+{
+    const char *fmt[] = {
+	XZTL_SYSFS "/block/%s/device/device/numa_node",
+	XZTL_SYSFS "/block/%s/device/numa_node",
+	XZTL_SYSFS "/class/nvme-generic/%s/device/device/numa_node",
+	XZTL_SYSFS "/bus/pci/devices/%s/numa_node",
+    };
+    char name[64], path[192], buf[XZTL_CPU_BUF];
+    const char *base;
+    uint32_t fmt_i;
+
+    base = strrchr (dev_name, '/');
+    base = (base) ? base + 1 : dev_name;
+    if (!strncmp (base, "pci:", 4))
+	base += 4;
+
+    /* Drop URI options such as "?nsid=1" */
+    snprintf (name, sizeof (name), "%.*s", (int) strcspn (base, "?"), base);
+
+    for (fmt_i = 0; fmt_i < sizeof (fmt) / sizeof (fmt[0]); fmt_i++) {
+	snprintf (path, sizeof (path), fmt[fmt_i], name);
+	if (!xztl_cpu_sysfs (path, buf))
+	    return atoi (buf);
+    }
+
+    return -1;
+}
+
+/* Memory of the I/O path follows the device, or else the calling thread */
+int xztl_numa_node (void)
+{
+    unsigned int cpu, node;
+
+    if (core.numa_node >= 0)
+	return core.numa_node;
+
+    if (syscall (SYS_getcpu, &cpu, &node, NULL))
+	return -1;
+
+    return node;
+}
+
+/* Prefers node for the pages fully inside the range. Pages already touched
+ * are not moved, bind before the first write */
+void xztl_numa_bind (void *addr, size_t len, int node)
+{
+    unsigned long mask, pgsz, start, end;
+
+    if (node < 0 || node >= XZTL_NUMA_MAX_NODES)
+	return;
+
+    pgsz  = sysconf (_SC_PAGESIZE);
+    start = ((unsigned long) addr + pgsz - 1) & ~(pgsz - 1);
+    end   = ((unsigned long) addr + len) & ~(pgsz - 1);
+    if (end <= start)
+	return;
+
+    mask = 1UL << node;
+    if (syscall (SYS_mbind, start, end - start, MPOL_PREFERRED, &mask,
+					    XZTL_NUMA_MAX_NODES + 1, 0))
+	log_erra ("xztl-cpu: Memory not bound to node %d.", node);
+}
+
+/* Prefers node for the memory allocated by the calling thread. The previous
+ * policy is kept in old, to be given back to xztl_numa_restore */
+int xztl_numa_prefer (int node, struct xztl_numa_policy *old)
+{
+    unsigned long mask;
+
+    if (node < 0 || node >= XZTL_NUMA_MAX_NODES)
+	return -1;
+
+    old->mask = 0;
+    if (syscall (SYS_get_mempolicy, &old->mode, &old->mask,
+				XZTL_NUMA_MAX_NODES + 1, NULL, 0))
+	return -1;
+
+    mask = 1UL << node;
+    if (syscall (SYS_set_mempolicy, MPOL_PREFERRED, &mask,
+				XZTL_NUMA_MAX_NODES + 1)) {
+	log_erra ("xztl-cpu: Memory policy not set to node %d.", node);
+	return -1;
+    }
+
+    return 0;
+}
+
+void xztl_numa_restore (struct xztl_numa_policy *old)
+{
+    if (syscall (SYS_set_mempolicy, old->mode, &old->mask,
+				XZTL_NUMA_MAX_NODES + 1))
+	log_err ("xztl-cpu: Memory policy not restored.");
+}
@@ -22,7 +22,7 @@
 #include <xztl-media.h>
 #include <xztl-mempool.h>
 
-#define XZTL_CTX_NVME_DEPTH  64
+extern struct xztl_core core;
 
 struct xztl_mthread_ctx *xztl_ctx_media_init (uint16_t tid,
 						     uint32_t depth)
@@ -53,7 +53,7 @@ struct xztl_mthread_ctx *xztl_ctx_media_init (uint16_t tid,
 
     /* Create asynchronous context via xnvme */
     cmd.opcode = XZTL_MISC_ASYNCH_INIT;
-    cmd.asynch.depth   	    = XZTL_CTX_NVME_DEPTH;
+    cmd.asynch.depth   	    = core.config.nvme_depth;
     cmd.asynch.ctx_ptr      = tctx;
 
     ret = xztl_media_submit_misc (&cmd);
@@ -45,6 +45,12 @@ static struct app_group *groups_get (uint16_t grp_id)
     return NULL;
 }
 
+/* Groups are contiguous in the device address space */
+static struct app_group *groups_get_by_offset (uint64_t offset)
+{
+    return groups_get (offset / core.media->geo.sec_grp);
+}
+
 static int groups_get_list (struct app_group **list, uint16_t ngrp)
 {
     int n = 0;
@@ -179,6 +185,7 @@ void ztl_grp_register (void) {
     ztl()->groups.exit_fn     = groups_exit;
     ztl()->groups.get_fn      = groups_get;
     ztl()->groups.get_list_fn = groups_get_list;
+    ztl()->groups.get_by_offset_fn = groups_get_by_offset;
 
     LIST_INIT(&app_grp_head);
 }
@@ -26,13 +26,17 @@
 #include <xztl-mempool.h>
 #include <pthread.h>
 #include <stdbool.h>
+#include <sys/mman.h>
 
 /* Comment this macro for standard spinlock implementation */
 #define MP_LOCKFREE
 
+#define XZTLMP_ALIGN(sz) (((sz) + 63) & ~((size_t) 63))
+
 static struct xztl_mempool xztlmp;
 
-static void xztl_mempool_free (struct xztl_mp_pool_i *pool)
+/* Entries still out of the pool keep the slab mapped */
+static void xztl_mempool_free (struct xztl_mp_pool_i *pool, uint32_t nents)
 {
     struct xztl_mp_entry *ent;
 
@@ -40,15 +44,15 @@ static void xztl_mempool_free (struct xztl_mp_pool_i *pool)
 	ent = STAILQ_FIRST (&pool->head);
 	if (ent) {
 	    STAILQ_REMOVE_HEAD (&pool->head, entry);
-	    if (ent->opaque) {
-		if (!pool->alloc_fn || !pool->free_fn)
-		    free (ent->opaque);
-		else
-		    pool->free_fn (ent->opaque);
-	    }
-	    free (ent);
+	    if (ent->opaque && pool->alloc_fn && pool->free_fn)
+		pool->free_fn (ent->opaque);
+	    nents--;
 	}
     }
+
+    if (pool->slab && !nents)
+	munmap (pool->slab, pool->slab_sz);
+    pool->slab = NULL;
 }
 
 /* This function does not free entries that are out of the pool */
@@ -65,7 +69,7 @@ int xztl_mempool_destroy (uint32_t type, uint16_t tid)
 	return XZTL_OK;
 
     pool->active = 0;
-    xztl_mempool_free (pool);
+    xztl_mempool_free (pool, pool->entries);
     pthread_spin_destroy (&pool->spin);
     pool->alloc_fn = NULL;
     pool->free_fn  = NULL;
@@ -73,11 +77,15 @@ int xztl_mempool_destroy (uint32_t type, uint16_t tid)
     return XZTL_OK;
 }
 
+/* Entries and their data, unless allocated by the user, come from a single
+ * slab placed on the NUMA node given by xztl_numa_node */
 int xztl_mempool_create (uint32_t type, uint16_t tid, uint32_t entries,
 		uint32_t ent_sz, xztl_mp_alloc *alloc, xztl_mp_free *free)
 {
     struct xztl_mp_pool_i *pool;
     struct xztl_mp_entry *ent;
+    size_t ent_stride, opq_stride;
+    char *slab;
     void *opaque;
     uint32_t ent_i;
 
@@ -98,21 +106,41 @@ int xztl_mempool_create (uint32_t type, uint16_t tid, uint32_t entries,
 
     STAILQ_INIT (&pool->head);
 
+    if (!alloc || !free) {
+	alloc = NULL;
+	free  = NULL;
+    }
+
+    ent_stride = XZTLMP_ALIGN (sizeof (struct xztl_mp_entry));
+    opq_stride = (alloc) ? 0 : XZTLMP_ALIGN (ent_sz);
+
+    pool->node     = xztl_numa_node ();
+    pool->slab_sz  = (size_t) entries * (ent_stride + opq_stride);
+    pool->alloc_fn = alloc;
+    pool->free_fn  = free;
+
+    slab = mmap (NULL, pool->slab_sz, PROT_READ | PROT_WRITE,
+				    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (slab == MAP_FAILED) {
+	pthread_spin_destroy (&pool->spin);
+	return XZTL_MP_MEMERROR;
+    }
+    pool->slab = slab;
+
+    /* Pages are placed at first touch, bind before filling the entries */
+    xztl_numa_bind (slab, pool->slab_sz, pool->node);
+
     /* Allocate entries */
     for (ent_i = 0; ent_i < entries; ent_i++) {
-	ent = aligned_alloc (64, sizeof (struct xztl_mp_entry));
-	if (!ent)
-	    goto MEMERR;
+	ent = (struct xztl_mp_entry *) (slab + ent_i * ent_stride);
 
-	if (!alloc || !free)
-	    opaque = aligned_alloc (64, ent_sz);
+	if (!alloc)
+	    opaque = slab + entries * ent_stride + ent_i * opq_stride;
 	else
 	    opaque = alloc (ent_sz);
 
-	if (!opaque) {
-	    free (ent);
+	if (!opaque)
 	    goto MEMERR;
-	}
 
 	ent->tid      = tid;
 	ent->entry_id = ent_i;
@@ -123,22 +151,34 @@ int xztl_mempool_create (uint32_t type, uint16_t tid, uint32_t entries,
 
     pool->entries = entries;
     pool->in_count = pool->out_count = 0;
-    pool->alloc_fn = alloc;
-    pool->free_fn  = free;
     pool->active = 1;
 
     ZDEBUG (ZDEBUG_MP, "mempool (create): type %d, tid %d, ents %d, "
-	    "ent_sz %d\n", type, tid, entries, ent_sz);
+	    "ent_sz %d, node %d\n", type, tid, entries, ent_sz, pool->node);
 
     return XZTL_OK;
 
 MEMERR:
-    xztl_mempool_free (pool);
+    xztl_mempool_free (pool, ent_i);
     pthread_spin_destroy (&pool->spin);
+    pool->alloc_fn = NULL;
+    pool->free_fn  = NULL;
 
     return XZTL_MP_MEMERROR;
 }
 
+int xztl_mempool_free_tid (uint32_t type)
+{
+    int tid;
+
+    for (tid = XZTLMP_THREADS - 1; tid >= 0; tid--) {
+	if (!xztlmp.mp[type].pool[tid].active)
+	    return tid;
+    }
+
+    return -1;
+}
+
 int xztl_mempool_left (uint32_t type, uint16_t tid)
 {
     struct xztl_mp_pool_i *pool;
@@ -0,0 +1,72 @@
+/* xZTL: Zone Translation Layer User-space Library
+ *
+ * Copyright 2020 Samsung Electronics
+ *
+ * Written by Ivan L. Picoli <i.picoli@samsung.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+*/
+
+#include <xztl.h>
+#include <stdint.h>
+#include <limits.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+static inline void xztl_poll_relax (void)
+{
+#if defined(__x86_64__)
+    __builtin_ia32_pause ();
+#endif
+}
+
+void xztl_poll_wake_all (struct xztl_poll *p)
+{
+    syscall (SYS_futex, &p->seq, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+
+/* Called after a poll found no work. The idle count is owned by the poller
+ * and reset when work is found. Parking stops at the next wake or after
+ * park_us, 0 parks until woken */
+void xztl_poll_idle (struct xztl_poll *p, uint32_t key, uint32_t *idle,
+							uint64_t park_us)
+{
+    struct timespec ts, *tsp = NULL;
+
+    if (*idle < XZTL_POLL_SPIN) {
+	(*idle)++;
+	xztl_poll_relax ();
+	return;
+    }
+
+    if (*idle < XZTL_POLL_SPIN + XZTL_POLL_YIELD) {
+	(*idle)++;
+	sched_yield ();
+	return;
+    }
+
+    if (park_us) {
+	ts.tv_sec  = park_us / 1000000;
+	ts.tv_nsec = (park_us % 1000000) * 1000;
+	tsp = &ts;
+    }
+
+    /* A wake after the key was taken changes seq and the wait returns */
+    __atomic_add_fetch (&p->parked, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n (&p->seq, __ATOMIC_SEQ_CST) == key)
+	syscall (SYS_futex, &p->seq, FUTEX_WAIT_PRIVATE, key, tsp, NULL, 0);
+    __atomic_sub_fetch (&p->parked, 1, __ATOMIC_SEQ_CST);
+}
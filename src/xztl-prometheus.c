@@ -17,297 +17,330 @@
  * limitations under the License.
 */
 
+#include <xztl.h>
 #include <stdio.h>
 #include <stdlib.h>
-#include <unistd.h>
-#include <pthread.h>
-#include <time.h>
-#include <xztl.h>
-#include <sys/queue.h>
-#include <xztl-mempool.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <sched.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
 
 extern struct xztl_core core;
 
-struct xztl_prometheus_stats {
-    uint64_t written_bytes;
-    uint64_t read_bytes;
-    uint64_t io_count;
-    uint64_t user_write_bytes;
-    uint64_t zns_write_bytes;
-
-    /* Flushing thread Timing */
-    struct timespec ts_s;
-    struct timespec ts_e;
-    uint64_t us_s;
-    uint64_t us_e;
-
-    /* Flushing latency thread Timing */
-    struct timespec ts_l_s;
-    struct timespec ts_l_e;
-    uint64_t us_l_s;
-    uint64_t us_l_e;
-};
-
-static pthread_t th_flush;
-static struct xztl_prometheus_stats pr_stats;
-static uint8_t xztl_flush_l_running, xztl_flush_running;
+/* Metrics are served in Prometheus text format by a single idle priority
+ * thread listening on localhost. Counters are read from the stats shards at
+ * scrape time, nothing is computed in the I/O path */
 
-/* Latency queue */
+#define XZTL_PROM_POLL_MS   500   /* Exit check interval */
+#define XZTL_PROM_REQ_SZ    1024
+#define XZTL_PROM_BODY_SZ   16384
 
-#define MAX_LATENCY_ENTS 8192
-
-struct latency_entry {
-    uint64_t usec;
-    void *mp_entry;
-    STAILQ_ENTRY (latency_entry) entry;
+struct xztl_prom_metric {
+    const char *name;
+    const char *help;
+    uint8_t     gauge;
 };
 
-static pthread_t latency_tid;
-static pthread_spinlock_t lat_spin;
-STAILQ_HEAD (latency_head, latency_entry) lat_head;
-
-static void xztl_prometheus_file_int64 (const char *fname, uint64_t val)
-{
-    FILE *fp;
+static const struct xztl_prom_metric xztl_prom_metrics[XZTL_STATS_IO_TYPES] = {
+    [XZTL_STATS_READ_BYTES] = {"xztl_media_read_bytes_total",
+					"Bytes read from the media", 0},
+    [XZTL_STATS_APPEND_BYTES] = {"xztl_media_write_bytes_total",
+					"Bytes written to the media", 0},
+    [XZTL_STATS_READ_MCMD] = {"xztl_media_read_commands_total",
+					"Media read commands", 0},
+    [XZTL_STATS_APPEND_MCMD] = {"xztl_media_write_commands_total",
+					"Media write and append commands", 0},
+    [XZTL_STATS_RESET_MCMD] = {"xztl_media_reset_commands_total",
+					"Zone reset commands", 0},
+    [XZTL_STATS_READ_BYTES_U] = {"xztl_user_read_bytes_total",
+					"Bytes read by the user", 0},
+    [XZTL_STATS_APPEND_BYTES_U] = {"xztl_user_write_bytes_total",
+					"Bytes written by the user", 0},
+    [XZTL_STATS_READ_UCMD] = {"xztl_user_read_commands_total",
+					"User read commands", 0},
+    [XZTL_STATS_APPEND_UCMD] = {"xztl_user_write_commands_total",
+					"User write commands", 0},
+    [XZTL_STATS_RECYCLED_BYTES] = {"xztl_recycled_bytes_total",
+					"Bytes recycled by garbage collection", 0},
+    [XZTL_STATS_RECYCLED_ZONES] = {"xztl_recycled_zones_total",
+					"Zones recycled by garbage collection", 0},
+    [XZTL_STATS_COPY_BYTES] = {"xztl_copy_bytes_total",
+					"Bytes moved by copy commands", 0},
+    [XZTL_STATS_COPY_MCMD] = {"xztl_copy_commands_total",
+					"Media copy commands", 0},
+    [XZTL_STATS_OPEN_ZONES] = {"xztl_open_zones",
+					"Zones currently open", 1},
+    [XZTL_STATS_OPEN_BUDGET] = {"xztl_open_zones_budget",
+					"Open zone budget", 1},
+    [XZTL_STATS_OPEN_FINISH] = {"xztl_open_zones_finished_total",
+					"Zones finished to respect the budget", 0},
+    [XZTL_STATS_COAL_UCMD] = {"xztl_coalesced_user_commands_total",
+					"Small writes coalesced", 0},
+    [XZTL_STATS_COAL_MCMD] = {"xztl_coalesced_media_commands_total",
+					"Media commands of coalesced writes", 0},
+};
 
-    fp = fopen(fname, "w+");
-    if (fp) {
-	fprintf(fp, "%lu", val);
-	fclose(fp);
-    }
-}
+static const char *xztl_prom_lat_ops[XZTL_STATS_LAT_TYPES] = {
+    [XZTL_STATS_LAT_READ]   = "read",
+    [XZTL_STATS_LAT_WRITE]  = "write",
+    [XZTL_STATS_LAT_APPEND] = "append",
+    [XZTL_STATS_LAT_RESET]  = "reset",
+    [XZTL_STATS_LAT_FINISH] = "finish",
+    [XZTL_STATS_LAT_W_QUEUE]   = "write_queue",
+    [XZTL_STATS_LAT_W_PROV]    = "write_provision",
+    [XZTL_STATS_LAT_W_SUBMIT]  = "write_submit",
+    [XZTL_STATS_LAT_W_DEVICE]  = "write_device",
+    [XZTL_STATS_LAT_W_HANDOFF] = "write_handoff",
+    [XZTL_STATS_LAT_W_MAP]     = "write_map",
+    [XZTL_STATS_LAT_W_TOTAL]   = "write_total",
+};
 
-static void xztl_prometheus_file_double (const char *fname, double val)
-{
-    FILE *fp;
+struct xztl_prom_body {
+    char    buf[XZTL_PROM_BODY_SZ];
+    size_t  len;
+    uint8_t full;   /* A record did not fit, the following are dropped */
+};
 
-    fp = fopen(fname, "w+");
-    if (fp) {
-	fprintf(fp, "%.6lf", val);
-	fclose(fp);
-    }
-}
+static struct xztl_prom_body prom_body;
+static pthread_t prom_tid;
+static int prom_sock = -1;
+static volatile uint8_t prom_running;
 
-static void xztl_prometheus_reset (void)
+static void xztl_prometheus_printf (struct xztl_prom_body *body,
+						    const char *fmt, ...)
 {
-    uint64_t write, read, io;
-    double thput_w, thput_r, thput, wa;
-
-    GET_MICROSECONDS(pr_stats.us_s, pr_stats.ts_s);
+    size_t left;
+    va_list ap;
+    int ret;
 
-    write = pr_stats.written_bytes;
-    read  = pr_stats.read_bytes;
-    io    = pr_stats.io_count;
+    if (body->full)
+	return;
 
-    xztl_atomic_int64_update (&pr_stats.written_bytes, 0);
-    xztl_atomic_int64_update (&pr_stats.read_bytes, 0);
-    xztl_atomic_int64_update (&pr_stats.io_count, 0);
+    left = XZTL_PROM_BODY_SZ - body->len;
 
-    thput_w = (double) write / (double) 1048576;
-    thput_r = (double) read / (double) 1048576;
-    thput   = thput_w + thput_r;
+    va_start (ap, fmt);
+    ret = vsnprintf (body->buf + body->len, left, fmt, ap);
+    va_end (ap);
 
-    if (pr_stats.user_write_bytes) {
-	wa  = (double) pr_stats.zns_write_bytes /
-	      (double) pr_stats.user_write_bytes;
-    } else {
-	wa  = 1;
+    /* Truncated records are dropped, the body keeps whole lines only */
+    if (ret < 0 || (size_t) ret >= left) {
+	body->buf[body->len] = '\0';
+	body->full = 1;
+	log_erra ("xztl-prometheus: Metrics truncated at %lu bytes.",
+							    body->len);
+	return;
     }
 
-    xztl_prometheus_file_double("/tmp/ztl_prometheus_thput_w", thput_w);
-    xztl_prometheus_file_double("/tmp/ztl_prometheus_thput_r", thput_r);
-    xztl_prometheus_file_double("/tmp/ztl_prometheus_thput", thput);
-    xztl_prometheus_file_int64 ("/tmp/ztl_prometheus_iops", io);
-    xztl_prometheus_file_double("/tmp/ztl_prometheus_wamp_ztl", wa);
+    body->len += ret;
 }
 
-void *xztl_prometheus_flush (void *arg)
+static void xztl_prometheus_render (struct xztl_prom_body *body)
 {
-    GET_MICROSECONDS(pr_stats.us_s, pr_stats.ts_s);
-
-    xztl_flush_running++;
-    while (xztl_flush_running) {
-	usleep(1);
-	GET_MICROSECONDS(pr_stats.us_e, pr_stats.ts_e);
-
-	if (pr_stats.us_e - pr_stats.us_s >= 1000000) {
-	    xztl_prometheus_reset();
-	}
+    const struct xztl_prom_metric *m;
+    struct xztl_stats_lat lat[XZTL_STATS_LAT_TYPES];
+    uint64_t user_w, zns_w;
+    uint32_t type_i;
+    const char *op;
+
+    body->len  = 0;
+    body->full = 0;
+
+    for (type_i = 0; type_i < XZTL_STATS_IO_TYPES; type_i++) {
+	m = &xztl_prom_metrics[type_i];
+	if (!m->name)
+	    continue;
+
+	xztl_prometheus_printf (body, "# HELP %s %s\n# TYPE %s %s\n%s %lu\n",
+				m->name, m->help, m->name,
+				(m->gauge) ? "gauge" : "counter",
+				m->name, xztl_stats_get (type_i));
     }
 
-    while (pr_stats.us_e - pr_stats.us_s < 1000000) {
-	GET_MICROSECONDS(pr_stats.us_e, pr_stats.ts_e);
+    zns_w  = xztl_stats_get (XZTL_STATS_APPEND_BYTES);
+    user_w = xztl_stats_get (XZTL_STATS_APPEND_BYTES_U);
+
+    xztl_prometheus_printf (body, "# HELP xztl_write_amplification "
+			    "Media bytes written per user byte\n"
+			    "# TYPE xztl_write_amplification gauge\n"
+			    "xztl_write_amplification %.6lf\n",
+			    (user_w) ? (double) zns_w / (double) user_w : 1);
+
+    xztl_prometheus_printf (body, "# HELP xztl_latency_usec "
+			    "Media command and write stage latency (usec)\n"
+			    "# TYPE xztl_latency_usec summary\n");
+
+    for (type_i = 0; type_i < XZTL_STATS_LAT_TYPES; type_i++) {
+	op = xztl_prom_lat_ops[type_i];
+	xztl_stats_lat_get (type_i, &lat[type_i]);
+
+	xztl_prometheus_printf (body,
+		"xztl_latency_usec{op=\"%s\",quantile=\"0.5\"} %lu\n"
+		"xztl_latency_usec{op=\"%s\",quantile=\"0.99\"} %lu\n"
+		"xztl_latency_usec{op=\"%s\",quantile=\"0.999\"} %lu\n"
+		"xztl_latency_usec_sum{op=\"%s\"} %lu\n"
+		"xztl_latency_usec_count{op=\"%s\"} %lu\n",
+		op, lat[type_i].p50, op, lat[type_i].p99, op, lat[type_i].p999,
+		op, lat[type_i].sum, op, lat[type_i].count);
     }
-    xztl_prometheus_reset();
 
-    return NULL;
+    xztl_prometheus_printf (body, "# HELP xztl_latency_usec_max "
+			    "Highest media command and write stage latency "
+			    "(usec)\n"
+			    "# TYPE xztl_latency_usec_max gauge\n");
+
+    for (type_i = 0; type_i < XZTL_STATS_LAT_TYPES; type_i++)
+	xztl_prometheus_printf (body, "xztl_latency_usec_max{op=\"%s\"} %lu\n",
+				xztl_prom_lat_ops[type_i], lat[type_i].max);
 }
 
-void xztl_prometheus_add_io (struct xztl_io_mcmd *cmd)
+static int xztl_prometheus_send (int fd, const char *buf, size_t len)
 {
-    uint32_t nsec = 0, i;
-
-    for (i = 0; i < cmd->naddr; i++)
-	nsec += cmd->nsec[i];
-
-    switch (cmd->opcode) {
-	case XZTL_ZONE_APPEND:
-	case XZTL_CMD_WRITE:
-	    xztl_atomic_int64_update (&pr_stats.written_bytes,
-				      pr_stats.written_bytes +
-				      (nsec * core.media->geo.nbytes));
-	    break;
-	case XZTL_CMD_READ:
-	    xztl_atomic_int64_update (&pr_stats.read_bytes,
-				      pr_stats.read_bytes +
-				      (nsec * core.media->geo.nbytes));
-	    break;
-	default:
-	    return;
+    ssize_t ret;
+
+    while (len) {
+	ret = send (fd, buf, len, MSG_NOSIGNAL);
+	if (ret < 0) {
+	    if (errno == EINTR)
+		continue;
+	    return -1;
+	}
+	buf += ret;
+	len -= ret;
     }
 
-    xztl_atomic_int64_update (&pr_stats.io_count, pr_stats.io_count + 1);
-}
-
-void xztl_prometheus_add_wa (uint64_t user_writes, uint64_t zns_writes)
-{
-    xztl_atomic_int64_update (&pr_stats.user_write_bytes, user_writes);
-    xztl_atomic_int64_update (&pr_stats.zns_write_bytes, zns_writes);
+    return 0;
 }
 
-static void xztl_prometheus_flush_latency (void)
+static void xztl_prometheus_serve (int fd)
 {
-    FILE *fp;
-    int dequeued = 0;
-    struct latency_entry *ent;
-    uint64_t lat;
+    struct timeval tv = { .tv_sec = 1, .tv_usec = 0 };
+    char req[XZTL_PROM_REQ_SZ], hdr[128];
+    size_t len = 0;
+    ssize_t ret;
+    int hlen;
+
+    setsockopt (fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof (tv));
+
+    /* Only the request line is used, headers are read and dropped */
+    while (len < XZTL_PROM_REQ_SZ - 1) {
+	ret = recv (fd, req + len, XZTL_PROM_REQ_SZ - 1 - len, 0);
+	if (ret <= 0)
+	    break;
+	len += ret;
+	req[len] = '\0';
+	if (strstr (req, "\r\n\r\n") || strstr (req, "\n\n"))
+	    break;
+    }
+    req[len] = '\0';
 
-    GET_MICROSECONDS(pr_stats.us_l_s, pr_stats.ts_l_s);
+    if (strncmp (req, "GET /metrics ", 13) &&
+	strncmp (req, "GET /metrics?", 13)) {
+	hlen = snprintf (hdr, sizeof (hdr), "HTTP/1.1 404 Not Found\r\n"
+			"Content-Length: 0\r\nConnection: close\r\n\r\n");
+	xztl_prometheus_send (fd, hdr, hlen);
+	return;
+    }
 
-    fp = fopen("/tmp/ztl_prometheus_read_lat", "w");
-    if (fp) {
-	while (!STAILQ_EMPTY(&lat_head) || dequeued < MAX_LATENCY_ENTS) {
+    xztl_prometheus_render (&prom_body);
 
-	    pthread_spin_lock (&lat_spin);
+    hlen = snprintf (hdr, sizeof (hdr), "HTTP/1.1 200 OK\r\n"
+		    "Content-Type: text/plain; version=0.0.4\r\n"
+		    "Content-Length: %lu\r\nConnection: close\r\n\r\n",
+		    prom_body.len);
 
-	    ent = STAILQ_FIRST(&lat_head);
-	    if (ent) {
-		lat = ent->usec;
-		STAILQ_REMOVE_HEAD (&lat_head, entry);
-		xztl_mempool_put (ent->mp_entry, XZTL_PROMETHEUS_LAT, 0);
+    if (!xztl_prometheus_send (fd, hdr, hlen))
+	xztl_prometheus_send (fd, prom_body.buf, prom_body.len);
+}
 
-		pthread_spin_unlock (&lat_spin);
+static void *xztl_prometheus_th (void *arg)
+{
+    struct sched_param sp = { .sched_priority = 0 };
+    struct pollfd pfd;
+    int fd;
 
-		fprintf(fp, "%lu\n", lat);
-//		if (ent->usec > 10000)
-//		    printf("TOO HIGH LATENCY (flush): %lu\n", ent->usec);
-	    } else {
-		pthread_spin_unlock (&lat_spin);
-	    }
-	    dequeued++;
+    xztl_thread_place (XZTL_THREAD_BG);
 
-	}
+    /* Scrapes are rare, stay out of the way of the I/O threads */
+    if (pthread_setschedparam (pthread_self (), SCHED_IDLE, &sp))
+	log_err ("xztl-prometheus: Idle priority not set.");
 
-	fclose(fp);
-    }
-}
+    pfd.fd = prom_sock;
+    pfd.events = POLLIN;
 
-void *xztl_prometheus_latency_th (void *arg)
-{
-    GET_MICROSECONDS(pr_stats.us_l_s, pr_stats.ts_l_s);
+    while (prom_running) {
+	if (poll (&pfd, 1, XZTL_PROM_POLL_MS) <= 0)
+	    continue;
 
-    xztl_flush_l_running++;
-    while (xztl_flush_l_running) {
-	usleep(1);
-	GET_MICROSECONDS(pr_stats.us_l_e, pr_stats.ts_l_e);
+	fd = accept (prom_sock, NULL, NULL);
+	if (fd < 0)
+	    continue;
 
-	if ((xztl_mempool_left (XZTL_PROMETHEUS_LAT, 0) < 512) ||
-	    (pr_stats.us_l_e - pr_stats.us_l_s >= 1000000)) {
-	    xztl_prometheus_flush_latency();
-	}
+	xztl_prometheus_serve (fd);
+	close (fd);
     }
 
-    xztl_prometheus_flush_latency();
-
     return NULL;
-
 }
 
-void xztl_prometheus_add_read_latency (uint64_t usec)
+void xztl_prometheus_exit (void)
 {
-    struct xztl_mp_entry *mp_ent;
-    struct latency_entry *ent;
-
-    pthread_spin_lock (&lat_spin);
-
-    /* Discard latency if queue is full */
-    if (xztl_mempool_left (XZTL_PROMETHEUS_LAT, 0) == 0)
+    if (prom_sock < 0)
 	return;
 
-    mp_ent = xztl_mempool_get (XZTL_PROMETHEUS_LAT, 0);
-    ent = (struct latency_entry *) mp_ent->opaque;
-    ent->mp_entry = mp_ent;
-    ent->usec = usec;
-
-    STAILQ_INSERT_TAIL (&lat_head, ent, entry);
-
-    pthread_spin_unlock (&lat_spin);
-
-//    if (usec > 10000)
-//	printf("TOO HIGH LATENCY (add): %lu\n", usec);
+    prom_running = 0;
+    pthread_join (prom_tid, NULL);
+    close (prom_sock);
+    prom_sock = -1;
 }
 
-void xztl_prometheus_exit (void)
+/* The endpoint is optional, failing to listen does not stop xZTL */
+int xztl_prometheus_init (void)
 {
-    xztl_flush_running = 0;
-    xztl_flush_l_running = 0;
-    pthread_join(th_flush, NULL);
-    pthread_join(latency_tid, NULL);
-    xztl_mempool_destroy (XZTL_PROMETHEUS_LAT, 0);
-    pthread_spin_destroy (&lat_spin);
-}
-
-int xztl_prometheus_init (void) {
-    int ret;
+    struct sockaddr_in addr;
+    int opt = 1;
 
-    memset(&pr_stats, 0, sizeof(struct xztl_prometheus_stats));
+    if (!core.config.prom_port)
+	return 0;
 
-    /* Create layency memory pool and queue */
-    STAILQ_INIT (&lat_head);
+    prom_sock = socket (AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (prom_sock < 0) {
+	log_err ("xztl-prometheus: Socket not created.");
+	return 0;
+    }
 
-    if (pthread_spin_init (&lat_spin, 0))
-	return -1;
+    setsockopt (prom_sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof (opt));
 
-    ret = xztl_mempool_create (XZTL_PROMETHEUS_LAT, 0, MAX_LATENCY_ENTS,
-			       sizeof(struct latency_entry), NULL, NULL);
-    if (ret) {
-	log_err("xztl-prometheus: Latency memory pool not started.");
-	goto SPIN;
-    }
+    memset (&addr, 0x0, sizeof (struct sockaddr_in));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+    addr.sin_port = htons (core.config.prom_port);
 
-    xztl_flush_l_running = 0;
-    if (pthread_create(&latency_tid, NULL, xztl_prometheus_latency_th, NULL)) {
-	log_err("xztl-prometheus: Flushing latency thread not started.");
-	goto MP;
+    if (bind (prom_sock, (struct sockaddr *) &addr, sizeof (addr)) ||
+	listen (prom_sock, 4)) {
+	log_erra ("xztl-prometheus: Port %u not available.",
+						core.config.prom_port);
+	goto SOCK;
     }
 
-    xztl_flush_running = 0;
-    if (pthread_create(&th_flush, NULL, xztl_prometheus_flush, NULL)) {
-	log_err("xztl-prometheus: Flushing thread not started.");
-	goto LAT_TH;
+    prom_running = 1;
+    if (pthread_create (&prom_tid, NULL, xztl_prometheus_th, NULL)) {
+	log_err ("xztl-prometheus: Metrics thread not started.");
+	goto SOCK;
     }
 
-    while (!xztl_flush_running || !xztl_flush_l_running) {}
+    log_infoa ("xztl-prometheus: Serving /metrics on 127.0.0.1:%u",
+						core.config.prom_port);
 
     return 0;
 
-LAT_TH:
-    while (!xztl_flush_l_running) {}
-    xztl_flush_l_running = 0;
-    pthread_join(th_flush, NULL);
-MP:
-    xztl_mempool_destroy (XZTL_PROMETHEUS_LAT, 0);
-SPIN:
-    pthread_spin_destroy (&lat_spin);
-    return -1;
+SOCK:
+    prom_running = 0;
+    close (prom_sock);
+    prom_sock = -1;
+    return 0;
 }
@@ -23,15 +23,94 @@
 #include <string.h>
 #include <xztl.h>
 
-#define XZTL_STATS_IO_TYPES 11
+#define XZTL_STATS_SHARDS   64
+
+/* Latency histograms are log-linear (HDR style). Values below
+ * XZTL_STATS_LAT_SUB are exact, above it each power of 2 is split in
+ * XZTL_STATS_LAT_SUB / 2 buckets, giving ~3% precision up to 2^32 usec */
+#define XZTL_STATS_LAT_BITS  6
+#define XZTL_STATS_LAT_SUB   (1 << XZTL_STATS_LAT_BITS)
+#define XZTL_STATS_LAT_BKTS  (XZTL_STATS_LAT_SUB + \
+			     (32 - XZTL_STATS_LAT_BITS) * XZTL_STATS_LAT_SUB / 2)
 
 extern struct xztl_core core;
 
-struct xztl_stats_data {
+struct xztl_stats_hist {
+    uint64_t bkt[XZTL_STATS_LAT_BKTS];
+    uint64_t sum;
+    uint64_t max;
+};
+
+/* Counters are sharded per thread and padded to cache lines, so the I/O path
+ * does not share lines across threads. Readers add up the shards. Gauges
+ * hold the last value set and are not sharded */
+struct xztl_stats_shard {
     uint64_t io[XZTL_STATS_IO_TYPES];
+    struct xztl_stats_hist lat[XZTL_STATS_LAT_TYPES];
+} __attribute__((aligned (64)));
+
+struct xztl_stats_data {
+    struct xztl_stats_shard shard[XZTL_STATS_SHARDS];
+    uint64_t base[XZTL_STATS_IO_TYPES];  /* Counter values at last reset */
+    uint64_t gauge[XZTL_STATS_IO_TYPES];
 };
 
 static struct xztl_stats_data xztl_stats;
+static uint32_t xztl_stats_nthreads;
+static __thread int32_t xztl_stats_tid = -1;
+
+static int xztl_stats_is_gauge (uint32_t type)
+{
+    return (type == XZTL_STATS_OPEN_ZONES || type == XZTL_STATS_OPEN_BUDGET);
+}
+
+static struct xztl_stats_shard *xztl_stats_shard (void)
+{
+    if (xztl_stats_tid < 0)
+	xztl_stats_tid = __sync_fetch_and_add (&xztl_stats_nthreads, 1) %
+							    XZTL_STATS_SHARDS;
+
+    return &xztl_stats.shard[xztl_stats_tid];
+}
+
+static uint64_t xztl_stats_sum (uint32_t type)
+{
+    uint64_t val = 0;
+    uint32_t shard_i;
+
+    for (shard_i = 0; shard_i < XZTL_STATS_SHARDS; shard_i++)
+	val += xztl_stats.shard[shard_i].io[type];
+
+    return val;
+}
+
+uint64_t xztl_stats_get (uint32_t type)
+{
+    if (xztl_stats_is_gauge (type))
+	return xztl_stats.gauge[type];
+
+    return xztl_stats_sum (type) - xztl_stats.base[type];
+}
+
+static void xztl_stats_print_lat (void)
+{
+    static const char *names[XZTL_STATS_LAT_TYPES] = {
+	"read", "write", "append", "reset", "finish",
+	"w-queue", "w-prov", "w-submit", "w-device", "w-handoff", "w-map",
+	"w-total"
+    };
+    struct xztl_stats_lat lat;
+    uint32_t type_i;
+
+    printf ("\n Latency (usec)  count         p50      p99    p99.9"
+							    "      max\n");
+
+    for (type_i = 0; type_i < XZTL_STATS_LAT_TYPES; type_i++) {
+	xztl_stats_lat_get (type_i, &lat);
+	printf ("   %-8s %12lu %9lu %8lu %8lu %8lu\n", names[type_i],
+			lat.count, lat.p50, lat.p99, lat.p999, lat.max);
+    }
+}
 
 void xztl_stats_print_io (void)
 {
@@ -39,16 +118,26 @@ void xztl_stats_print_io (void)
     double wa;
 
     printf ("\n User I/O commands\n");
-    printf ("   write  : %lu\n", xztl_stats.io[XZTL_STATS_APPEND_UCMD]);
-    printf ("   read   : %lu\n", xztl_stats.io[XZTL_STATS_READ_UCMD]);
+    printf ("   write  : %lu\n", xztl_stats_get (XZTL_STATS_APPEND_UCMD));
+    printf ("   read   : %lu\n", xztl_stats_get (XZTL_STATS_READ_UCMD));
 
     printf ("\n Media I/O commands\n");
-    printf ("   append : %lu\n", xztl_stats.io[XZTL_STATS_APPEND_MCMD]);
-    printf ("   read   : %lu\n", xztl_stats.io[XZTL_STATS_READ_MCMD]);
-    printf ("   reset  : %lu\n", xztl_stats.io[XZTL_STATS_RESET_MCMD]);
-
-    tot_b_r = xztl_stats.io[XZTL_STATS_READ_BYTES_U];
-    tot_b_w = xztl_stats.io[XZTL_STATS_APPEND_BYTES_U];
+    printf ("   append : %lu\n", xztl_stats_get (XZTL_STATS_APPEND_MCMD));
+    printf ("   read   : %lu\n", xztl_stats_get (XZTL_STATS_READ_MCMD));
+    printf ("   reset  : %lu\n", xztl_stats_get (XZTL_STATS_RESET_MCMD));
+    printf ("   copy   : %lu\n", xztl_stats_get (XZTL_STATS_COPY_MCMD));
+
+    printf ("\n Coalesced writes: %lu (user commands %lu)\n",
+				xztl_stats_get (XZTL_STATS_COAL_MCMD),
+				xztl_stats_get (XZTL_STATS_COAL_UCMD));
+
+    printf ("\n Open zones: %lu (budget %lu, finished under pressure %lu)\n",
+				xztl_stats_get (XZTL_STATS_OPEN_ZONES),
+				xztl_stats_get (XZTL_STATS_OPEN_BUDGET),
+				xztl_stats_get (XZTL_STATS_OPEN_FINISH));
+
+    tot_b_r = xztl_stats_get (XZTL_STATS_READ_BYTES_U);
+    tot_b_w = xztl_stats_get (XZTL_STATS_APPEND_BYTES_U);
     tot_b = tot_b_w + tot_b_r;
 
     wa = tot_b_w;
@@ -60,8 +149,8 @@ void xztl_stats_print_io (void)
     printf ("   data read        : %10.2lf MB (%lu bytes)\n",
                 (double) tot_b_r / (double) 1048576, (uint64_t) tot_b_r);
 
-    tot_b_r = xztl_stats.io[XZTL_STATS_READ_BYTES];
-    tot_b_w = xztl_stats.io[XZTL_STATS_APPEND_BYTES];
+    tot_b_r = xztl_stats_get (XZTL_STATS_READ_BYTES);
+    tot_b_w = xztl_stats_get (XZTL_STATS_APPEND_BYTES);
     tot_b = tot_b_w + tot_b_r;
 
     wa = (double) tot_b_w / wa;
@@ -74,6 +163,8 @@ void xztl_stats_print_io (void)
                 (double) tot_b_r / (double) 1048576, (uint64_t) tot_b_r);
 
     printf ("\n Write Amplification: %.6lf\n", wa);
+
+    xztl_stats_print_lat ();
 }
 
 void xztl_stats_print_io_simple (void)
@@ -81,8 +172,8 @@ void xztl_stats_print_io_simple (void)
     uint64_t flush_w, app_w, padding_w;
     FILE *fp;
 
-    flush_w = xztl_stats.io[XZTL_STATS_APPEND_BYTES];
-    app_w = xztl_stats.io[XZTL_STATS_APPEND_BYTES_U];
+    flush_w = xztl_stats_get (XZTL_STATS_APPEND_BYTES);
+    app_w = xztl_stats_get (XZTL_STATS_APPEND_BYTES_U);
     padding_w = flush_w - app_w;
 
     printf("\nZTL Application Writes : %.2f MB (%lu bytes)\n",
@@ -93,10 +184,20 @@ void xztl_stats_print_io_simple (void)
 				    flush_w / (double) 1048576, flush_w);
     printf("ZTL write-amplification: %.6lf\n", (double) flush_w / (double) app_w);
     printf("\nRecycled Zones: %lu (%.2f MB, %lu bytes)\n",
-	xztl_stats.io[XZTL_STATS_RECYCLED_ZONES],
-	xztl_stats.io[XZTL_STATS_RECYCLED_BYTES] / (double) 1048576,
-	xztl_stats.io[XZTL_STATS_RECYCLED_BYTES]);
-    printf("Zone Resets   : %lu\n", xztl_stats.io[XZTL_STATS_RESET_MCMD]);
+	xztl_stats_get (XZTL_STATS_RECYCLED_ZONES),
+	xztl_stats_get (XZTL_STATS_RECYCLED_BYTES) / (double) 1048576,
+	xztl_stats_get (XZTL_STATS_RECYCLED_BYTES));
+    printf("Zone Resets   : %lu\n", xztl_stats_get (XZTL_STATS_RESET_MCMD));
+    printf("Copied Data   : %.2f MB (%lu bytes)\n",
+	xztl_stats_get (XZTL_STATS_COPY_BYTES) / (double) 1048576,
+	xztl_stats_get (XZTL_STATS_COPY_BYTES));
+    printf("Open Zones    : %lu (budget %lu, finished under pressure %lu)\n",
+	xztl_stats_get (XZTL_STATS_OPEN_ZONES),
+	xztl_stats_get (XZTL_STATS_OPEN_BUDGET),
+	xztl_stats_get (XZTL_STATS_OPEN_FINISH));
+    printf("Coalesced     : %lu writes (%lu user commands)\n",
+	xztl_stats_get (XZTL_STATS_COAL_MCMD),
+	xztl_stats_get (XZTL_STATS_COAL_UCMD));
     printf("\n");
 
     fp = fopen ("/tmp/ztl_written_bytes", "w+");
@@ -114,6 +215,7 @@ void xztl_stats_print_io_simple (void)
 
 void xztl_stats_add_io (struct xztl_io_mcmd *cmd)
 {
+    struct xztl_stats_shard *shard;
     uint32_t nsec = 0, type_b, type_c, i;
 
     for (i = 0; i < cmd->naddr; i++)
@@ -129,42 +231,152 @@ void xztl_stats_add_io (struct xztl_io_mcmd *cmd)
 	    type_b = XZTL_STATS_READ_BYTES;
 	    type_c = XZTL_STATS_READ_MCMD;
 	    break;
+	case XZTL_CMD_COPY:
+	    type_b = XZTL_STATS_COPY_BYTES;
+	    type_c = XZTL_STATS_COPY_MCMD;
+	    break;
 	default:
 	    return;
 
     }
 
-    xztl_atomic_int64_update (&xztl_stats.io[type_c],
-					xztl_stats.io[type_c] + 1);
-    xztl_atomic_int64_update (&xztl_stats.io[type_b],
-		xztl_stats.io[type_b] + (nsec * core.media->geo.nbytes));
-
-#if XZTL_PROMETHEUS
-    /* Prometheus */
-    xztl_prometheus_add_io (cmd);
-#endif
+    shard = xztl_stats_shard ();
+    __sync_fetch_and_add (&shard->io[type_c], 1);
+    __sync_fetch_and_add (&shard->io[type_b],
+			    (uint64_t) nsec * core.media->geo.nbytes);
 }
 
 void xztl_stats_inc (uint32_t type, uint64_t val)
 {
-    xztl_atomic_int64_update (&xztl_stats.io[type],
-			       xztl_stats.io[type] + val);
+    __sync_fetch_and_add (&xztl_stats_shard ()->io[type], val);
+}
 
-#if XZTL_PROMETHEUS
-    /* Prometheus */
-    if (type == XZTL_STATS_APPEND_BYTES_U) {
-	xztl_prometheus_add_wa(xztl_stats.io[XZTL_STATS_APPEND_BYTES_U],
-			       xztl_stats.io[XZTL_STATS_APPEND_BYTES]);
+static uint32_t xztl_stats_lat_bkt (uint64_t usec)
+{
+    uint32_t msb;
+
+    if (usec < XZTL_STATS_LAT_SUB)
+	return usec;
+
+    if (usec > UINT32_MAX)
+	return XZTL_STATS_LAT_BKTS - 1;
+
+    msb = 63 - __builtin_clzll (usec);
+
+    return XZTL_STATS_LAT_SUB +
+	   (msb - XZTL_STATS_LAT_BITS) * (XZTL_STATS_LAT_SUB / 2) +
+	   ((usec >> (msb - XZTL_STATS_LAT_BITS + 1)) &
+						(XZTL_STATS_LAT_SUB / 2 - 1));
+}
+
+/* Highest value counted in a bucket */
+static uint64_t xztl_stats_lat_val (uint32_t bkt)
+{
+    uint32_t mag, sub;
+
+    if (bkt < XZTL_STATS_LAT_SUB)
+	return bkt;
+
+    mag = (bkt - XZTL_STATS_LAT_SUB) / (XZTL_STATS_LAT_SUB / 2) +
+							    XZTL_STATS_LAT_BITS;
+    sub = (bkt - XZTL_STATS_LAT_SUB) % (XZTL_STATS_LAT_SUB / 2) +
+						    XZTL_STATS_LAT_SUB / 2;
+
+    return (((uint64_t) sub + 1) << (mag - XZTL_STATS_LAT_BITS + 1)) - 1;
+}
+
+void xztl_stats_lat_add (uint32_t type, uint64_t usec)
+{
+    struct xztl_stats_hist *hist = &xztl_stats_shard ()->lat[type];
+    uint64_t max;
+
+    __sync_fetch_and_add (&hist->bkt[xztl_stats_lat_bkt (usec)], 1);
+    __sync_fetch_and_add (&hist->sum, usec);
+
+    max = hist->max;
+    while (usec > max) {
+	if (__sync_bool_compare_and_swap (&hist->max, max, usec))
+	    break;
+	max = hist->max;
     }
-#endif
 }
 
+static uint64_t xztl_stats_lat_pct (const uint64_t *bkt, uint64_t count,
+								double pct)
+{
+    uint64_t rank, seen = 0;
+    uint32_t bkt_i;
+
+    rank = (uint64_t) (pct * count + 0.5);
+    if (!rank)
+	rank = 1;
+
+    for (bkt_i = 0; bkt_i < XZTL_STATS_LAT_BKTS; bkt_i++) {
+	seen += bkt[bkt_i];
+	if (seen >= rank)
+	    return xztl_stats_lat_val (bkt_i);
+    }
+
+    return 0;
+}
+
+/* Shards are merged at read time, recording is never blocked */
+void xztl_stats_lat_get (uint32_t type, struct xztl_stats_lat *lat)
+{
+    static __thread uint64_t bkt[XZTL_STATS_LAT_BKTS];
+    struct xztl_stats_hist *hist;
+    uint32_t shard_i, bkt_i;
+
+    memset (lat, 0x0, sizeof (struct xztl_stats_lat));
+    memset (bkt, 0x0, sizeof (bkt));
+
+    for (shard_i = 0; shard_i < XZTL_STATS_SHARDS; shard_i++) {
+	hist = &xztl_stats.shard[shard_i].lat[type];
+
+	for (bkt_i = 0; bkt_i < XZTL_STATS_LAT_BKTS; bkt_i++) {
+	    bkt[bkt_i] += hist->bkt[bkt_i];
+	    lat->count += hist->bkt[bkt_i];
+	}
+	lat->sum += hist->sum;
+	if (hist->max > lat->max)
+	    lat->max = hist->max;
+    }
+
+    if (!lat->count)
+	return;
+
+    lat->p50  = xztl_stats_lat_pct (bkt, lat->count, 0.5);
+    lat->p99  = xztl_stats_lat_pct (bkt, lat->count, 0.99);
+    lat->p999 = xztl_stats_lat_pct (bkt, lat->count, 0.999);
+
+    /* Bucket bounds can exceed the largest value seen */
+    if (lat->p50 > lat->max)
+	lat->p50 = lat->max;
+    if (lat->p99 > lat->max)
+	lat->p99 = lat->max;
+    if (lat->p999 > lat->max)
+	lat->p999 = lat->max;
+}
+
+void xztl_stats_set (uint32_t type, uint64_t val)
+{
+    xztl_atomic_int64_update (&xztl_stats.gauge[type], val);
+}
+
+/* Counters restart from the current totals, shards are not written */
 void xztl_stats_reset_io (void)
 {
     uint32_t type_i;
 
-    for (type_i = 0; type_i < XZTL_STATS_IO_TYPES; type_i++)
-	xztl_atomic_int64_update (&xztl_stats.io[type_i], 0);
+    for (type_i = 0; type_i < XZTL_STATS_IO_TYPES; type_i++) {
+
+	/* Gauges keep the current value */
+	if (xztl_stats_is_gauge (type_i))
+	    continue;
+
+	xztl_atomic_int64_update (&xztl_stats.base[type_i],
+					    xztl_stats_sum (type_i));
+    }
 }
 
 void xztl_stats_exit (void)
@@ -176,7 +388,7 @@ void xztl_stats_exit (void)
 
 int xztl_stats_init (void)
 {
-    memset (xztl_stats.io, 0x0, sizeof(uint64_t) * XZTL_STATS_IO_TYPES);
+    memset (&xztl_stats, 0x0, sizeof (struct xztl_stats_data));
 
 #if XZTL_PROMETHEUS
     if (xztl_prometheus_init()) {
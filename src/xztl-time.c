@@ -0,0 +1,91 @@
+/* xZTL: Zone Translation Layer User-space Library
+ *
+ * Copyright 2020 Samsung Electronics
+ *
+ * Written by Ivan L. Picoli <i.picoli@samsung.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+*/
+
+#include <xztl.h>
+#include <stdint.h>
+#include <time.h>
+#if defined(__x86_64__)
+#include <cpuid.h>
+#endif
+
+#define XZTL_TIME_CAL_NSEC 10000000  /* 10 ms calibration window */
+
+struct xztl_time_cal xztl_time_cal;
+
+uint64_t xztl_time_ns_sys (void)
+{
+    struct timespec ts;
+    uint64_t ns;
+
+    GET_NANOSECONDS (ns, ts);
+
+    return ns;
+}
+
+#if defined(__x86_64__)
+/* Invariant TSC: constant rate in all P/C-states (CPUID 80000007h EDX[8]) */
+static int xztl_time_tsc_invariant (void)
+{
+    unsigned int eax, ebx, ecx, edx;
+
+    if (!__get_cpuid (0x80000007, &eax, &ebx, &ecx, &edx))
+	return 0;
+
+    return !!(edx & (1 << 8));
+}
+#endif
+
+void xztl_time_init (void)
+{
+#if defined(__x86_64__)
+    struct timespec ts, wait = { .tv_sec = 0, .tv_nsec = XZTL_TIME_CAL_NSEC };
+    uint64_t ns_s, ns_e, tsc_s, tsc_e;
+
+    if (xztl_time_cal.tsc)
+	return;
+
+    if (!xztl_time_tsc_invariant ()) {
+	log_info ("xztl-time: TSC is not invariant, using the system clock.");
+	return;
+    }
+
+    GET_NANOSECONDS (ns_s, ts);
+    tsc_s = __builtin_ia32_rdtsc ();
+
+    nanosleep (&wait, NULL);
+
+    GET_NANOSECONDS (ns_e, ts);
+    tsc_e = __builtin_ia32_rdtsc ();
+
+    if (tsc_e <= tsc_s || ns_e <= ns_s) {
+	log_info ("xztl-time: TSC calibration failed, using the system clock.");
+	return;
+    }
+
+    xztl_time_cal.mult     = ((ns_e - ns_s) << XZTL_TIME_SHIFT) /
+							    (tsc_e - tsc_s);
+    xztl_time_cal.tsc_base = tsc_e;
+    xztl_time_cal.ns_base  = ns_e;
+    __sync_synchronize ();
+    xztl_time_cal.tsc      = 1;
+
+    log_infoa ("xztl-time: TSC calibrated, %.3f MHz",
+			    (double) (tsc_e - tsc_s) * 1000 / (ns_e - ns_s));
+#endif
+}
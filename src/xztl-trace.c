@@ -0,0 +1,345 @@
+/* xZTL: Zone Translation Layer User-space Library
+ *
+ * Copyright 2020 Samsung Electronics
+ *
+ * Written by Ivan L. Picoli <i.picoli@samsung.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+*/
+
+#include <xztl.h>
+#include <xztl-media.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+extern struct xztl_core core;
+
+/* Each recording thread owns a single-producer ring drained by the trace
+ * thread, recording never takes a lock. Rings are allocated by their thread
+ * on the first record and released when the thread exits, the next thread
+ * continues the ring. Records of threads beyond XZTL_TRACE_RINGS alive at
+ * the same time are counted as dropped */
+
+#define XZTL_TRACE_RINGS     64
+#define XZTL_TRACE_RING_ENTS 65536  /* Power of 2, 2 MB per thread */
+#define XZTL_TRACE_FLUSH_US  1000
+
+struct xztl_trace_ring {
+    uint64_t head;       /* Written by the owner thread */
+    uint8_t  rsv[56];
+    uint64_t tail;       /* Written by the trace thread */
+    uint64_t drops;
+    struct xztl_trace_rec *ents;
+    uint8_t  owned;      /* A thread records in the ring */
+} __attribute__((aligned (64)));
+
+static volatile uint8_t xztl_trace_on;
+
+static struct xztl_trace_ring trace_rings[XZTL_TRACE_RINGS];
+static uint64_t trace_drops;
+static __thread int32_t trace_ring_id = -1;
+static pthread_key_t trace_ring_key;
+static pthread_once_t trace_key_once = PTHREAD_ONCE_INIT;
+
+static pthread_t trace_tid;
+static volatile uint8_t trace_running;
+static FILE *trace_fp;
+
+/* Called at thread exit, records left in the ring are still drained */
+static void xztl_trace_ring_put (void *arg)
+{
+    struct xztl_trace_ring *ring = (struct xztl_trace_ring *) arg;
+
+    __atomic_store_n (&ring->owned, 0, __ATOMIC_RELEASE);
+}
+
+static void xztl_trace_key_init (void)
+{
+    if (pthread_key_create (&trace_ring_key, xztl_trace_ring_put))
+	log_err ("xztl-trace: Thread key not created.");
+}
+
+static struct xztl_trace_ring *xztl_trace_ring (void)
+{
+    struct xztl_trace_ring *ring;
+    int32_t ring_i;
+
+    if (trace_ring_id >= 0)
+	return &trace_rings[trace_ring_id];
+
+    for (ring_i = 0; ring_i < XZTL_TRACE_RINGS; ring_i++) {
+	ring = &trace_rings[ring_i];
+	if (__atomic_load_n (&ring->owned, __ATOMIC_RELAXED) ||
+		    !__sync_bool_compare_and_swap (&ring->owned, 0, 1))
+	    continue;
+
+	/* Without the key the ring is kept until the process exits */
+	pthread_setspecific (trace_ring_key, ring);
+	trace_ring_id = ring_i;
+	return ring;
+    }
+
+    return NULL;
+}
+
+static void xztl_trace_add (uint8_t event, uint8_t opcode, uint64_t tag,
+			    uint64_t addr, uint32_t nsec, uint16_t status)
+{
+    struct xztl_trace_ring *ring;
+    struct xztl_trace_rec *rec, *ents;
+    uint64_t head;
+
+    ring = xztl_trace_ring ();
+    if (!ring) {
+	__sync_fetch_and_add (&trace_drops, 1);
+	return;
+    }
+
+    if (!ring->ents) {
+	ents = calloc (XZTL_TRACE_RING_ENTS, sizeof (struct xztl_trace_rec));
+	if (!ents) {
+	    __sync_fetch_and_add (&trace_drops, 1);
+	    return;
+	}
+	__atomic_store_n (&ring->ents, ents, __ATOMIC_RELEASE);
+    }
+
+    head = ring->head;
+    if (head - __atomic_load_n (&ring->tail, __ATOMIC_ACQUIRE) >=
+						    XZTL_TRACE_RING_ENTS) {
+	ring->drops++;
+	return;
+    }
+
+    rec = &ring->ents[head & (XZTL_TRACE_RING_ENTS - 1)];
+    rec->us     = xztl_time_us ();
+    rec->addr   = addr;
+    rec->tag    = tag;
+    rec->nsec   = nsec;
+    rec->event  = event;
+    rec->opcode = opcode;
+    rec->status = status;
+
+    __atomic_store_n (&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+static void xztl_trace_io (uint8_t event, struct xztl_io_mcmd *cmd)
+{
+    uint32_t nsec = 0, i;
+
+    if (!xztl_trace_on)
+	return;
+
+    for (i = 0; i < cmd->naddr; i++)
+	nsec += cmd->nsec[i];
+
+    xztl_trace_add (event, cmd->opcode, (uint64_t) cmd,
+			    cmd->addr[0].addr, nsec, cmd->status);
+}
+
+static void xztl_trace_zn (uint8_t event, struct xztl_zn_mcmd *cmd)
+{
+    if (!xztl_trace_on)
+	return;
+
+    xztl_trace_add (event, cmd->opcode, (uint64_t) cmd,
+			    cmd->addr.addr, cmd->nzones, cmd->status);
+}
+
+static int xztl_trace_submit_io (struct xztl_io_mcmd *cmd)
+{
+    xztl_trace_io (XZTL_TRACE_IO_SUBMIT, cmd);
+    return 0;
+}
+
+static void xztl_trace_io_done (struct xztl_io_mcmd *cmd)
+{
+    xztl_trace_io (XZTL_TRACE_IO_DONE, cmd);
+}
+
+static int xztl_trace_submit_zn (struct xztl_zn_mcmd *cmd)
+{
+    xztl_trace_zn (XZTL_TRACE_ZN_SUBMIT, cmd);
+    return 0;
+}
+
+static void xztl_trace_zn_done (struct xztl_zn_mcmd *cmd)
+{
+    xztl_trace_zn (XZTL_TRACE_ZN_DONE, cmd);
+}
+
+static struct xztl_media_layer xztl_trace_layer = {
+    .name      = "trace",
+    .submit_io = xztl_trace_submit_io,
+    .io_done   = xztl_trace_io_done,
+    .submit_zn = xztl_trace_submit_zn,
+    .zn_done   = xztl_trace_zn_done,
+};
+
+static void xztl_trace_drain (void)
+{
+    struct xztl_trace_ring *ring;
+    struct xztl_trace_rec *ents;
+    uint64_t head, tail, n;
+    uint32_t ring_i;
+
+    for (ring_i = 0; ring_i < XZTL_TRACE_RINGS; ring_i++) {
+	ring = &trace_rings[ring_i];
+	ents = __atomic_load_n (&ring->ents, __ATOMIC_ACQUIRE);
+	if (!ents)
+	    continue;
+
+	head = __atomic_load_n (&ring->head, __ATOMIC_ACQUIRE);
+	tail = ring->tail;
+
+	while (tail < head) {
+	    n = MIN (head - tail, XZTL_TRACE_RING_ENTS -
+				    (tail & (XZTL_TRACE_RING_ENTS - 1)));
+	    fwrite (&ents[tail & (XZTL_TRACE_RING_ENTS - 1)],
+				    sizeof (struct xztl_trace_rec), n, trace_fp);
+	    tail += n;
+	}
+
+	__atomic_store_n (&ring->tail, tail, __ATOMIC_RELEASE);
+    }
+}
+
+static void *xztl_trace_th (void *arg)
+{
+    xztl_thread_place (XZTL_THREAD_BG);
+
+    while (trace_running) {
+	xztl_trace_drain ();
+	usleep (XZTL_TRACE_FLUSH_US);
+    }
+
+    return NULL;
+}
+
+static void xztl_trace_free (void)
+{
+    uint32_t ring_i;
+
+    for (ring_i = 0; ring_i < XZTL_TRACE_RINGS; ring_i++) {
+	free (trace_rings[ring_i].ents);
+	trace_rings[ring_i].ents = NULL;
+    }
+}
+
+static int xztl_trace_start (const char *path)
+{
+    struct xztl_trace_hdr hdr;
+    struct xztl_trace_ring *ring;
+    uint32_t ring_i;
+
+    if (trace_fp)
+	return -1;
+
+    pthread_once (&trace_key_once, xztl_trace_key_init);
+
+    trace_fp = fopen (path, "w");
+    if (!trace_fp) {
+	log_erra ("xztl-trace: Could not open %s", path);
+	return -1;
+    }
+
+    memset (&hdr, 0x0, sizeof (struct xztl_trace_hdr));
+    hdr.magic   = XZTL_TRACE_MAGIC;
+    hdr.version = XZTL_TRACE_VERSION;
+    hdr.nbytes  = (core.media) ? core.media->geo.nbytes : 0;
+    hdr.rec_sz  = sizeof (struct xztl_trace_rec);
+
+    if (fwrite (&hdr, sizeof (struct xztl_trace_hdr), 1, trace_fp) != 1)
+	goto FP;
+
+    /* Records left from a previous trace are discarded. Rings are kept
+     * until xztl_trace_exit, threads may still record after a stop */
+    for (ring_i = 0; ring_i < XZTL_TRACE_RINGS; ring_i++) {
+	ring = &trace_rings[ring_i];
+	ring->tail  = __atomic_load_n (&ring->head, __ATOMIC_ACQUIRE);
+	ring->drops = 0;
+    }
+    trace_drops = 0;
+
+    trace_running = 1;
+    if (pthread_create (&trace_tid, NULL, xztl_trace_th, NULL)) {
+	log_err ("xztl-trace: Trace thread not started.");
+	trace_running = 0;
+	goto FP;
+    }
+
+    xztl_trace_on = 1;
+
+    log_infoa ("xztl-trace: Recording media commands to %s", path);
+
+    return 0;
+
+FP:
+    fclose (trace_fp);
+    trace_fp = NULL;
+    return -1;
+}
+
+static void xztl_trace_stop (void)
+{
+    uint64_t drops;
+    uint32_t ring_i;
+
+    if (!trace_fp)
+	return;
+
+    xztl_trace_on = 0;
+    trace_running = 0;
+    pthread_join (trace_tid, NULL);
+
+    xztl_trace_drain ();
+    fclose (trace_fp);
+    trace_fp = NULL;
+
+    drops = trace_drops;
+    for (ring_i = 0; ring_i < XZTL_TRACE_RINGS; ring_i++)
+	drops += trace_rings[ring_i].drops;
+
+    if (drops)
+	log_erra ("xztl-trace: %lu records dropped", drops);
+}
+
+void xztl_trace_exit (void)
+{
+    xztl_trace_stop ();
+    xztl_trace_free ();
+}
+
+/* Tracing starts at init if XZTL_TRACE_FILE is set and stops at exit. The
+ * trace layer only joins the media chain in that case, the chain does not
+ * change while I/O runs */
+int xztl_trace_init (void)
+{
+    const char *path;
+
+    path = getenv ("XZTL_TRACE_FILE");
+    if (!path || !*path)
+	return 0;
+
+    if (xztl_trace_start (path))
+	return -1;
+
+    if (xztl_media_layer_add (&xztl_trace_layer)) {
+	xztl_trace_stop ();
+	return -1;
+    }
+
+    return 0;
+}
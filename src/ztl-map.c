@@ -27,11 +27,14 @@
 #include <xztl-ztl.h>
 #include <ztl.h>
 
-#define MAP_BUF_PGS     8192      /* 256 MB per cache with 32KB page */
 #define MAP_N_CACHES	1
 
 #define MAP_ADDR_FLAG   ((1 & AND64) << 63)
 
+/* Slot updates that carry a byte extent are serialized per ID stripe, reads
+ * of the entry only remain lock-free */
+#define MAP_EXT_LOCKS	64
+
 extern struct xztl_core    core;
 
 struct map_cache_entry {
@@ -63,6 +66,17 @@ static volatile uint8_t     cp_running;
 static uint32_t 	    map_pg_sz;
 static uint64_t             map_ent_per_pg;
 
+static pthread_spinlock_t   map_ext_spin[MAP_EXT_LOCKS];
+
+/* Mapped entries per mapping page. Lookups in empty pages return not found
+ * without loading the page */
+static uint32_t            *map_pg_nlive;
+
+/* Free entries of the tiny table, index 0 is never used */
+static uint32_t            *tiny_free;
+static uint32_t             tiny_nfree;
+static pthread_spinlock_t   tiny_spin;
+
 static int map_nvm_read (struct map_cache_entry *ent)
 {
     return 0;
@@ -101,8 +115,6 @@ static int map_load_pg_cache (struct map_cache *cache,
            struct map_md_addr *md_entry, uint64_t first_id, uint32_t pg_off)
 {
     struct map_cache_entry *cache_ent;
-    struct app_map_entry *map_ent;
-    uint64_t ent_id;
 
 WAIT:
     if (LIST_EMPTY(&cache->mbf_head)) {
@@ -134,10 +146,8 @@ WAIT:
 
     /* If metadata entry PPA is zero, mapping page does not exist yet */
     if (!md_entry->addr) {
-        for (ent_id = 0; ent_id < map_ent_per_pg; ent_id++) {
-            map_ent = &((struct app_map_entry *) cache_ent->buf)[ent_id];
-            map_ent->addr = 0x0;
-        }
+        memset (cache_ent->buf, 0x0, map_ent_per_pg *
+                                        sizeof (struct app_map_slot));
         cache_ent->dirty = 1;
     } else {
         if (map_nvm_read (cache_ent)) {
@@ -173,7 +183,8 @@ static int map_init_cache (struct map_cache *cache)
 {
     uint32_t pg_i;
 
-    cache->pg_buf = calloc (sizeof(struct map_cache_entry), MAP_BUF_PGS);
+    cache->pg_buf = calloc (sizeof(struct map_cache_entry),
+                                            core.config.map_buf_pgs);
     if (!cache->pg_buf)
         return -1;
 
@@ -189,7 +200,7 @@ static int map_init_cache (struct map_cache *cache)
     cache->nfree = 0;
     cache->nused = 0;
 
-    for (pg_i = 0; pg_i < MAP_BUF_PGS; pg_i++) {
+    for (pg_i = 0; pg_i < core.config.map_buf_pgs; pg_i++) {
         cache->pg_buf[pg_i].dirty = 0;
         cache->pg_buf[pg_i].buf_sz = map_pg_sz;
         cache->pg_buf[pg_i].addr.addr = 0x0;
@@ -266,16 +277,124 @@ static void map_exit_all_caches (void)
     }
 }
 
+static int map_tiny_init (void)
+{
+    struct app_tiny_entry *tbl;
+    uint8_t *dirty;
+    uint32_t ent_i, entries = ZTL_MAP_TINY_ENTS;
+
+    tbl = calloc (entries, sizeof (struct app_tiny_entry));
+    if (!tbl)
+        return -1;
+
+    dirty = calloc (entries, sizeof (uint8_t));
+    if (!dirty)
+        goto TBL;
+
+    tiny_free = malloc (sizeof (uint32_t) * entries);
+    if (!tiny_free)
+        goto DIRTY;
+
+    if (pthread_spin_init (&tiny_spin, 0))
+        goto FREE;
+
+    tiny_nfree = 0;
+    for (ent_i = entries - 1; ent_i > 0; ent_i--) {
+        tbl[ent_i].id = AND64;
+        tiny_free[tiny_nfree++] = ent_i;
+    }
+
+    ztl()->smap.tiny.tbl      = tbl;
+    ztl()->smap.tiny.dirty    = dirty;
+    ztl()->smap.tiny.entries  = entries;
+    ztl()->smap.tiny.entry_sz = sizeof (struct app_tiny_entry);
+
+    return 0;
+
+FREE:
+    free (tiny_free);
+DIRTY:
+    free (dirty);
+TBL:
+    free (tbl);
+    return -1;
+}
+
+static void map_tiny_exit (void)
+{
+
+    pthread_spin_destroy (&tiny_spin);
+    free (tiny_free);
+    free (ztl()->smap.tiny.dirty);
+    free (ztl()->smap.tiny.tbl);
+}
+
+static uint32_t map_tiny_get (void)
+{
+    uint32_t ent_i = 0;
+
+    pthread_spin_lock (&tiny_spin);
+    if (tiny_nfree)
+        ent_i = tiny_free[--tiny_nfree];
+    pthread_spin_unlock (&tiny_spin);
+
+    return ent_i;
+}
+
+static void map_tiny_put (uint32_t ent_i)
+{
+
+    ztl()->smap.tiny.tbl[ent_i].id = AND64;
+    ztl()->smap.tiny.dirty[ent_i]  = 1;
+
+    pthread_spin_lock (&tiny_spin);
+    tiny_free[tiny_nfree++] = ent_i;
+    pthread_spin_unlock (&tiny_spin);
+}
+
+/* Returns the tiny table index if the entry is an inline object of 'id' */
+static uint32_t map_tiny_index (uint64_t id, struct app_map_entry *ent)
+{
+
+    if (!ent->addr || ent->g.nsec ||
+                        ent->g.offset >= ztl()->smap.tiny.entries)
+        return 0;
+
+    return (ztl()->smap.tiny.tbl[ent->g.offset].id == id) ? ent->g.offset : 0;
+}
+
+/* Called with the slot lock held, before the slot is replaced */
+static void map_tiny_release (uint64_t id, struct app_map_slot *slot)
+{
+    uint32_t ent_i;
+
+    ent_i = map_tiny_index (id, &slot->ent);
+    if (ent_i)
+        map_tiny_put (ent_i);
+}
+
 static int map_init (void)
 {
-    uint32_t cache_i;
+    uint32_t cache_i, lock_i;
 
     map_caches = calloc (sizeof (struct map_cache), MAP_N_CACHES);
     if (!map_caches)
         return -1;
 
     map_pg_sz      = (ZTL_MPE_PG_SEC * core.media->geo.nbytes);
-    map_ent_per_pg = map_pg_sz / sizeof (struct app_map_entry);
+    map_ent_per_pg = map_pg_sz / sizeof (struct app_map_slot);
+
+    map_pg_nlive = calloc (ztl()->smap.entries, sizeof (uint32_t));
+    if (!map_pg_nlive)
+        goto FREE;
+
+    for (lock_i = 0; lock_i < MAP_EXT_LOCKS; lock_i++) {
+        if (pthread_spin_init (&map_ext_spin[lock_i], 0))
+            goto EXIT_LOCKS;
+    }
+
+    if (map_tiny_init ())
+        goto EXIT_LOCKS;
 
     for (cache_i = 0; cache_i < MAP_N_CACHES; cache_i++) {
 
@@ -296,6 +415,14 @@ EXIT_CACHES:
         cache_i--;
         map_exit_cache (&map_caches[cache_i]);
     }
+    map_tiny_exit ();
+EXIT_LOCKS:
+    while (lock_i) {
+        lock_i--;
+        pthread_spin_destroy (&map_ext_spin[lock_i]);
+    }
+    free (map_pg_nlive);
+FREE:
     free (map_caches);
 
     return -1;
@@ -303,7 +430,15 @@ EXIT_CACHES:
 
 static void map_exit (void)
 {
+    uint32_t lock_i;
+
     map_exit_all_caches ();
+    map_tiny_exit ();
+
+    for (lock_i = 0; lock_i < MAP_EXT_LOCKS; lock_i++)
+        pthread_spin_destroy (&map_ext_spin[lock_i]);
+
+    free (map_pg_nlive);
 
     free (map_caches);
 
@@ -374,12 +509,45 @@ static int map_upsert_md (uint64_t index, uint64_t new_addr, uint64_t old_addr)
     return 0;
 }
 
+static uint8_t map_pg_empty (uint64_t id)
+{
+    uint64_t pg_off = id / map_ent_per_pg;
+
+    return (pg_off < ztl()->smap.entries) ? !map_pg_nlive[pg_off] : 0;
+}
+
+/* Called with the slot lock held, before the slot is replaced */
+static void map_pg_count (uint64_t id, struct app_map_slot *slot,
+                                                        uint64_t new_addr)
+{
+    uint64_t pg_off = id / map_ent_per_pg;
+
+    if (!slot->ent.addr && new_addr)
+        __sync_fetch_and_add (&map_pg_nlive[pg_off], 1);
+    else if (slot->ent.addr && !new_addr)
+        __sync_fetch_and_sub (&map_pg_nlive[pg_off], 1);
+}
+
+static struct app_map_slot *map_get_slot (uint64_t id)
+{
+    struct map_cache_entry *cache_ent;
+    uint32_t ent_off;
+
+    ent_off = id % map_ent_per_pg;
+
+    cache_ent = map_get_cache_entry (id);
+    if (!cache_ent)
+        return NULL;
+
+    return &((struct app_map_slot *) cache_ent->buf)[ent_off];
+}
+
 static int map_upsert (uint64_t id, uint64_t val, uint64_t *old,
                                                         uint64_t old_caller)
 {
     uint32_t ent_off;
+    struct app_map_slot *slot;
     struct app_map_entry *map_ent;
-    struct map_cache_entry *cache_ent;
 
     ent_off = id % map_ent_per_pg;
     if (ent_off >= map_ent_per_pg) {
@@ -390,11 +558,11 @@ static int map_upsert (uint64_t id, uint64_t val, uint64_t *old,
 
     ZDEBUG (ZDEBUG_MAP, "ztl-map: upsert. ID: %lu, off %d.", id, ent_off);
 
-    cache_ent = map_get_cache_entry (id);
-    if (!cache_ent)
+    slot = map_get_slot (id);
+    if (!slot)
         return -1;
 
-    map_ent = &((struct app_map_entry *) cache_ent->buf)[ent_off];
+    map_ent = &slot->ent;
 
     /* Fill old ADDR pointer, caller may use to invalidate the addr for GC */
     *old = map_ent->addr;
@@ -406,7 +574,13 @@ static int map_upsert (uint64_t id, uint64_t val, uint64_t *old,
         return 1;
     }
 
+    /* A plain upsert maps full sectors */
+    pthread_spin_lock (&map_ext_spin[id % MAP_EXT_LOCKS]);
+    map_tiny_release (id, slot);
+    map_pg_count (id, slot, val);
+    slot->ext.val = 0;
     xztl_atomic_int64_update (&map_ent->addr, val);
+    pthread_spin_unlock (&map_ext_spin[id % MAP_EXT_LOCKS]);
 
     /* Uncomment this line if we implement recovery at the ZTL */
     //cache_ent->dirty = 1;
@@ -417,33 +591,167 @@ static int map_upsert (uint64_t id, uint64_t val, uint64_t *old,
     return 0;
 }
 
-static uint64_t map_read (uint64_t id)
+/* Maps a user write together with its byte extent, the entry and the extent
+ * are updated atomically for readers using map_read_ext */
+static int map_upsert_ext (uint64_t id, uint64_t val, uint64_t ext,
+                                                        uint64_t *old)
 {
-    struct map_cache_entry *cache_ent;
+    struct app_map_slot *slot;
+
+    ZDEBUG (ZDEBUG_MAP, "ztl-map: upsert ext. ID: %lu, ext 0x%lx.", id, ext);
+
+    slot = map_get_slot (id);
+    if (!slot)
+        return -1;
+
+    pthread_spin_lock (&map_ext_spin[id % MAP_EXT_LOCKS]);
+    *old = slot->ent.addr;
+    map_tiny_release (id, slot);
+    map_pg_count (id, slot, val);
+    slot->ext.val = ext;
+    xztl_atomic_int64_update (&slot->ent.addr, val);
+    pthread_spin_unlock (&map_ext_spin[id % MAP_EXT_LOCKS]);
+
+    return 0;
+}
+
+/* Stores an object inline in the tiny table. Returns a positive value if
+ * the table is full, the caller writes the object to media instead */
+static int map_upsert_tiny (uint64_t id, void *buf, uint32_t len,
+                                                        uint64_t *old)
+{
+    struct app_map_slot *slot;
+    struct app_map_entry ent;
+    struct app_map_ext ext;
+    uint32_t ent_i;
+
+    if (!len || len > ZTL_MAP_TINY_BYTES)
+        return -1;
+
+    slot = map_get_slot (id);
+    if (!slot)
+        return -1;
+
+    ent_i = map_tiny_get ();
+    if (!ent_i)
+        return 1;
+
+    memcpy (ztl()->smap.tiny.tbl[ent_i].data, buf, len);
+    ztl()->smap.tiny.tbl[ent_i].id = id;
+    ztl()->smap.tiny.dirty[ent_i]  = 1;
+
+    ent.addr     = 0;
+    ent.g.offset = ent_i;
+    ext.val      = 0;
+    ext.g.len    = len;
+
+    pthread_spin_lock (&map_ext_spin[id % MAP_EXT_LOCKS]);
+    *old = slot->ent.addr;
+    map_tiny_release (id, slot);
+    map_pg_count (id, slot, ent.addr);
+    slot->ext.val = ext.val;
+    xztl_atomic_int64_update (&slot->ent.addr, ent.addr);
+    pthread_spin_unlock (&map_ext_spin[id % MAP_EXT_LOCKS]);
+
+    ZDEBUG (ZDEBUG_MAP, "ztl-map: upsert tiny. ID: %lu, ent %d, len %d.",
+                                                        id, ent_i, len);
+
+    return 0;
+}
+
+/* Copies an inline object. Returns a positive value if the object is not
+ * inline anymore */
+static int map_read_tiny (uint64_t id, uint64_t off, void *buf, size_t size)
+{
+    struct app_map_slot *slot;
+    uint32_t ent_i;
+    int ret = 0;
+
+    slot = map_get_slot (id);
+    if (!slot)
+        return -1;
+
+    pthread_spin_lock (&map_ext_spin[id % MAP_EXT_LOCKS]);
+    ent_i = map_tiny_index (id, &slot->ent);
+    if (!ent_i)
+        ret = 1;
+    else if (off + size > slot->ext.g.len)
+        ret = -1;
+    else
+        memcpy (buf, ztl()->smap.tiny.tbl[ent_i].data + off, size);
+    pthread_spin_unlock (&map_ext_spin[id % MAP_EXT_LOCKS]);
+
+    return ret;
+}
+
+/* Returns ZTL_MAP_NOT_FOUND if the ID is not mapped */
+static int map_read_ext (uint64_t id, struct app_map_entry *ent,
+                                                struct app_map_ext *ext)
+{
+    struct app_map_slot *slot;
+
+    ent->addr = 0;
+    ext->val  = 0;
+
+    if (map_pg_empty (id))
+        return ZTL_MAP_NOT_FOUND;
+
+    slot = map_get_slot (id);
+    if (!slot)
+        return -1;
+
+    pthread_spin_lock (&map_ext_spin[id % MAP_EXT_LOCKS]);
+    ent->addr = slot->ent.addr;
+    ext->val  = slot->ext.val;
+    pthread_spin_unlock (&map_ext_spin[id % MAP_EXT_LOCKS]);
+
+    if (!ent->addr)
+        return ZTL_MAP_NOT_FOUND;
+
+    /* Entries mapped without extent cover their full sectors */
+    if (!ext->val)
+        ext->g.len = (uint64_t) ent->g.nsec * core.media->geo.nbytes;
+
+    ZDEBUG (ZDEBUG_MAP, "  read ext succeed: ID: %lu, val (0x%lx/%d/%d), "
+                "boff %d, len %lu", id, (uint64_t) ent->g.offset, ent->g.nsec,
+                ent->g.multi, ext->g.boff, (uint64_t) ext->g.len);
+
+    return 0;
+}
+
+/* Returns ZTL_MAP_NOT_FOUND if the ID is not mapped, or a negative value
+ * if the mapping cannot be read. 'val' is set only if the ID is mapped */
+static int map_read (uint64_t id, uint64_t *val)
+{
+    struct app_map_slot *slot;
     struct app_map_entry *map_ent;
     uint32_t ent_off;
-    uint64_t ret;
 
     ent_off = id % map_ent_per_pg;
     if (ent_off >= map_ent_per_pg) {
         log_erra ("ztl-map: read. Entry offset out of bounds. ID %lu", id);
-        return AND64;
+        return -1;
     }
 
     ZDEBUG (ZDEBUG_MAP, "ztl-map: read. ID: %lu, off %d.", id, ent_off);
 
-    cache_ent = map_get_cache_entry (id);
-    if (!cache_ent)
-        return AND64;
+    if (map_pg_empty (id))
+        return ZTL_MAP_NOT_FOUND;
 
-    map_ent = &((struct app_map_entry *) cache_ent->buf)[ent_off];
+    slot = map_get_slot (id);
+    if (!slot)
+        return -1;
+
+    map_ent = &slot->ent;
+    if (!map_ent->addr)
+        return ZTL_MAP_NOT_FOUND;
 
-    ret = map_ent->g.offset;
+    *val = map_ent->g.offset;
 
     ZDEBUG (ZDEBUG_MAP, "  read succeed: ID: %lu, val (0x%lx/%d/%d)",
 	    id, (uint64_t) map_ent->g.offset, map_ent->g.nsec, map_ent->g.multi);
 
-    return ret;
+    return 0;
 }
 
 static struct app_map_mod libztl_map = {
@@ -454,7 +762,11 @@ static struct app_map_mod libztl_map = {
     .persist_fn     = map_flush_all_caches,
     .upsert_md_fn   = map_upsert_md,
     .upsert_fn      = map_upsert,
-    .read_fn        = map_read
+    .read_fn        = map_read,
+    .upsert_ext_fn  = map_upsert_ext,
+    .read_ext_fn    = map_read_ext,
+    .upsert_tiny_fn = map_upsert_tiny,
+    .read_tiny_fn   = map_read_tiny
 };
 
 void ztl_map_register (void) {
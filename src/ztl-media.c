@@ -31,12 +31,45 @@
 #include <pthread.h>
 #include <sys/queue.h>
 #include <sched.h>
+#include <string.h>
 
 static struct znd_media zndmedia;
 extern char *dev_name;
+extern struct xztl_core core;
 
-static pthread_spinlock_t cb_spin;
-STAILQ_HEAD (callback_head, xztl_io_mcmd) cb_head;
+static void znd_media_lat_io (struct xztl_io_mcmd *cmd)
+{
+    cmd->us_end = xztl_time_us ();
+
+    switch (cmd->opcode) {
+	case XZTL_CMD_READ:
+	    xztl_stats_lat_add (XZTL_STATS_LAT_READ,
+					cmd->us_end - cmd->us_start);
+	    break;
+	case XZTL_CMD_WRITE:
+	    xztl_stats_lat_add (XZTL_STATS_LAT_WRITE,
+					cmd->us_end - cmd->us_start);
+	    break;
+	case XZTL_ZONE_APPEND:
+	    xztl_stats_lat_add (XZTL_STATS_LAT_APPEND,
+					cmd->us_end - cmd->us_start);
+	    break;
+	default:
+	    break;
+    }
+}
+
+static void znd_media_lat_zn (struct xztl_zn_mcmd *cmd)
+{
+    uint64_t us_end;
+
+    us_end = xztl_time_us ();
+
+    if (cmd->opcode == XZTL_ZONE_MGMT_RESET)
+	xztl_stats_lat_add (XZTL_STATS_LAT_RESET, us_end - cmd->us_start);
+    else if (cmd->opcode == XZTL_ZONE_MGMT_FINISH)
+	xztl_stats_lat_add (XZTL_STATS_LAT_FINISH, us_end - cmd->us_start);
+}
 
 static struct xnvme_cmd_ctx init_sync_cmd_ctx(){
     struct xnvme_cmd_ctx ret;
@@ -46,6 +79,18 @@ static struct xnvme_cmd_ctx init_sync_cmd_ctx(){
     return ret;
 }
 
+/* Queues the callback to the completion thread of the command context */
+static void znd_media_complete_io (struct xztl_io_mcmd *cmd)
+{
+    struct xztl_mthread_ctx *tctx = cmd->async_ctx;
+
+    pthread_spin_lock (&tctx->cb_spin);
+    STAILQ_INSERT_TAIL (&tctx->cb_head, cmd, entry);
+    pthread_spin_unlock (&tctx->cb_spin);
+
+    xztl_poll_wake (&tctx->cb_poll);
+}
+
 static void znd_media_async_cb (struct xnvme_cmd_ctx *ctx, void *cb_arg)
 {
     struct xztl_io_mcmd *cmd;
@@ -54,6 +99,8 @@ static void znd_media_async_cb (struct xnvme_cmd_ctx *ctx, void *cb_arg)
     cmd = (struct xztl_io_mcmd *) cb_arg;
     cmd->status = xnvme_cmd_ctx_cpl_status (ctx);
 
+    znd_media_lat_io (cmd);
+
     if (!cmd->status && cmd->opcode == XZTL_ZONE_APPEND)
 	cmd->paddr[sec_i] = *(uint64_t *) &ctx->cpl.cdw0;
 
@@ -65,11 +112,35 @@ static void znd_media_async_cb (struct xnvme_cmd_ctx *ctx, void *cb_arg)
         xnvme_cmd_ctx_pr (ctx, 0);
     }
 
+    xztl_media_io_done (cmd);
+
+    xnvme_queue_put_cmd_ctx(ctx->async.queue, ctx);
+
+    znd_media_complete_io (cmd);
+}
+
+static void znd_media_async_zn_cb (struct xnvme_cmd_ctx *ctx, void *cb_arg)
+{
+    struct xztl_mthread_ctx *tctx;
+    struct xztl_zn_mcmd *cmd;
+
+    cmd = (struct xztl_zn_mcmd *) cb_arg;
+    cmd->status = xnvme_cmd_ctx_cpl_status (ctx);
+
+    znd_media_lat_zn (cmd);
+    xztl_media_zn_done (cmd);
+
+    if (cmd->status)
+        xnvme_cmd_ctx_pr (ctx, 0);
+
     xnvme_queue_put_cmd_ctx(ctx->async.queue, ctx);
 
-    pthread_spin_lock (&cb_spin);
-    STAILQ_INSERT_TAIL (&cb_head, cmd, entry);
-    pthread_spin_unlock (&cb_spin);
+    tctx = cmd->async_ctx;
+    pthread_spin_lock (&tctx->cb_spin);
+    STAILQ_INSERT_TAIL (&tctx->zn_cb_head, cmd, entry);
+    pthread_spin_unlock (&tctx->cb_spin);
+
+    xztl_poll_wake (&tctx->cb_poll);
 }
 
 static struct xnvme_cmd_ctx *init_async_cmd_ctx(struct xztl_io_mcmd *cmd){
@@ -78,6 +149,8 @@ static struct xnvme_cmd_ctx *init_async_cmd_ctx(struct xztl_io_mcmd *cmd){
     ret = xnvme_cmd_ctx_from_queue(cmd->async_ctx->asynch);
     xnvme_cmd_ctx_set_cb(ret, znd_media_async_cb, cmd);
 
+    cmd->us_start = xztl_time_us ();
+
     return ret;
 }
 
@@ -87,7 +160,6 @@ static int znd_media_submit_read_synch (struct xztl_io_mcmd *cmd)
     void *dbuf;
     uint64_t slba;
     uint16_t sec_i = 0;
-    struct timespec ts_s, ts_e;
 
     /* The read path is not group based. It uses only sectors */
     slba = cmd->addr[sec_i].g.sect;
@@ -98,12 +170,9 @@ static int znd_media_submit_read_synch (struct xztl_io_mcmd *cmd)
 
     int ret;
 
-    GET_MICROSECONDS(cmd->us_start, ts_s);
+    cmd->us_start = xztl_time_us ();
     ret = xnvme_nvm_read(&ctx, xnvme_dev_get_nsid(zndmedia.dev), slba, (uint16_t) cmd->nsec[sec_i] - 1, dbuf, NULL);
-    GET_MICROSECONDS(cmd->us_end, ts_e);
-
-    /* WARNING: Uncommenting this line causes performance drop */
-    //xztl_prometheus_add_read_latency (cmd->us_end - cmd->us_start);
+    znd_media_lat_io (cmd);
 
     if (ret)
 	xztl_print_mcmd (cmd);
@@ -190,6 +259,112 @@ static int znd_media_submit_append_asynch (struct xztl_io_mcmd *cmd)
     return ret;
 }
 
+/* Moves data through a host buffer when Simple Copy is not supported or
+ * when a source range is larger than the device limit */
+static int znd_media_copy_emulate (struct xztl_io_mcmd *cmd)
+{
+    struct xnvme_cmd_ctx ctx;
+    uint64_t phys, dlba;
+    uint32_t nsid, addr_i;
+    void *buf;
+    int ret = 0;
+
+    nsid = xnvme_dev_get_nsid (zndmedia.dev);
+    dlba = cmd->addr_dst.g.sect;
+
+    for (addr_i = 0; addr_i < cmd->naddr; addr_i++) {
+	buf = xnvme_buf_phys_alloc (zndmedia.dev,
+		    cmd->nsec[addr_i] * zndmedia.devgeo->nbytes, &phys);
+	if (!buf)
+	    return ZND_MEDIA_ASYNCH_MEM;
+
+	ctx = init_sync_cmd_ctx();
+	ret = xnvme_nvm_read (&ctx, nsid, cmd->addr[addr_i].g.sect,
+			    (uint16_t) cmd->nsec[addr_i] - 1, buf, NULL);
+	if (!ret) {
+	    ctx = init_sync_cmd_ctx();
+	    ret = xnvme_nvm_write (&ctx, nsid, dlba,
+			    (uint16_t) cmd->nsec[addr_i] - 1, buf, NULL);
+	}
+
+	xnvme_buf_free (zndmedia.dev, buf);
+
+	if (ret) {
+	    cmd->status = xnvme_cmd_ctx_cpl_status (&ctx);
+	    return ret;
+	}
+
+	dlba += cmd->nsec[addr_i];
+    }
+
+    return XZTL_OK;
+}
+
+static int znd_media_copy_offload (struct xztl_io_mcmd *cmd)
+{
+    struct xnvme_spec_nvm_scopy_source_range *rng;
+    struct xnvme_cmd_ctx ctx;
+    uint64_t phys;
+    uint32_t addr_i;
+    int ret;
+
+    rng = xnvme_buf_phys_alloc (zndmedia.dev, sizeof (*rng), &phys);
+    if (!rng)
+	return ZND_MEDIA_ASYNCH_MEM;
+
+    memset (rng, 0x0, sizeof (*rng));
+    for (addr_i = 0; addr_i < cmd->naddr; addr_i++) {
+	rng->entry[addr_i].slba = cmd->addr[addr_i].g.sect;
+	rng->entry[addr_i].nlb  = (uint16_t) cmd->nsec[addr_i] - 1;
+    }
+
+    ctx = init_sync_cmd_ctx();
+
+    /* Number of ranges is zero-based */
+    ret = xnvme_nvm_scopy (&ctx, xnvme_dev_get_nsid (zndmedia.dev),
+			   cmd->addr_dst.g.sect, rng->entry,
+			   cmd->naddr - 1, XNVME_NVM_SCOPY_FMT_ZERO);
+    if (ret)
+	cmd->status = xnvme_cmd_ctx_cpl_status (&ctx);
+
+    xnvme_buf_free (zndmedia.dev, rng);
+
+    return ret;
+}
+
+/* Copies are synchronous and executed on the caller thread, 'synch' must
+ * be set. Commands out of the device limits are emulated */
+static int znd_media_submit_copy (struct xztl_io_mcmd *cmd)
+{
+    uint64_t nsec = 0;
+    uint32_t addr_i;
+    uint8_t offload;
+    int ret;
+
+    if (!cmd->synch)
+	return ZND_INVALID_OPCODE;
+
+    offload = zndmedia.scopy && cmd->naddr <= zndmedia.scopy_msrc;
+    for (addr_i = 0; addr_i < cmd->naddr; addr_i++) {
+	if (cmd->nsec[addr_i] > zndmedia.scopy_mssrl)
+	    offload = 0;
+	nsec += cmd->nsec[addr_i];
+    }
+    if (nsec > zndmedia.scopy_mcl)
+	offload = 0;
+
+    ret = (offload) ? znd_media_copy_offload (cmd) :
+		      znd_media_copy_emulate (cmd);
+    if (ret) {
+	xztl_print_mcmd (cmd);
+	return ret;
+    }
+
+    cmd->paddr[0] = cmd->addr_dst.g.sect;
+
+    return XZTL_OK;
+}
+
 static int znd_media_submit_io (struct xztl_io_mcmd *cmd)
 {
     switch (cmd->opcode) {
@@ -202,24 +377,57 @@ static int znd_media_submit_io (struct xztl_io_mcmd *cmd)
 	case XZTL_CMD_WRITE:
 	    return (cmd->synch) ? znd_media_submit_write_synch (cmd) :
 				  znd_media_submit_write_asynch (cmd);
+	case XZTL_CMD_COPY:
+	    return znd_media_submit_copy (cmd);
 	default:
 	    return ZND_INVALID_OPCODE;
     }
     return 0;
 }
 
+static int znd_media_zone_manage_asynch (struct xztl_zn_mcmd *cmd,
+						uint64_t lba, uint8_t op)
+{
+    struct xztl_mthread_ctx *tctx;
+    struct xnvme_cmd_ctx *ctx;
+    int ret;
+
+    tctx = cmd->async_ctx;
+
+    pthread_spin_lock (&tctx->qpair_spin);
+
+    ctx = xnvme_cmd_ctx_from_queue (tctx->asynch);
+    xnvme_cmd_ctx_set_cb (ctx, znd_media_async_zn_cb, cmd);
+
+    cmd->us_start = xztl_time_us ();
+
+    ret = xnvme_znd_mgmt_send(ctx, xnvme_dev_get_nsid(zndmedia.dev), lba, op, 0, NULL);
+    if (ret)
+	xnvme_queue_put_cmd_ctx (tctx->asynch, ctx);
+
+    pthread_spin_unlock (&tctx->qpair_spin);
+
+    return ret;
+}
+
 static inline int znd_media_zone_manage (struct xztl_zn_mcmd *cmd, uint8_t op)
 {
-    uint32_t lba;
+    uint64_t lba;
     struct xnvme_cmd_ctx devreq;
     int ret;
 
-    lba = ( (zndmedia.devgeo->nzone * cmd->addr.g.grp) +
+    /* Same zone layout as the write path */
+    lba = ( ((uint64_t) zndmedia.media.geo.zn_grp * cmd->addr.g.grp) +
 	    cmd->addr.g.zone) * zndmedia.devgeo->nsect;
 
+    if (cmd->asynch)
+	return znd_media_zone_manage_asynch (cmd, lba, op);
+
     devreq = init_sync_cmd_ctx();
 
+    cmd->us_start = xztl_time_us ();
     ret = xnvme_znd_mgmt_send(&devreq, xnvme_dev_get_nsid(zndmedia.dev), lba, op, 0, NULL);
+    znd_media_lat_zn (cmd);
 
     cmd->status = (ret) ? xnvme_cmd_ctx_cpl_status (&devreq) : XZTL_OK;
 
@@ -323,16 +531,11 @@ static void *znd_media_asynch_comp_th (void *args)
 {
     struct xztl_misc_cmd    *cmd_misc;
     struct xztl_io_mcmd	    *cmd;
+    struct xztl_zn_mcmd	    *zn_cmd;
     struct xztl_mthread_ctx *tctx;
+    uint32_t key, idle = 0;
 
-#if ZTL_WRITE_AFFINITY
-    cpu_set_t cpuset;
-
-    /* Set affinity to writing core */
-    CPU_ZERO(&cpuset);
-    CPU_SET(ZTL_WRITE_CORE, &cpuset);
-    pthread_setaffinity_np (pthread_self(), sizeof(cpu_set_t), &cpuset);
-#endif
+    xztl_thread_place (XZTL_THREAD_COMP);
 
     cmd_misc   = (struct xztl_misc_cmd *) args;
     tctx       = cmd_misc->asynch.ctx_ptr;
@@ -340,25 +543,39 @@ static void *znd_media_asynch_comp_th (void *args)
     tctx->comp_active = 1;
 
     while (tctx->comp_active) {
-	usleep (1);
+	key = xztl_poll_key (&tctx->cb_poll);
 
-NEXT:
-	if (!STAILQ_EMPTY (&cb_head)) {
+	if (!STAILQ_EMPTY (&tctx->cb_head)) {
 
-	    pthread_spin_lock (&cb_spin);
-	    cmd = STAILQ_FIRST (&cb_head);
-	    if (!cmd) {
-		pthread_spin_unlock (&cb_spin);
+	    pthread_spin_lock (&tctx->cb_spin);
+	    cmd = STAILQ_FIRST (&tctx->cb_head);
+	    if (cmd)
+		STAILQ_REMOVE_HEAD (&tctx->cb_head, entry);
+	    pthread_spin_unlock (&tctx->cb_spin);
+
+	    if (cmd) {
+		cmd->callback (cmd);
+		idle = 0;
 		continue;
 	    }
+	}
 
-	    STAILQ_REMOVE_HEAD (&cb_head, entry);
-	    pthread_spin_unlock (&cb_spin);
+	if (!STAILQ_EMPTY (&tctx->zn_cb_head)) {
 
-	    cmd->callback (cmd);
+	    pthread_spin_lock (&tctx->cb_spin);
+	    zn_cmd = STAILQ_FIRST (&tctx->zn_cb_head);
+	    if (zn_cmd)
+		STAILQ_REMOVE_HEAD (&tctx->zn_cb_head, entry);
+	    pthread_spin_unlock (&tctx->cb_spin);
 
-	    goto NEXT;
+	    if (zn_cmd) {
+		zn_cmd->callback (zn_cmd);
+		idle = 0;
+		continue;
+	    }
 	}
+
+	xztl_poll_idle (&tctx->cb_poll, key, &idle, 0);
     }
 
     return XZTL_OK;
@@ -378,8 +595,13 @@ static int znd_media_asynch_init (struct xztl_misc_cmd *cmd)
     }
 
 
-    STAILQ_INIT (&cb_head);
-    if (pthread_spin_init (&cb_spin, 0)) {
+    STAILQ_INIT (&tctx->cb_head);
+    STAILQ_INIT (&tctx->zn_cb_head);
+    memset (&tctx->cb_poll, 0x0, sizeof (struct xztl_poll));
+    if (pthread_spin_init (&tctx->cb_spin, 0)) {
+	tctx->asynch->base.dev = zndmedia.dev;
+	xnvme_queue_term (tctx->asynch);
+	tctx->asynch = NULL;
 	return ZND_MEDIA_ASYNCH_ERR;
     }
 
@@ -393,7 +615,7 @@ static int znd_media_asynch_init (struct xztl_misc_cmd *cmd)
     tctx->asynch->base.dev = zndmedia.dev;
 	xnvme_queue_term (tctx->asynch);
 	tctx->asynch = NULL;
-	pthread_spin_destroy (&cb_spin);
+	pthread_spin_destroy (&tctx->cb_spin);
 
 	return ZND_MEDIA_ASYNCH_TH;
     }
@@ -411,6 +633,7 @@ static int znd_media_asynch_term (struct xztl_misc_cmd *cmd)
     int ret;
 
     /* Join the completion thread (should be terminated by the caller) */
+    xztl_poll_wake (&cmd->asynch.ctx_ptr->cb_poll);
     pthread_join (cmd->asynch.ctx_ptr->comp_tid, NULL);
 
     cmd->asynch.ctx_ptr->asynch->base.dev = zndmedia.dev;
@@ -418,7 +641,7 @@ static int znd_media_asynch_term (struct xztl_misc_cmd *cmd)
     if (ret)
 	return ZND_MEDIA_ASYNCH_ERR;
 
-    pthread_spin_destroy (&cb_spin);
+    pthread_spin_destroy (&cmd->asynch.ctx_ptr->cb_spin);
 
     return XZTL_OK;
 }
@@ -467,8 +690,43 @@ static int znd_media_exit (void)
     return XZTL_OK;
 }
 
+static void znd_media_scopy_check (struct xnvme_dev *dev)
+{
+    const struct xnvme_spec_idfy_ctrlr *ctrlr;
+    const struct xnvme_spec_idfy_ns *ns;
+    struct xnvme_spec_nvm_scopy_source_range *rng = NULL;
+
+    zndmedia.scopy       = 0;
+    zndmedia.scopy_mssrl = 0;
+    zndmedia.scopy_mcl   = 0;
+    zndmedia.scopy_msrc  = 0;
+
+    ctrlr = xnvme_dev_get_ctrlr (dev);
+    ns    = xnvme_dev_get_ns (dev);
+    if (!ctrlr || !ns || !ctrlr->oncs.copy || !ns->mssrl)
+	return;
+
+    /* MSRC is 0-based, the range buffer holds a limited number of entries */
+    zndmedia.scopy       = 1;
+    zndmedia.scopy_mssrl = ns->mssrl;
+    zndmedia.scopy_mcl   = ns->mcl;
+    zndmedia.scopy_msrc  = MIN ((uint32_t) ns->msrc + 1,
+				 sizeof (rng->entry) / sizeof (rng->entry[0]));
+
+    log_infoa ("znd-media: Simple Copy supported. mssrl %d, mcl %d, "
+			"msrc %d", ns->mssrl, ns->mcl, zndmedia.scopy_msrc);
+}
+
+/* Limits are reported 0-based, all bits set means no limit */
+static uint32_t znd_media_zone_limit (uint32_t limit)
+{
+    return (limit == 0xFFFFFFFF) ? 0 : limit + 1;
+}
+
 int znd_media_register (const char *dev_name)
 {
+    const struct xnvme_spec_znd_idfy_ns *zns;
+    const struct xnvme_spec_idfy_ns *ns;
     const struct xnvme_geo *devgeo;
     struct xnvme_dev *dev;
     struct xztl_media *m;
@@ -487,6 +745,11 @@ int znd_media_register (const char *dev_name)
     zndmedia.devgeo = devgeo;
     m = &zndmedia.media;
 
+    core.numa_node = xztl_numa_dev_node (dev_name);
+    log_infoa ("znd-media: NUMA node %d (-1: unknown)", core.numa_node);
+
+    znd_media_scopy_check (dev);
+
     m->geo.ngrps  	 = devgeo->npugrp;
     m->geo.pu_grp 	 = devgeo->npunit;
     m->geo.zn_pu  	 = devgeo->nzone;
@@ -494,6 +757,24 @@ int znd_media_register (const char *dev_name)
     m->geo.nbytes 	 = devgeo->nbytes;
     m->geo.nbytes_oob    = devgeo->nbytes_oob;
 
+    zns = xnvme_znd_dev_get_ns (dev);
+    m->geo.zn_open   = (zns) ? znd_media_zone_limit (zns->mor) : 0;
+    m->geo.zn_active = (zns) ? znd_media_zone_limit (zns->mar) : 0;
+
+    log_infoa ("znd-media: Zone limits. open %d, active %d (0: no limit)",
+				    m->geo.zn_open, m->geo.zn_active);
+
+    /* Preferred write granularity is 0-based and reads as 0 if the
+     * namespace does not report it */
+    ns = xnvme_dev_get_ns (dev);
+    m->geo.sec_mcmd  = devgeo->mdts_nbytes / devgeo->nbytes;
+    m->geo.sec_wgran = (ns) ? ns->npwg + 1 : 1;
+    if (m->geo.sec_mcmd && m->geo.sec_wgran > m->geo.sec_mcmd)
+	m->geo.sec_wgran = 1;
+
+    log_infoa ("znd-media: Transfer limits. max %d sectors (0: no limit), "
+		    "write granularity %d", m->geo.sec_mcmd, m->geo.sec_wgran);
+
     m->init_fn   = znd_media_init;
     m->exit_fn   = znd_media_exit;
     m->submit_io = znd_media_submit_io;
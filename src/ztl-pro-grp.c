@@ -19,6 +19,7 @@
 
 #include <sys/queue.h>
 #include <stdlib.h>
+#include <unistd.h>
 #include <xztl.h>
 #include <xztl-ztl.h>
 #include <ztl.h>
@@ -26,6 +27,15 @@
 #include <libxnvme_znd.h>
 
 extern struct xztl_core core;
+extern struct app_group **glist;
+extern uint16_t app_ngrps;
+
+/* The device limits open and active zones for the whole namespace, so the
+ * budget is shared by all groups and provisioning types. A zero budget
+ * means no limit */
+static uint32_t		 pro_budget;
+static volatile uint32_t pro_nopen;
+static volatile uint32_t pro_nfinish; /* Open zones being finished */
 
 static void ztl_pro_grp_print_status (struct app_group *grp)
 {
@@ -35,7 +45,8 @@ static void ztl_pro_grp_print_status (struct app_group *grp)
 
     pro = (struct ztl_pro_grp *) grp->pro;
 
-    printf ("\nztl-pro group %d: free %d, used %d\n", grp->id, pro->nfree, pro->nused);
+    printf ("\nztl-pro group %d: free %d, used %d, reset %d\n", grp->id,
+				    pro->nfree, pro->nused, pro->nreset);
 
     for (type_i = 0; type_i < ZTL_PRO_TYPES; type_i++) {
 	if (pro->nopen[type_i])
@@ -52,37 +63,393 @@ static void ztl_pro_grp_print_status (struct app_group *grp)
     }
 }
 
+static inline uint64_t ztl_pro_grp_zone_left (struct ztl_pro_zone *zone)
+{
+    return zone->addr.g.sect + zone->capacity -
+				    zone->zmd_entry->wptr_inflight;
+}
+
+static inline uint8_t ztl_pro_grp_bucket (uint64_t nsec)
+{
+    uint8_t bucket = 63 - __builtin_clzll (nsec);
+
+    return (bucket >= ZTL_PRO_BUCKETS) ? ZTL_PRO_BUCKETS - 1 : bucket;
+}
+
+/* Must be called with pro->spin held */
+static void ztl_pro_grp_avlb_insert (struct ztl_pro_grp *pro,
+				     struct ztl_pro_zone *zone, uint16_t ptype)
+{
+    uint64_t left;
+
+    left = ztl_pro_grp_zone_left (zone);
+
+    /* Zones without space for a minimum piece are never selected */
+    if (zone->avlb || left < APP_PRO_MIN_PIECE_SZ)
+	return;
+
+    zone->bucket = ztl_pro_grp_bucket (left);
+    zone->avlb   = 1;
+    TAILQ_INSERT_TAIL (&pro->avlb_head[ptype][zone->bucket], zone, avlb_entry);
+    pro->avlb_map[ptype] |= (1U << zone->bucket);
+}
+
+/* Must be called with pro->spin held */
+static void ztl_pro_grp_avlb_remove (struct ztl_pro_grp *pro,
+				     struct ztl_pro_zone *zone, uint16_t ptype)
+{
+    if (!zone->avlb)
+	return;
+
+    TAILQ_REMOVE (&pro->avlb_head[ptype][zone->bucket], zone, avlb_entry);
+    if (TAILQ_EMPTY (&pro->avlb_head[ptype][zone->bucket]))
+	pro->avlb_map[ptype] &= ~(1U << zone->bucket);
+    zone->avlb = 0;
+}
+
+static void ztl_pro_grp_budget_stats (void)
+{
+    xztl_stats_set (XZTL_STATS_OPEN_ZONES, pro_nopen);
+}
+
+static int ztl_pro_grp_budget_get (void)
+{
+    uint32_t nopen;
+
+    do {
+	nopen = pro_nopen;
+	if (pro_budget && nopen >= pro_budget)
+	    return -1;
+    } while (!__sync_bool_compare_and_swap (&pro_nopen, nopen, nopen + 1));
+
+    ztl_pro_grp_budget_stats ();
+
+    return 0;
+}
+
+static void ztl_pro_grp_budget_put (void)
+{
+    __sync_fetch_and_sub (&pro_nopen, 1);
+    ztl_pro_grp_budget_stats ();
+}
+
+void ztl_pro_grp_budget_init (void)
+{
+    struct xztl_mgeo *g = &core.media->geo;
+
+    pro_budget = g->zn_open;
+    if (!pro_budget || (g->zn_active && g->zn_active < pro_budget))
+	pro_budget = g->zn_active;
+
+    pro_nopen   = 0;
+    pro_nfinish = 0;
+
+    xztl_stats_set (XZTL_STATS_OPEN_BUDGET, pro_budget);
+    ztl_pro_grp_budget_stats ();
+
+    log_infoa ("ztl-pro: Open zone budget: %d (0: no limit)", pro_budget);
+}
+
+/* Submits a zone management command on the provisioning media context.
+ * The command is synchronous if the asynchronous submission fails. The
+ * callback is called in both cases */
+static void ztl_pro_grp_submit_zn (struct ztl_pro_grp *pro,
+				   struct ztl_pro_zone *zone, uint8_t opcode,
+				   xztl_callback *callback)
+{
+    struct xztl_zn_mcmd *cmd = &zone->zn_cmd;
+
+    cmd->opcode    = opcode;
+    cmd->status    = 0;
+    cmd->asynch    = 1;
+    cmd->addr.addr = zone->addr.addr;
+    cmd->async_ctx = pro->tctx;
+    cmd->callback  = callback;
+    cmd->opaque    = zone;
+
+    zone->zn_inflight = 1;
+    __sync_fetch_and_add (&pro->nzn_inflight, 1);
+
+    /* The reset thread pokes the context to complete the command */
+    if (pro->tctx && !xztl_media_submit_zn (cmd)) {
+	ztl_pro_reset_wake ();
+	return;
+    }
+
+    cmd->asynch = 0;
+    if (xztl_media_submit_zn (cmd) && !cmd->status)
+	cmd->status = XZTL_ZTL_PROV_ERR;
+
+    callback (cmd);
+}
+
+static void ztl_pro_grp_finish_cb (void *arg)
+{
+    struct xztl_zn_mcmd *cmd;
+    struct ztl_pro_zone *zone;
+    struct ztl_pro_grp  *pro;
+
+    cmd  = (struct xztl_zn_mcmd *) arg;
+    zone = (struct ztl_pro_zone *) cmd->opaque;
+    pro  = (struct ztl_pro_grp *) zone->grp->pro;
+
+    if (cmd->status)
+	log_erra ("ztl-pro: Zone finish failure (%d/%d). status %d",
+			zone->addr.g.grp, zone->addr.g.zone, cmd->status);
+
+    /* The zone left provisioning and is full for the ZTL, also if it was
+     * finished before the end. It is recycled by ztl_pro_grp_put_zone, the
+     * reset recovers a failed finish */
+    pthread_spin_lock (&pro->spin);
+    xztl_atomic_int64_update (&zone->zmd_entry->wptr,
+				    zone->addr.g.sect + zone->capacity);
+    xztl_atomic_int64_update (&zone->zmd_entry->wptr_inflight,
+				    zone->addr.g.sect + zone->capacity);
+    pthread_spin_unlock (&pro->spin);
+
+    __sync_fetch_and_sub (&pro_nfinish, 1);
+    ztl_pro_grp_budget_put ();
+
+    zone->zn_inflight = 0;
+    __sync_fetch_and_sub (&pro->nzn_inflight, 1);
+}
+
+/* Finishes an open zone already removed from the open and free space lists */
+static void ztl_pro_grp_finish_open (struct ztl_pro_grp *pro,
+				     struct ztl_pro_zone *zone, uint16_t type)
+{
+    xztl_atomic_int16_update (&zone->zmd_entry->flags,
+				zone->zmd_entry->flags ^ XZTL_ZMD_OPEN);
+    __sync_fetch_and_sub (&pro->nopen[type], 1);
+
+    __sync_fetch_and_add (&pro_nfinish, 1);
+    ztl_pro_grp_submit_zn (pro, zone, XZTL_ZONE_MGMT_FINISH,
+						ztl_pro_grp_finish_cb);
+}
+
+/* Finishes an open zone of the group to release budget. The least useful
+ * zone is the one with less space left within the type holding more open
+ * zones. Zones locked by a writer are skipped */
+static int ztl_pro_grp_reclaim_grp (struct app_group *grp)
+{
+    struct ztl_pro_zone *zone, *victim = NULL;
+    struct ztl_pro_grp  *pro;
+    uint64_t left, vleft = 0;
+    uint16_t type_i, vtype = 0;
+
+    pro = (struct ztl_pro_grp *) grp->pro;
+
+    pthread_spin_lock (&pro->spin);
+
+    for (type_i = 0; type_i < ZTL_PRO_TYPES; type_i++) {
+	if (victim && pro->nopen[type_i] < pro->nopen[vtype])
+	    continue;
+
+	TAILQ_FOREACH (zone, &pro->open_head[type_i], open_entry) {
+	    if (zone->lock || zone->zn_inflight)
+		continue;
+
+	    left = ztl_pro_grp_zone_left (zone);
+	    if (!victim || pro->nopen[type_i] > pro->nopen[vtype] ||
+							    left < vleft) {
+		victim = zone;
+		vleft  = left;
+		vtype  = type_i;
+	    }
+	}
+    }
+
+    if (!victim) {
+	pthread_spin_unlock (&pro->spin);
+	return -1;
+    }
+
+    ztl_pro_grp_avlb_remove (pro, victim, vtype);
+    TAILQ_REMOVE (&pro->open_head[vtype], victim, open_entry);
+    pthread_spin_unlock (&pro->spin);
+
+    ZDEBUG (ZDEBUG_PRO, "ztl-pro-grp (reclaim): (%d/%d/0x%lx) type %d, "
+						    "left %lu",
+			victim->addr.g.grp,
+			victim->addr.g.zone,
+	     (uint64_t) victim->addr.g.sect,
+			vtype,
+			vleft);
+
+    xztl_stats_inc (XZTL_STATS_OPEN_FINISH, 1);
+
+    ztl_pro_grp_finish_open (pro, victim, vtype);
+
+    return 0;
+}
+
+/* The budget is shared by all groups, so the open zones holding it may
+ * belong to other groups. The caller group is tried first */
+static int ztl_pro_grp_reclaim (struct app_group *grp)
+{
+    uint16_t grp_i;
+
+    if (!ztl_pro_grp_reclaim_grp (grp))
+	return 0;
+
+    for (grp_i = 1; grp_i < app_ngrps; grp_i++) {
+	if (!ztl_pro_grp_reclaim_grp (glist[(grp->id + grp_i) % app_ngrps]))
+	    return 0;
+    }
+
+    return -1;
+}
+
+/* Finishes the open zones of a type no level writes to anymore, so they do
+ * not hold budget. Zones locked by a writer return to the type and are left
+ * to the budget reclaim */
+void ztl_pro_grp_retire (uint16_t type)
+{
+    struct ztl_pro_zone *zone;
+    struct ztl_pro_grp  *pro;
+    uint16_t grp_i;
+
+    for (grp_i = 0; grp_i < app_ngrps; grp_i++) {
+	pro = (struct ztl_pro_grp *) glist[grp_i]->pro;
+
+	do {
+	    pthread_spin_lock (&pro->spin);
+	    TAILQ_FOREACH (zone, &pro->open_head[type], open_entry) {
+		if (!zone->lock && !zone->zn_inflight)
+		    break;
+	    }
+	    if (zone) {
+		ztl_pro_grp_avlb_remove (pro, zone, type);
+		TAILQ_REMOVE (&pro->open_head[type], zone, open_entry);
+	    }
+	    pthread_spin_unlock (&pro->spin);
+
+	    if (zone) {
+		ZDEBUG (ZDEBUG_PRO, "ztl-pro-grp (retire): (%d/%d) type %d",
+			zone->addr.g.grp, zone->addr.g.zone, type);
+		ztl_pro_grp_finish_open (pro, zone, type);
+	    }
+	} while (zone);
+    }
+}
+
+static void ztl_pro_grp_reset_cb (void *arg)
+{
+    struct xztl_zn_mcmd  *cmd;
+    struct ztl_pro_zone  *zone;
+    struct ztl_pro_grp   *pro;
+    struct app_zmd_entry *zmde;
+
+    cmd  = (struct xztl_zn_mcmd *) arg;
+    zone = (struct ztl_pro_zone *) cmd->opaque;
+    pro  = (struct ztl_pro_grp *) zone->grp->pro;
+    zmde = zone->zmd_entry;
+
+    if (cmd->status) {
+
+	/* Move zone out of provisioning */
+	log_erra ("ztl-pro (reset): Zone reset failure (%d/%d). status %d",
+			zone->addr.g.grp, zone->addr.g.zone, cmd->status);
+	xztl_atomic_int16_update (&zmde->flags, 0);
+
+    } else {
+
+	xztl_atomic_int64_update (&zmde->wptr, zone->addr.g.sect);
+	xztl_atomic_int64_update (&zmde->wptr_inflight, zone->addr.g.sect);
+
+	pthread_spin_lock (&pro->spin);
+	TAILQ_INSERT_TAIL (&pro->free_head[zone->addr.g.punit % pro->npu],
+								zone, entry);
+	pthread_spin_unlock (&pro->spin);
+
+	__sync_fetch_and_add (&pro->nfree, 1);
+
+	ZDEBUG (ZDEBUG_PRO, "ztl-pro-grp (reset): (%d/%d/0x%lx)",
+			zone->addr.g.grp,
+			zone->addr.g.zone,
+	     (uint64_t) zone->addr.g.sect);
+    }
+
+    __sync_fetch_and_sub (&pro->nreset_inflight, 1);
+    zone->zn_inflight = 0;
+    __sync_fetch_and_sub (&pro->nzn_inflight, 1);
+}
+
 static struct ztl_pro_zone *ztl_pro_grp_zone_open (struct app_group *grp,
-						   uint8_t ptype)
+					    uint8_t ptype, uint16_t level)
 {
     struct ztl_pro_grp   *pro;
     struct ztl_pro_zone  *zone;
     struct xztl_zn_mcmd   cmd;
     struct app_zmd_entry *zmde;
+    uint64_t              birth;
+    uint32_t retry;
+    uint16_t pu_i;
     int ret;
 
     pro  = (struct ztl_pro_grp *) grp->pro;
 
+    /* Wait for budget, finish an open zone if no finish is on the way */
+    for (retry = 0; ztl_pro_grp_budget_get (); retry++) {
+	if (retry >= ZTL_PRO_BUDGET_RETRY) {
+	    log_infoa ("ztl-pro (open): Open zone budget exhausted. Grp %d.",
+								    grp->id);
+	    return NULL;
+	}
+
+	if (pro_nopen - pro_nfinish >= pro_budget)
+	    ztl_pro_grp_reclaim (grp);
+
+	usleep (1);
+    }
+
     pthread_spin_lock (&pro->spin);
-    zone = TAILQ_FIRST (&pro->free_head);
-    if (!zone) {
-	log_infoa ("ztl-pro (open): No zones left. Grp %d.", grp->id);
+
+    /* Spread open zones across parallel units */
+    zone = NULL;
+    for (pu_i = 0; pu_i < pro->npu && !zone; pu_i++)
+	zone = TAILQ_FIRST (&pro->free_head[(pro->pu_next + pu_i) % pro->npu]);
+
+    if (zone) {
+	pro->pu_next = (zone->addr.g.punit + 1) % pro->npu;
+	TAILQ_REMOVE (&pro->free_head[zone->addr.g.punit % pro->npu],
+								zone, entry);
+	TAILQ_INSERT_TAIL (&pro->used_head, zone, entry);
 	pthread_spin_unlock (&pro->spin);
-	return NULL;
+
+	xztl_atomic_int32_update (&pro->nfree, pro->nfree - 1);
+	if (pro->nfree + pro->nreset_inflight < core.config.reset_pool)
+	    ztl_pro_reset_wake ();
+    } else {
+
+	/* No reset zone is ready, take one that still needs a reset */
+	zone = TAILQ_FIRST (&pro->reset_head);
+	if (!zone) {
+	    log_infoa ("ztl-pro (open): No zones left. Grp %d.", grp->id);
+	    pthread_spin_unlock (&pro->spin);
+	    ztl_pro_grp_budget_put ();
+	    return NULL;
+	}
+	TAILQ_REMOVE (&pro->reset_head, zone, entry);
+	TAILQ_INSERT_TAIL (&pro->used_head, zone, entry);
+	pthread_spin_unlock (&pro->spin);
+
+	xztl_atomic_int32_update (&pro->nreset, pro->nreset - 1);
     }
-    TAILQ_REMOVE (&pro->free_head, zone, entry);
-    TAILQ_INSERT_TAIL (&pro->used_head, zone, entry);
-    pthread_spin_unlock (&pro->spin);
 
-    xztl_atomic_int32_update (&pro->nfree, pro->nfree - 1);
     xztl_atomic_int32_update (&pro->nused, pro->nused + 1);
 
     zmde = zone->zmd_entry;
     xztl_atomic_int16_update (&zmde->flags, zmde->flags | XZTL_ZMD_USED);
 
-    /* Reset the zone if write pointer is at the end */
+    /* Reset the zone if write pointer is at the end. It only happens if
+     * the reset thread did not reset the zone in advance */
     if (zmde->wptr > zone->addr.g.sect) {
+	while (zone->zn_inflight)
+	    usleep (1);
+
 	cmd.opcode    = XZTL_ZONE_MGMT_RESET;
+	cmd.asynch    = 0;
 	cmd.addr.addr = zone->addr.addr;
 	ret = xztl_media_submit_zn (&cmd);
     	if (ret || cmd.status) {
@@ -92,16 +459,24 @@ static struct ztl_pro_zone *ztl_pro_grp_zone_open (struct app_group *grp,
 	}
     }
 
-    /* A single thread is used for each provisioning type, no lock needed */
+    /* The zone is returned to the caller and only becomes available for
+     * other requests when the caller frees it */
     xztl_atomic_int16_update (&zmde->flags, zmde->flags | XZTL_ZMD_OPEN);
+    pthread_spin_lock (&pro->spin);
     TAILQ_INSERT_TAIL (&pro->open_head[ptype], zone, open_entry);
-    xztl_atomic_int32_update (&pro->nopen[ptype], pro->nopen[ptype] + 1);
+    pthread_spin_unlock (&pro->spin);
+    __sync_fetch_and_add (&pro->nopen[ptype], 1);
 
     xztl_atomic_int64_update (&zmde->wptr, zone->addr.g.sect);
     xztl_atomic_int64_update (&zmde->wptr_inflight, zone->addr.g.sect);
     xztl_atomic_int32_update (&zmde->npieces, 0);
     xztl_atomic_int32_update (&zmde->ndeletes, 0);
-    xztl_atomic_int16_update (&zmde->level, ptype);
+
+    /* Zones may be shared by levels with the same predicted lifetime, the
+     * level opening the zone is kept for lifetime samples on delete */
+    birth = xztl_time_us ();
+    xztl_atomic_int16_update (&zmde->level, level);
+    xztl_atomic_int64_update (&zmde->birth, birth);
 
     return zone;
 
@@ -116,6 +491,7 @@ ERR:
     pthread_spin_unlock (&pro->spin);
 
     xztl_atomic_int32_update (&pro->nused, pro->nused - 1);
+    ztl_pro_grp_budget_put ();
 
     return NULL;
 }
@@ -125,36 +501,80 @@ struct ztl_pro_zone *ztl_pro_grp_get_best_zone (struct app_group *grp,
 {
     struct ztl_pro_zone *zone;
     struct ztl_pro_grp  *pro;
-    uint64_t off;
-    uint32_t min_piece;
+    uint32_t min_piece, map;
+    uint8_t bucket;
 
     pro = (struct ztl_pro_grp *) grp->pro;
     min_piece = (multi) ? APP_PRO_MIN_PIECE_SZ : nsec;
+    bucket = ztl_pro_grp_bucket (min_piece);
+
+    pthread_spin_lock (&pro->spin);
 
-    /* Scan open zones: Pick the first available on the list */
-    TAILQ_FOREACH (zone, &pro->open_head[ptype], open_entry) {
-	off = (zone->zmd_entry->addr.g.sect + zone->capacity) - min_piece;
-	if ( (zone->zmd_entry->wptr_inflight <= off) && !zone->lock)
-	    return zone;
+    /* Prefer the fullest zone that fits the piece. Zones in the lowest
+     * candidate bucket may be smaller than the piece, check the head */
+    zone = TAILQ_FIRST (&pro->avlb_head[ptype][bucket]);
+    if (!zone || ztl_pro_grp_zone_left (zone) < min_piece) {
+	zone = NULL;
+	map  = (bucket + 1 < ZTL_PRO_BUCKETS) ?
+		pro->avlb_map[ptype] & ~((1U << (bucket + 1)) - 1) : 0;
+	if (map)
+	    zone = TAILQ_FIRST (&pro->avlb_head[ptype][__builtin_ctz (map)]);
+    }
 
-	/* We may need to finish the zone if the space left is less
-	 * than APP_PRO_MIN_PIECE_SZ */
+    if (zone) {
+	ztl_pro_grp_avlb_remove (pro, zone, ptype);
+	zone->lock = 1;
     }
 
-    return NULL;
+    pthread_spin_unlock (&pro->spin);
+
+    return zone;
+}
+
+/* Number of zones a request is striped across. Each zone receives at least
+ * ZTL_PRO_STRIPE_SEC sectors, so small writes stay in a single zone. The
+ * width is limited by the free slots in the device queue, since more
+ * zones than slots do not add parallelism. A single request never takes
+ * more than half of the open zone budget, so it does not wait for zones
+ * it has locked itself */
+uint32_t ztl_pro_grp_stripe (uint32_t nsec)
+{
+    uint32_t width, outs, qfree;
+
+    width = nsec / ZTL_PRO_STRIPE_SEC;
+    if (width > core.config.pro_stripe)
+	width = core.config.pro_stripe;
+
+    if (ztl()->wca && ztl()->wca->outstanding_fn) {
+	outs  = ztl()->wca->outstanding_fn ();
+	qfree = (outs < core.config.nvme_depth) ?
+				core.config.nvme_depth - outs : 0;
+	if (width > qfree)
+	    width = qfree;
+    }
+
+    if (pro_budget && width > pro_budget / 2)
+	width = pro_budget / 2;
+
+    return (width) ? width : 1;
 }
 
+/* Appends the zones to the addresses already in the context. On failure,
+ * only the zones taken by this call are released */
 int ztl_pro_grp_get (struct app_group *grp, struct app_pro_addr *ctx,
-				uint32_t nsec, uint16_t ptype, uint8_t multi)
+				uint32_t nsec, uint16_t ptype, uint8_t multi,
+				uint32_t stripe)
 {
     struct ztl_pro_zone *zone;
-    uint64_t sec_left, zn_i, sec_zn, sec_avlb;
+    uint64_t sec_left, zn_i, zn_first, sec_zn, sec_avlb;
 
     sec_left = nsec;
-    zn_i = 0;
-    ctx->naddr = 0;
+    zn_i = zn_first = ctx->naddr;
+
+    if (!stripe)
+	stripe = 1;
 
-    sec_zn = (multi) ? nsec / ZTL_PRO_STRIPE : nsec;
+    sec_zn = (multi) ? nsec / stripe : nsec;
     if (!sec_zn)
 	sec_zn = ZTL_WCA_SEC_MCMD_MIN;
     else if (sec_zn % ZTL_WCA_SEC_MCMD_MIN != 0)
@@ -163,13 +583,13 @@ int ztl_pro_grp_get (struct app_group *grp, struct app_pro_addr *ctx,
     while (sec_left) {
 	zone = ztl_pro_grp_get_best_zone (grp, sec_zn, ptype, multi);
 	if (!zone) {
-	    zone = ztl_pro_grp_zone_open (grp, ptype);
+	    zone = ztl_pro_grp_zone_open (grp, ptype, ctx->level);
 	    if (!zone) {
 		log_erra ("ztl-pro-grp: Zone open failed. Type %x", ptype);
-		return -1;
+		goto ERR;
 	    }
+	    zone->lock = 1;
 	}
-	zone->lock = 1;
 
 	ctx->naddr++;
 	ctx->addr[zn_i].addr = zone->addr.addr;
@@ -217,7 +637,11 @@ int ztl_pro_grp_get (struct app_group *grp, struct app_pro_addr *ctx,
     return 0;
 
 NO_LEFT:
-    while (zn_i) {
+    log_erra ("ztl-pro (get): No zones left. Group %d", grp->id);
+
+ERR:
+    /* Release zones locked by this request */
+    while (zn_i > zn_first) {
 	zn_i--;
 	ztl_pro_grp_free (grp, ctx->addr[zn_i].g.zone, 0, ptype);
 	ctx->naddr--;
@@ -225,8 +649,6 @@ NO_LEFT:
 	ctx->nsec[zn_i] = 0;
     }
 
-    log_erra ("ztl-pro (get): No zones left. Group %d", grp->id);
-
     return -1;
 }
 
@@ -235,14 +657,12 @@ void ztl_pro_grp_free (struct app_group *grp, uint32_t zone_i,
 {
     struct ztl_pro_zone *zone;
     struct ztl_pro_grp  *pro;
-    struct xztl_zn_mcmd  cmd;
-    int ret;
 
     pro = (struct ztl_pro_grp *) grp->pro;
     zone = &((struct ztl_pro_grp *) grp->pro)->vzones[zone_i];
 
-    /* Move the write pointer */
-    /* A single thread touches the write pointer, no lock needed */
+    /* Move the write pointer. The zone is locked by the write being freed
+     * (zone->lock), reclaim skips it, so no other thread moves the pointer */
     zone->zmd_entry->wptr += nsec;
 
     /* Check if the zone should be finished according to minimum write size */
@@ -250,23 +670,30 @@ void ztl_pro_grp_free (struct app_group *grp, uint32_t zone_i,
 				 + zone->capacity
 				 - (ZTL_WCA_SEC_MCMD_MIN - 1)) {
 
+	pthread_spin_lock (&pro->spin);
 	TAILQ_REMOVE (&pro->open_head[type], zone, open_entry);
+	pthread_spin_unlock (&pro->spin);
 	xztl_atomic_int16_update (&zone->zmd_entry->flags,
 				    zone->zmd_entry->flags ^ XZTL_ZMD_OPEN);
-	xztl_atomic_int32_update (&pro->nopen[type], pro->nopen[type] - 1);
-
-	/* Explicit closes the zone */
-        cmd.opcode    = XZTL_ZONE_MGMT_FINISH;
-        cmd.addr.addr = zone->addr.addr;
-        ret = xztl_media_submit_zn (&cmd);
-	if (ret || cmd.status) {
-	    log_erra ("ztl-pro: Zone finish failure (%d/%d). status %d",
-			    zone->addr.g.grp, zone->addr.g.zone, cmd.status);
-	}
+	__sync_fetch_and_sub (&pro->nopen[type], 1);
 
-    }
+	/* Explicit closes the zone. Completion is asynchronous, so the
+	 * finish overlaps with user I/O */
+	__sync_fetch_and_add (&pro_nfinish, 1);
+	ztl_pro_grp_submit_zn (pro, zone, XZTL_ZONE_MGMT_FINISH,
+						    ztl_pro_grp_finish_cb);
+
+	zone->lock = 0;
 
-    zone->lock = 0;
+    } else {
+
+	/* Zone is available again for provisioning */
+	pthread_spin_lock (&pro->spin);
+	zone->lock = 0;
+	ztl_pro_grp_avlb_insert (pro, zone, type);
+	pthread_spin_unlock (&pro->spin);
+
+    }
 
     ZDEBUG (ZDEBUG_PRO, "ztl-pro-grp (free): (%d/%d/0x%lx/0x%lx) type %d",
 		zone->addr.g.grp,
@@ -303,6 +730,7 @@ int ztl_pro_grp_finish_zn (struct app_group *grp, uint32_t zid, uint8_t type)
 			zone->addr.g.sect + zone->capacity - zmde->wptr);
 
     cmd.opcode = XZTL_ZONE_MGMT_FINISH;
+    cmd.asynch = 0;
     cmd.addr.g.zone = zmde->addr.g.zone;
 
     ret = xztl_media_submit_zn (&cmd);
@@ -312,10 +740,14 @@ int ztl_pro_grp_finish_zn (struct app_group *grp, uint32_t zid, uint8_t type)
     zmde->wptr = zone->addr.g.sect + zone->capacity;
 
     if (zmde->flags & XZTL_ZMD_OPEN) {
+	pthread_spin_lock (&pro->spin);
+	ztl_pro_grp_avlb_remove (pro, zone, type);
 	TAILQ_REMOVE (&pro->open_head[type], zone, open_entry);
+	pthread_spin_unlock (&pro->spin);
 	xztl_atomic_int16_update (&zone->zmd_entry->flags,
 				    zone->zmd_entry->flags ^ XZTL_ZMD_OPEN);
-	xztl_atomic_int32_update (&pro->nopen[type], pro->nopen[type] - 1);
+	__sync_fetch_and_sub (&pro->nopen[type], 1);
+	ztl_pro_grp_budget_put ();
     }
 
     ZDEBUG (ZDEBUG_PRO, "ztl-pro-grp (finish): (%d/%d/0x%lx/0x%lx) type %d",
@@ -374,12 +806,14 @@ int ztl_pro_grp_put_zone (struct app_group *grp, uint32_t zone_i)
     xztl_atomic_int16_update (&zmde->flags, zmde->flags ^ XZTL_ZMD_USED);
     xztl_atomic_int32_update (&pro->nused, pro->nused - 1);
 
+    /* The zone is reset in background by ztl_pro_grp_reset_pool */
     pthread_spin_lock (&pro->spin);
     TAILQ_REMOVE (&pro->used_head, zone, entry);
-    TAILQ_INSERT_TAIL (&pro->free_head, zone, entry);
+    TAILQ_INSERT_TAIL (&pro->reset_head, zone, entry);
     pthread_spin_unlock (&pro->spin);
 
-    xztl_atomic_int32_update (&pro->nfree, pro->nfree + 1);
+    xztl_atomic_int32_update (&pro->nreset, pro->nreset + 1);
+    ztl_pro_reset_wake ();
 
     xztl_stats_inc (XZTL_STATS_RECYCLED_ZONES, 1);
     xztl_stats_inc (XZTL_STATS_RECYCLED_BYTES,
@@ -391,10 +825,49 @@ int ztl_pro_grp_put_zone (struct app_group *grp, uint32_t zone_i)
     return 0;
 }
 
+int ztl_pro_grp_reset_pool (struct app_group *grp)
+{
+    struct ztl_pro_zone  *zone;
+    struct ztl_pro_grp   *pro;
+    int nreset = 0;
+
+    pro = (struct ztl_pro_grp *) grp->pro;
+
+    while (pro->nfree + pro->nreset_inflight < core.config.reset_pool) {
+
+	pthread_spin_lock (&pro->spin);
+	zone = TAILQ_FIRST (&pro->reset_head);
+	if (!zone) {
+	    pthread_spin_unlock (&pro->spin);
+	    break;
+	}
+
+	/* Wait for the zone finish to complete before resetting */
+	if (zone->zn_inflight) {
+	    pthread_spin_unlock (&pro->spin);
+	    break;
+	}
+
+	TAILQ_REMOVE (&pro->reset_head, zone, entry);
+	pthread_spin_unlock (&pro->spin);
+
+	__sync_fetch_and_sub (&pro->nreset, 1);
+	__sync_fetch_and_add (&pro->nreset_inflight, 1);
+
+	/* The zone is inserted in the free list by the callback */
+	ztl_pro_grp_submit_zn (pro, zone, XZTL_ZONE_MGMT_RESET,
+						    ztl_pro_grp_reset_cb);
+	nreset++;
+    }
+
+    return nreset;
+}
+
 static void ztl_pro_grp_zones_free (struct app_group *grp)
 {
     struct ztl_pro_zone *zone;
     struct ztl_pro_grp  *pro;
+    uint16_t pu_i;
     uint8_t ptype;
 
     pro = (struct ztl_pro_grp *) grp->pro;
@@ -404,14 +877,22 @@ static void ztl_pro_grp_zones_free (struct app_group *grp)
     	TAILQ_REMOVE (&pro->used_head, zone, entry);
     }
 
-    while (!TAILQ_EMPTY (&pro->free_head)) {
-	zone = TAILQ_FIRST (&pro->free_head);
-        TAILQ_REMOVE (&pro->free_head, zone, entry);
+    for (pu_i = 0; pu_i < pro->npu; pu_i++) {
+	while (!TAILQ_EMPTY (&pro->free_head[pu_i])) {
+	    zone = TAILQ_FIRST (&pro->free_head[pu_i]);
+	    TAILQ_REMOVE (&pro->free_head[pu_i], zone, entry);
+	}
+    }
+
+    while (!TAILQ_EMPTY (&pro->reset_head)) {
+	zone = TAILQ_FIRST (&pro->reset_head);
+	TAILQ_REMOVE (&pro->reset_head, zone, entry);
     }
 
     for (ptype = 0; ptype < ZTL_PRO_TYPES; ptype++) {
 	while (!TAILQ_EMPTY (&pro->open_head[ptype])) {
 	    zone = TAILQ_FIRST (&pro->open_head[ptype]);
+	    ztl_pro_grp_avlb_remove (pro, zone, ptype);
 	    TAILQ_REMOVE (&pro->open_head[ptype], zone, open_entry);
 	}
     }
@@ -419,14 +900,14 @@ static void ztl_pro_grp_zones_free (struct app_group *grp)
     free (pro->vzones);
 }
 
-int ztl_pro_grp_init (struct app_group *grp)
+int ztl_pro_grp_init (struct app_group *grp, struct xztl_mthread_ctx *tctx)
 {
     struct xnvme_spec_znd_descr *zinfo;
     struct xnvme_znd_report    *rep;
     struct ztl_pro_zone  *zone;
     struct app_zmd_entry *zmde;
     struct ztl_pro_grp   *pro;
-    uint8_t ptype;
+    uint8_t ptype, bucket;
 
     int ntype, zone_i;
 
@@ -446,14 +927,26 @@ int ztl_pro_grp_init (struct app_group *grp)
 	return XZTL_ZTL_PROV_ERR;
     }
 
-    grp->pro = pro;
-    rep      = grp->zmd.report;
+    grp->pro  = pro;
+    pro->tctx = tctx;
+    rep       = grp->zmd.report;
 
-    TAILQ_INIT (&pro->free_head);
+    pro->npu     = (core.media->geo.pu_grp < ZTL_PRO_PUNITS) ?
+				core.media->geo.pu_grp : ZTL_PRO_PUNITS;
+    pro->pu_next = 0;
+    if (!pro->npu)
+	pro->npu = 1;
+
+    for (ntype = 0; ntype < ZTL_PRO_PUNITS; ntype++)
+	TAILQ_INIT (&pro->free_head[ntype]);
     TAILQ_INIT (&pro->used_head);
+    TAILQ_INIT (&pro->reset_head);
 
     for (ntype = 0; ntype < ZTL_PRO_TYPES; ntype++) {
 	TAILQ_INIT (&pro->open_head[ntype]);
+	for (bucket = 0; bucket < ZTL_PRO_BUCKETS; bucket++)
+	    TAILQ_INIT (&pro->avlb_head[ntype][bucket]);
+	pro->avlb_map[ntype] = 0;
     }
 
     for (zone_i = 0; zone_i < grp->zmd.entries; zone_i++) {
@@ -481,6 +974,7 @@ int ztl_pro_grp_init (struct app_group *grp)
 	zone->state     = zinfo->zs;
 	zone->zmd_entry = zmde;
 	zone->lock      = 0;
+	zone->grp       = grp;
 
 	switch (zinfo->zs) {
 	    case XNVME_SPEC_ZND_STATE_EMPTY:
@@ -495,7 +989,8 @@ int ztl_pro_grp_init (struct app_group *grp)
 
 		zmde->npieces  = 0;
 		zmde->ndeletes = 0;
-		TAILQ_INSERT_TAIL (&pro->free_head, zone, entry);
+		TAILQ_INSERT_TAIL (&pro->free_head[zone->addr.g.punit % pro->npu],
+								zone, entry);
 		pro->nfree++;
 
 		ZDEBUG (ZDEBUG_PRO_GRP, " ZINFO: (%d/%d) empty\n",
@@ -518,6 +1013,7 @@ int ztl_pro_grp_init (struct app_group *grp)
 
 		pro->nused++;
 		pro->nopen[ptype]++;
+		__sync_fetch_and_add (&pro_nopen, 1);
 
 		ZDEBUG (ZDEBUG_PRO_GRP, " ZINFO: (%d/%d) open\n",
 				zmde->addr.g.grp, zmde->addr.g.zone);
@@ -547,8 +1043,13 @@ int ztl_pro_grp_init (struct app_group *grp)
 	}
 
 	zmde->wptr = zmde->wptr_inflight = zinfo->wp;
+
+	if (zmde->flags & XZTL_ZMD_OPEN)
+	    ztl_pro_grp_avlb_insert (pro, zone, ZTL_PRO_TUSER);
     }
 
+    ztl_pro_grp_budget_stats ();
+
     log_infoa ("ztl-pro: Started. Group %d.", grp->id);
     return 0;
 }
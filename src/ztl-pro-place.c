@@ -0,0 +1,133 @@
+/* xZTL: Zone Translation Layer User-space Library
+ *
+ * Copyright 2019 Samsung Electronics
+ *
+ * Written by Ivan L. Picoli <i.picoli@samsung.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+*/
+
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <xztl.h>
+#include <xztl-ztl.h>
+#include <ztl.h>
+
+/* Lifetime-aware placement
+ *
+ * Each user level keeps a moving average of the lifetime of its data,
+ * measured from zone open to trim or delete. Levels with lifetimes in
+ * the same power of two (in milliseconds) share a provisioning type, so
+ * data expected to die together is written to the same zones. Levels
+ * without enough samples keep a type of their own.
+ *
+ * A level moves to a new class only when its average leaves the current
+ * class by more than a quarter of the class bounds, so an average close
+ * to a power of two does not flip the type at every sample. When the last
+ * level leaves a type, the open zones of that type are finished.
+ */
+
+struct ztl_pro_place_level {
+    uint64_t lifetime;	/* Moving average in microseconds */
+    uint32_t nsamples;
+    uint16_t ptype;	/* Current provisioning type */
+};
+
+static struct ztl_pro_place_level place_lvl[ZTL_PRO_TYPES];
+static uint32_t place_users[ZTL_PRO_TYPES];
+
+static uint16_t ztl_pro_place_unsampled (uint16_t level)
+{
+    return ZTL_PRO_PLACE_CLASSES +
+			(level % (ZTL_PRO_TYPES - ZTL_PRO_PLACE_CLASSES));
+}
+
+static uint16_t ztl_pro_place_class (struct ztl_pro_place_level *lvl)
+{
+    uint64_t msec, lo, hi;
+    uint16_t class;
+
+    msec  = lvl->lifetime / 1000;
+    class = lvl->ptype;
+
+    /* Hysteresis, keep the sampled class while close to its bounds */
+    if (class < ZTL_PRO_PLACE_CLASSES) {
+	lo = (class) ? 1UL << class : 0;
+	hi = 2UL << class;
+	if (msec >= lo - lo / 4 && (class == ZTL_PRO_PLACE_CLASSES - 1 ||
+						    msec < hi + hi / 4))
+	    return class;
+    }
+
+    class = (msec) ? 63 - __builtin_clzll (msec) : 0;
+
+    return (class < ZTL_PRO_PLACE_CLASSES) ?
+				    class : ZTL_PRO_PLACE_CLASSES - 1;
+}
+
+uint16_t ztl_pro_place_type (uint16_t level)
+{
+    return place_lvl[level].ptype;
+}
+
+void ztl_pro_place_death (struct app_zmd_entry *zmde, uint16_t level)
+{
+    struct ztl_pro_place_level *lvl;
+    uint64_t now, life, avg;
+    uint16_t old, new;
+
+    if (level >= ZTL_PRO_TYPES || !zmde->birth)
+	return;
+
+    now = xztl_time_us ();
+    if (now < zmde->birth)
+	return;
+
+    lvl  = &place_lvl[level];
+    life = now - zmde->birth;
+
+    /* Exponential moving average, new samples weight 1/8 */
+    avg = lvl->lifetime;
+    avg = (lvl->nsamples) ? avg - (avg >> 3) + (life >> 3) : life;
+    xztl_atomic_int64_update (&lvl->lifetime, avg);
+    if (__sync_add_and_fetch (&lvl->nsamples, 1) < ZTL_PRO_PLACE_SAMPLES)
+	return;
+
+    old = lvl->ptype;
+    new = ztl_pro_place_class (lvl);
+
+    ZDEBUG (ZDEBUG_PRO, "ztl-pro-place: level %d, life %lu us, avg %lu us, "
+					    "type %d -> %d", level, life, avg,
+					    old, new);
+
+    if (new == old || !__sync_bool_compare_and_swap (&lvl->ptype, old, new))
+	return;
+
+    __sync_fetch_and_add (&place_users[new], 1);
+    if (!__sync_sub_and_fetch (&place_users[old], 1))
+	ztl_pro_grp_retire (old);
+}
+
+void ztl_pro_place_init (void)
+{
+    uint16_t level;
+
+    memset (place_lvl, 0x0, sizeof (place_lvl));
+    memset (place_users, 0x0, sizeof (place_users));
+
+    for (level = 0; level < ZTL_PRO_TYPES; level++) {
+	place_lvl[level].ptype = ztl_pro_place_unsampled (level);
+	place_users[place_lvl[level].ptype]++;
+    }
+}
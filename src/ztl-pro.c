@@ -19,25 +19,44 @@
 
 #include <sys/queue.h>
 #include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
 #include <xztl.h>
 #include <xztl-mempool.h>
 #include <xztl-ztl.h>
 #include <ztl.h>
 
-extern uint32_t app_ngrps;
+extern uint16_t app_ngrps;
+
+/* Indexed by group ID */
 struct app_group **glist;
 static uint16_t cur_grp[ZTL_PRO_TYPES];
 
-void ztl_pro_free (struct app_pro_addr *ctx)
+static pthread_t	reset_thread;
+static volatile uint8_t reset_running;
+static struct xztl_poll reset_poll;
+
+/* Media context for asynchronous zone management commands */
+static struct xztl_mthread_ctx *pro_tctx;
+
+static void ztl_pro_release (struct app_pro_addr *ctx)
 {
-    uint32_t zn_i;
+    uint32_t zn_i, grp_i;
 
     for (zn_i = 0; zn_i < ctx->naddr; zn_i++)
-	ztl_pro_grp_free (ctx->grp, ctx->addr[zn_i].g.zone,
-					    ctx->nsec[zn_i], ctx->ptype);
+	ztl_pro_grp_free (glist[ctx->addr[zn_i].g.grp],
+			  ctx->addr[zn_i].g.zone,
+			  ctx->nsec[zn_i], ctx->ptype);
 
-    /* We assume a single group for now */
-    app_grp_ctx_sub (ctx->grp);
+    for (grp_i = 0; grp_i < app_ngrps; grp_i++) {
+	if (ctx->grp_map & (1U << grp_i))
+	    app_grp_ctx_sub (glist[grp_i]);
+    }
+}
+
+void ztl_pro_free (struct app_pro_addr *ctx)
+{
+    ztl_pro_release (ctx);
 
     xztl_mempool_put (ctx->mp_entry, XZTL_ZTL_PRO_CTX, ctx->thread_id);
 }
@@ -47,6 +66,8 @@ struct app_pro_addr *ztl_pro_new (uint32_t nsec, uint16_t type, uint8_t multi)
     struct xztl_mp_entry *mpe;
     struct app_pro_addr *ctx;
     struct app_group *grp;
+    uint32_t stripe, ngrps, grp_i, sec_grp, sec_left;
+    uint16_t ptype;
     int ret;
 
     ZDEBUG (ZDEBUG_PRO, "ztl-pro      (new): nsec %d, type %d", nsec, type);
@@ -64,28 +85,64 @@ struct app_pro_addr *ztl_pro_new (uint32_t nsec, uint16_t type, uint8_t multi)
 
     ctx = (struct app_pro_addr *) mpe->opaque;
 
-    /* For now, we consider a single group */
-    grp = glist[cur_grp[type]];
-
-    ret = ztl_pro_grp_get (grp, ctx, nsec, type, multi);
-    if (ret) {
-	xztl_mempool_put (mpe, XZTL_ZTL_PRO_CTX, type);
-	log_erra ("ztl-pro: Get group zone failed. Type %x", type);
-	return NULL;
-    }
+    /* The user level (type) selects the open zones by predicted lifetime */
+    ptype = ztl_pro_place_type (type);
 
-    ctx->grp       = grp;
+    ctx->naddr     = 0;
+    ctx->grp_map   = 0;
+    ctx->grp       = glist[cur_grp[type]];
     ctx->thread_id = type;
-    ctx->ptype     = type;
+    ctx->ptype     = ptype;
+    ctx->level     = type;
     ctx->mp_entry  = mpe;
 
-    app_grp_ctx_add (grp);
-
-    /* We do not check for disabled groups (disabled by built-in functions).
-     * For now, it is ok because we don't have garbage collection */
-    cur_grp[type] = (cur_grp[type] == app_ngrps - 1) ? 0 : cur_grp[type] + 1;
+    /* Multi-piece requests are striped across groups, the stripe width is
+     * split among them. Single-piece requests round-robin across groups */
+    stripe = ztl_pro_grp_stripe (nsec);
+    ngrps  = (multi) ? app_ngrps : 1;
+    if (ngrps > stripe)
+	ngrps = stripe;
+    if (ngrps > nsec)
+	ngrps = nsec;
+    if (!ngrps)
+	ngrps = 1;
+
+    sec_grp  = nsec / ngrps;
+    sec_left = nsec;
+
+    for (grp_i = 0; grp_i < ngrps; grp_i++) {
+
+	/* We do not check for disabled groups (disabled by built-in
+	 * functions). For now, it is ok because we don't have garbage
+	 * collection */
+	grp = glist[cur_grp[type]];
+	cur_grp[type] = (cur_grp[type] == app_ngrps - 1) ?
+						    0 : cur_grp[type] + 1;
+
+	ret = ztl_pro_grp_get (grp, ctx,
+			(grp_i == ngrps - 1) ? sec_left : sec_grp,
+			ptype, multi, stripe / ngrps);
+	if (ret) {
+	    log_erra ("ztl-pro: Get group zone failed. Grp %d, Type %x",
+								grp->id, type);
+	    goto FREE;
+	}
+
+	sec_left -= (grp_i == ngrps - 1) ? sec_left : sec_grp;
+
+	app_grp_ctx_add (grp);
+	ctx->grp_map |= (1U << grp->id);
+    }
 
     return ctx;
+
+FREE:
+    for (grp_i = 0; grp_i < ctx->naddr; grp_i++)
+	ctx->nsec[grp_i] = 0;
+    ztl_pro_release (ctx);
+    xztl_mempool_put (mpe, XZTL_ZTL_PRO_CTX, type);
+
+    return NULL;
 }
 
 int ztl_pro_put_zone (struct app_group *grp, uint32_t zid)
@@ -103,10 +160,92 @@ void ztl_pro_check_gc (struct app_group *grp)
 
 }
 
+static void ztl_pro_poke_ctx (void)
+{
+    struct xztl_misc_cmd misc;
+
+    misc.opcode		  = XZTL_MISC_ASYNCH_POKE;
+    misc.asynch.ctx_ptr   = pro_tctx;
+    misc.asynch.limit     = 0;
+    misc.asynch.count     = 0;
+
+    pthread_spin_lock (&pro_tctx->qpair_spin);
+    xztl_media_submit_misc (&misc);
+    pthread_spin_unlock (&pro_tctx->qpair_spin);
+}
+
+/* Waits for in-flight zone management commands of all groups */
+static void ztl_pro_wait_zn (void)
+{
+    struct ztl_pro_grp *pro;
+    uint32_t grp_i;
+
+    for (grp_i = 0; grp_i < app_ngrps; grp_i++) {
+	pro = (struct ztl_pro_grp *) glist[grp_i]->pro;
+	while (pro->nzn_inflight) {
+	    ztl_pro_poke_ctx ();
+	    usleep (1);
+	}
+    }
+}
+
+/* Wakes the reset thread, called when zones are recycled, when a group
+ * pool drops below its target and when zone commands are submitted */
+void ztl_pro_reset_wake (void)
+{
+    xztl_poll_wake (&reset_poll);
+}
+
+/* Keeps a pool of empty zones per group, so opening a zone in the write
+ * path does not wait for a zone reset. Resets and finishes are submitted
+ * asynchronously and completed by poking the provisioning context. The
+ * thread parks until woken, or polls every ZTL_PRO_RESET_USEC while zone
+ * commands are in flight */
+static void *ztl_pro_reset_th (void *arg)
+{
+    struct ztl_pro_grp *pro;
+    uint32_t grp_i, key, idle = 0, inflight;
+    int nreset;
+
+    xztl_thread_place (XZTL_THREAD_BG);
+
+    while (reset_running) {
+	key      = xztl_poll_key (&reset_poll);
+	nreset   = 0;
+	inflight = 0;
+
+	for (grp_i = 0; grp_i < app_ngrps; grp_i++) {
+	    nreset += ztl_pro_grp_reset_pool (glist[grp_i]);
+
+	    pro = (struct ztl_pro_grp *) glist[grp_i]->pro;
+	    inflight += pro->nzn_inflight;
+	}
+
+	if (inflight)
+	    ztl_pro_poke_ctx ();
+
+	if (nreset) {
+	    idle = 0;
+	    continue;
+	}
+
+	xztl_poll_idle (&reset_poll, key, &idle,
+				    (inflight) ? ZTL_PRO_RESET_USEC : 0);
+    }
+
+    return NULL;
+}
+
 void ztl_pro_exit (void)
 {
     int ret;
 
+    reset_running = 0;
+    xztl_poll_wake (&reset_poll);
+    pthread_join (reset_thread, NULL);
+
+    ztl_pro_wait_zn ();
+
     ret = ztl()->groups.get_list_fn (glist, app_ngrps);
     if (ret != app_ngrps)
 	log_infoa ("ztl-pro (exit): Groups mismatch (%d,%d).", ret, app_ngrps);
@@ -116,6 +255,7 @@ void ztl_pro_exit (void)
 	ztl_pro_grp_exit (glist[ret]);
     }
 
+    xztl_ctx_media_exit (pro_tctx);
     free (glist);
 
     log_info ("ztl-pro: Global provisioning stopped.");
@@ -152,7 +292,7 @@ static void ztl_mempool_exit (void)
 
 int ztl_pro_init (void)
 {
-    int ret, grp_i;
+    int ret, grp_i, tid;
 
     glist = calloc (sizeof (struct app_group *), app_ngrps);
     if (!glist)
@@ -165,13 +305,30 @@ int ztl_pro_init (void)
     if (ret != app_ngrps)
 	goto MP;
 
+    tid = xztl_mempool_free_tid (XZTL_MEMPOOL_MCMD);
+    pro_tctx = (tid < 0) ? NULL :
+			   xztl_ctx_media_init (tid, ZTL_PRO_CTX_DEPTH);
+    if (!pro_tctx) {
+	log_err ("ztl-pro: Media context not started.");
+	goto MP;
+    }
+
+    ztl_pro_grp_budget_init ();
+    ztl_pro_place_init ();
+
     for (grp_i = 0; grp_i < app_ngrps; grp_i++) {
-	if (ztl_pro_grp_init (glist[grp_i]))
+	if (ztl_pro_grp_init (glist[grp_i], pro_tctx))
 	    goto EXIT;
     }
 
     memset (cur_grp, 0x0, sizeof (uint16_t) * ZTL_PRO_TYPES);
 
+    reset_running = 1;
+    if (pthread_create (&reset_thread, NULL, ztl_pro_reset_th, NULL)) {
+	log_err ("ztl-pro: Reset thread not started.");
+	goto EXIT;
+    }
+
     log_info ("ztl-pro: Global provisioning started.");
 
     return XZTL_OK;
@@ -181,6 +338,7 @@ EXIT:
 	grp_i--;
 	ztl_pro_grp_exit (glist[grp_i]);
     }
+    xztl_ctx_media_exit (pro_tctx);
 
 MP:
     ztl_mempool_exit ();
@@ -198,7 +356,8 @@ static struct app_pro_mod ztl_pro = {
     .finish_zn_fn	= ztl_pro_finish_zone,
     .put_zone_fn	= ztl_pro_put_zone,
     .new_fn		= ztl_pro_new,
-    .free_fn		= ztl_pro_free
+    .free_fn		= ztl_pro_free,
+    .death_fn		= ztl_pro_place_death
 };
 
 void ztl_pro_register (void)
@@ -24,9 +24,27 @@
 #include <ztl.h>
 #include <unistd.h>
 #include <sched.h>
+#include <time.h>
 
 #define ZTL_MCMD_ENTS	 XZTL_IO_MAX_MCMD
 
+/* Small writes with ZTL-managed mapping are packed byte by byte in DMA
+ * buffers and written together. A staging buffer holds objects of a single
+ * level and is written by a single media command. Staging time, slots and
+ * buffers are set by xztl_config (coal_usec, coal_slots, coal_bufs) */
+#define ZTL_WCA_COAL_POKE_USEC	10 /* Poke interval, coalesced writes */
+
+struct ztl_wca_coal {
+    void		*buf;
+    uint64_t		 bytes;	/* Staged bytes */
+    uint32_t		 nucmd;	/* Staged user commands */
+    uint16_t		 level;
+    uint64_t		 us;	/* Time the first object was staged */
+    struct app_pro_addr *prov;
+    STAILQ_HEAD (coal_ucmd_head, xztl_io_ucmd) ucmd_head;
+    STAILQ_ENTRY (ztl_wca_coal) entry;
+};
+
 extern struct xztl_core core;
 
 STAILQ_HEAD (uc_head, xztl_io_ucmd)  ucmd_head;
@@ -34,6 +52,15 @@ static pthread_spinlock_t     	     ucmd_spin;
 static struct xztl_mthread_ctx      *tctx;
 static pthread_t		     wca_thread;
 static uint8_t 			     wca_running;
+static struct xztl_poll		     wca_poll;
+
+STAILQ_HEAD (coal_head, ztl_wca_coal) coal_free;
+static pthread_spinlock_t	     coal_spin;
+static struct ztl_wca_coal	     coal_bufs[ZTL_WCA_COAL_BUFS_MAX];
+static struct ztl_wca_coal	    *coal_slot[ZTL_WCA_COAL_SLOTS_MAX];
+static volatile uint32_t	     coal_inflight;
+static uint64_t			     coal_bytes; /* Staging buffer size */
+static uint64_t			     coal_max;	 /* Largest staged object */
 
 /* This function checks if the media offsets are sequential.
  * If not, we return a negative value. For now we do not support
@@ -75,7 +102,9 @@ static void ztl_wca_reorg_ucmd_off (struct xztl_io_ucmd *ucmd)
 
 	/* Or zone is not the same as the previous one */
 	     (ucmd->mcmd[off_i]->addr[0].g.zone !=
-	      ucmd->mcmd[off_i -1]->addr[0].g.zone) ) {
+	      ucmd->mcmd[off_i -1]->addr[0].g.zone) ||
+	     (ucmd->mcmd[off_i]->addr[0].g.grp !=
+	      ucmd->mcmd[off_i -1]->addr[0].g.grp) ) {
 
 	    /* Close the piece and set first offset + size */
 	    ucmd->moffset[curr] = ucmd->moffset[first_off];
@@ -108,14 +137,61 @@ static void ztl_wca_reorg_ucmd_off (struct xztl_io_ucmd *ucmd)
     ucmd->noffs = (ucmd->nmcmd > 1) ? curr : 1;
 }
 
+/* Sectors spanned by a byte length */
+static uint32_t ztl_wca_nsec (uint64_t bytes)
+{
+    uint32_t nbytes = core.media->geo.nbytes;
+
+    return (bytes + nbytes - 1) / nbytes;
+}
+
+/* Stage latencies of a successful write, each stage is measured from the
+ * previous stamped stage. Writes above the slow threshold are logged */
+static void ztl_wca_ucmd_stages (struct xztl_io_ucmd *ucmd)
+{
+    uint64_t *st = ucmd->us_stage;
+    uint64_t lat[XZTL_UCMD_STAGES], prev, total;
+    uint32_t st_i;
+
+    if (ucmd->status || !st[XZTL_UCMD_SUBMIT])
+	return;
+
+    total = xztl_time_us () - st[XZTL_UCMD_SUBMIT];
+    prev  = st[XZTL_UCMD_SUBMIT];
+
+    for (st_i = XZTL_UCMD_DEQUEUE; st_i < XZTL_UCMD_STAGES; st_i++) {
+	lat[st_i] = 0;
+	if (!st[st_i])
+	    continue;
+
+	lat[st_i] = (st[st_i] > prev) ? st[st_i] - prev : 0;
+	prev = (st[st_i] > prev) ? st[st_i] : prev;
+
+	xztl_stats_lat_add (XZTL_STATS_LAT_W_QUEUE + st_i - XZTL_UCMD_DEQUEUE,
+								lat[st_i]);
+    }
+    xztl_stats_lat_add (XZTL_STATS_LAT_W_TOTAL, total);
+
+    if (!core.config.slow_write_us || total < core.config.slow_write_us)
+	return;
+
+    log_infoa ("ztl-wca: Slow write. ID %lu, bytes %lu, total %lu us: "
+	    "queue %lu, prov %lu, submit %lu, device %lu, handoff %lu, "
+	    "map %lu", ucmd->id, ucmd->size, total,
+	    lat[XZTL_UCMD_DEQUEUE], lat[XZTL_UCMD_PROV],
+	    lat[XZTL_UCMD_MSUBMIT], lat[XZTL_UCMD_MDONE],
+	    lat[XZTL_UCMD_CALLBACK], lat[XZTL_UCMD_MAPPED]);
+}
+
 static void ztl_wca_callback_mcmd (void *arg)
 {
     struct xztl_io_ucmd  *ucmd;
     struct xztl_io_mcmd  *mcmd;
     struct app_map_entry map;
+    struct app_map_ext ext;
     struct app_zmd_entry *zmd;
     uint64_t old;
-    int ret, off_i;
+    int ret, off_i, last;
 
     mcmd = (struct xztl_io_mcmd *) arg;
     ucmd = (struct xztl_io_ucmd *) mcmd->opaque;
@@ -131,7 +207,12 @@ static void ztl_wca_callback_mcmd (void *arg)
     }
 
     pthread_spin_lock (&ucmd->inflight_spin);
-    xztl_atomic_int16_update (&ucmd->ncb, ucmd->ncb + 1);
+    if (mcmd->us_end > ucmd->us_stage[XZTL_UCMD_MDONE])
+	ucmd->us_stage[XZTL_UCMD_MDONE] = mcmd->us_end;
+
+    /* Callbacks may run in several completion threads, only the last one
+     * completes the user command */
+    last = (++ucmd->ncb == ucmd->nmcmd);
     pthread_spin_unlock (&ucmd->inflight_spin);
 
     if (mcmd->status)
@@ -145,8 +226,9 @@ static void ztl_wca_callback_mcmd (void *arg)
 
     xztl_mempool_put (mcmd->mp_cmd, XZTL_MEMPOOL_MCMD, ZTL_PRO_TUSER);
 
-    if (ucmd->ncb == ucmd->nmcmd) {
+    if (last) {
 
+	ucmd->us_stage[XZTL_UCMD_CALLBACK] = xztl_time_us ();
 	ucmd->noffs = 0;
 
 	/* Update mapping if managed by the ZTL */
@@ -157,9 +239,12 @@ static void ztl_wca_callback_mcmd (void *arg)
 	    if (!ztl_wca_check_offset_seq (ucmd)) {
 		map.addr     = 0;
 		map.g.offset = ucmd->moffset[0];
-		map.g.nsec   = ucmd->msec[0];
+		map.g.nsec   = ztl_wca_nsec (ucmd->size);
 		map.g.multi  = 0;
-		ret = ztl()->map->upsert_fn (ucmd->id, map.addr, &old, 0);
+		ext.val      = 0;
+		ext.g.len    = ucmd->size;
+		ret = ztl()->map->upsert_ext_fn (ucmd->id, map.addr,
+							    ext.val, &old);
 		if (ret)
 		    ucmd->status = XZTL_ZTL_MAP_ERR;
 	    } else {
@@ -174,7 +259,9 @@ static void ztl_wca_callback_mcmd (void *arg)
 
 
 	for (off_i = 0; off_i < ucmd->noffs; off_i++) {
-	    zmd = ztl()->zmd->get_fn (ucmd->prov->grp, ucmd->moffset[off_i], 1);
+	    zmd = ztl()->zmd->get_fn (
+			ztl()->groups.get_by_offset_fn (ucmd->moffset[off_i]),
+			ucmd->moffset[off_i], 1);
 	    xztl_atomic_int32_update (&zmd->npieces, zmd->npieces + 1);
 
 	    if (ZDEBUG_WCA) {
@@ -186,6 +273,9 @@ static void ztl_wca_callback_mcmd (void *arg)
 
 	ztl()->pro->free_fn (ucmd->prov);
 
+	ucmd->us_stage[XZTL_UCMD_MAPPED] = xztl_time_us ();
+	ztl_wca_ucmd_stages (ucmd);
+
 	if (ucmd->callback) {
 	    ucmd->completed = 1;
 	    pthread_spin_destroy (&ucmd->inflight_spin);
@@ -196,6 +286,22 @@ static void ztl_wca_callback_mcmd (void *arg)
     }
 }
 
+/* Commands outstanding in the device queue of the write context. Called
+ * by the write thread only, through provisioning */
+static uint32_t ztl_wca_outstanding (void)
+{
+    struct xztl_misc_cmd misc;
+
+    misc.opcode		  = XZTL_MISC_ASYNCH_OUTS;
+    misc.asynch.ctx_ptr   = tctx;
+    misc.asynch.count     = 0;
+
+    if (xztl_media_submit_misc (&misc))
+	return 0;
+
+    return misc.asynch.count;
+}
+
 static void ztl_wca_callback (struct xztl_io_mcmd *mcmd)
 {
     ztl_wca_callback_mcmd (mcmd);
@@ -203,10 +309,15 @@ static void ztl_wca_callback (struct xztl_io_mcmd *mcmd)
 
 static int ztl_wca_submit (struct xztl_io_ucmd *ucmd)
 {
+    memset (ucmd->us_stage, 0x0, sizeof (ucmd->us_stage));
+    ucmd->us_stage[XZTL_UCMD_SUBMIT] = xztl_time_us ();
+
     pthread_spin_lock (&ucmd_spin);
     STAILQ_INSERT_TAIL (&ucmd_head, ucmd, entry);
     pthread_spin_unlock (&ucmd_spin);
 
+    xztl_poll_wake (&wca_poll);
+
     return 0;
 }
 
@@ -216,8 +327,8 @@ static uint32_t ztl_wca_ncmd_prov_based (struct app_pro_addr *prov)
 
     ncmd = 0;
     for (zn_i = 0; zn_i < prov->naddr; zn_i++) {
-	ncmd += prov->nsec[zn_i] / ZTL_WCA_SEC_MCMD;
-	if (prov->nsec[zn_i] % ZTL_WCA_SEC_MCMD != 0)
+	ncmd += prov->nsec[zn_i] / core.config.wca_sec_mcmd;
+	if (prov->nsec[zn_i] % core.config.wca_sec_mcmd != 0)
 	    ncmd++;
     }
 
@@ -238,30 +349,342 @@ static void ztl_wca_poke_ctx (void) {
     }
 }
 
+static void ztl_wca_coal_complete (struct xztl_io_ucmd *ucmd)
+{
+    ucmd->us_stage[XZTL_UCMD_MAPPED] = xztl_time_us ();
+    ztl_wca_ucmd_stages (ucmd);
+
+    if (ucmd->callback) {
+	ucmd->completed = 1;
+	ucmd->callback (ucmd);
+    } else {
+	ucmd->completed = 1;
+    }
+}
+
+static void ztl_wca_coal_put (struct ztl_wca_coal *coal)
+{
+    coal->bytes = 0;
+    coal->nucmd = 0;
+    coal->prov  = NULL;
+    STAILQ_INIT (&coal->ucmd_head);
+
+    pthread_spin_lock (&coal_spin);
+    STAILQ_INSERT_TAIL (&coal_free, coal, entry);
+    pthread_spin_unlock (&coal_spin);
+}
+
+/* Objects are mapped to the sector of the written buffer holding their first
+ * byte, plus the byte offset within that sector. The byte position within
+ * the staging buffer is kept in moffset[0] while staged */
+static void ztl_wca_coal_callback_mcmd (void *arg)
+{
+    struct ztl_wca_coal *coal;
+    struct xztl_io_ucmd *ucmd;
+    struct xztl_io_mcmd *mcmd;
+    struct app_map_entry map;
+    struct app_map_ext ext;
+    struct app_zmd_entry *zmd;
+    uint32_t nbytes = core.media->geo.nbytes;
+    uint64_t old, now;
+    uint8_t status;
+
+    mcmd = (struct xztl_io_mcmd *) arg;
+    coal = (struct ztl_wca_coal *) mcmd->opaque;
+    status = (mcmd->status) ? XZTL_ZTL_WCA_S2_ERR : 0;
+    now = xztl_time_us ();
+
+    if (mcmd->status)
+	log_erra ("ztl-wca: Coalesced write failed. level %d, bytes %lu, "
+		    "objects %d. St: %d", coal->level, coal->bytes,
+		    coal->nucmd, mcmd->status);
+
+    while (!STAILQ_EMPTY (&coal->ucmd_head)) {
+	ucmd = STAILQ_FIRST (&coal->ucmd_head);
+	STAILQ_REMOVE_HEAD (&coal->ucmd_head, entry);
+
+	ucmd->us_stage[XZTL_UCMD_MDONE]    = mcmd->us_end;
+	ucmd->us_stage[XZTL_UCMD_CALLBACK] = now;
+
+	ucmd->status = status;
+	if (!status) {
+	    ext.val      = 0;
+	    ext.g.boff   = ucmd->moffset[0] % nbytes;
+	    ext.g.len    = ucmd->size;
+	    ucmd->moffset[0] = mcmd->paddr[0] + ucmd->moffset[0] / nbytes;
+	    ucmd->msec[0]    = ztl_wca_nsec (ext.g.boff + ucmd->size);
+
+	    map.addr     = 0;
+	    map.g.offset = ucmd->moffset[0];
+	    map.g.nsec   = ucmd->msec[0];
+	    map.g.multi  = 0;
+	    if (ztl()->map->upsert_ext_fn (ucmd->id, map.addr,
+							ext.val, &old)) {
+		ucmd->status = XZTL_ZTL_MAP_ERR;
+	    } else {
+		zmd = ztl()->zmd->get_fn (
+			ztl()->groups.get_by_offset_fn (ucmd->moffset[0]),
+			ucmd->moffset[0], 1);
+		xztl_atomic_int32_update (&zmd->npieces, zmd->npieces + 1);
+	    }
+	}
+
+	ucmd->noffs = (ucmd->status) ? 0 : 1;
+	ucmd->ncb   = 1;
+	ztl_wca_coal_complete (ucmd);
+    }
+
+    xztl_mempool_put (mcmd->mp_cmd, XZTL_MEMPOOL_MCMD, ZTL_PRO_TUSER);
+    ztl()->pro->free_fn (coal->prov);
+    ztl_wca_coal_put (coal);
+
+    __sync_fetch_and_sub (&coal_inflight, 1);
+    xztl_poll_wake (&wca_poll);
+}
+
+static void ztl_wca_coal_fail (struct ztl_wca_coal *coal)
+{
+    struct xztl_io_ucmd *ucmd;
+
+    while (!STAILQ_EMPTY (&coal->ucmd_head)) {
+	ucmd = STAILQ_FIRST (&coal->ucmd_head);
+	STAILQ_REMOVE_HEAD (&coal->ucmd_head, entry);
+
+	ucmd->status = XZTL_ZTL_WCA_S_ERR;
+	ztl_wca_coal_complete (ucmd);
+    }
+
+    ztl_wca_coal_put (coal);
+}
+
+/* Group commit: the staged objects of a level are written as one command */
+static void ztl_wca_coal_flush (uint32_t slot_i)
+{
+    struct ztl_wca_coal *coal = coal_slot[slot_i];
+    struct xztl_mp_entry *mp_cmd;
+    struct xztl_io_mcmd *mcmd;
+    struct xztl_io_ucmd *ucmd;
+    struct app_pro_addr *prov;
+    uint64_t now;
+    uint32_t nsec;
+
+    if (!coal)
+	return;
+
+    coal_slot[slot_i] = NULL;
+
+    /* Pad the last sector */
+    nsec = ztl_wca_nsec (coal->bytes);
+    memset ((char *) coal->buf + coal->bytes, 0x0,
+		    (uint64_t) nsec * core.media->geo.nbytes - coal->bytes);
+
+    prov = ztl()->pro->new_fn (nsec, coal->level, 0);
+    if (!prov) {
+	log_erra ("ztl-wca: Provisioning failed. nsec %d, prov_type %d",
+						    nsec, coal->level);
+	goto FAILURE;
+    }
+    coal->prov = prov;
+
+    /* Staging time is accounted as provisioning */
+    now = xztl_time_us ();
+    STAILQ_FOREACH (ucmd, &coal->ucmd_head, entry) {
+	ucmd->us_stage[XZTL_UCMD_PROV]    = now;
+	ucmd->us_stage[XZTL_UCMD_MSUBMIT] = now;
+    }
+
+    mp_cmd = xztl_mempool_get (XZTL_MEMPOOL_MCMD, ZTL_PRO_TUSER);
+    if (!mp_cmd) {
+	log_err ("ztl-wca: Mempool failed.");
+	goto FAIL_PROV;
+    }
+
+    mcmd = (struct xztl_io_mcmd *) mp_cmd->opaque;
+
+    memset (mcmd, 0x0, sizeof (struct xztl_io_mcmd));
+    mcmd->mp_cmd    = mp_cmd;
+    mcmd->opcode    = (XZTL_WRITE_APPEND) ? XZTL_ZONE_APPEND : XZTL_CMD_WRITE;
+    mcmd->naddr     = 1;
+    mcmd->nsec[0]   = nsec;
+    mcmd->addr[0].g.grp  = prov->addr[0].g.grp;
+    mcmd->addr[0].g.zone = prov->addr[0].g.zone;
+
+    if (!XZTL_WRITE_APPEND)
+	mcmd->addr[0].g.sect = (uint64_t) prov->addr[0].g.sect;
+
+    mcmd->prp[0]    = (uint64_t) coal->buf;
+    mcmd->callback  = ztl_wca_coal_callback_mcmd;
+    mcmd->opaque    = coal;
+    mcmd->async_ctx = tctx;
+
+    __sync_fetch_and_add (&coal_inflight, 1);
+
+    if (xztl_media_submit_io (mcmd)) {
+	__sync_fetch_and_sub (&coal_inflight, 1);
+	xztl_mempool_put (mp_cmd, XZTL_MEMPOOL_MCMD, ZTL_PRO_TUSER);
+	goto FAIL_PROV;
+    }
+
+    mcmd->submitted = 1;
+
+    xztl_stats_inc (XZTL_STATS_COAL_MCMD, 1);
+    xztl_stats_inc (XZTL_STATS_COAL_UCMD, coal->nucmd);
+
+    ZDEBUG (ZDEBUG_WCA, "ztl-wca: Coalesced write. level %d, bytes %lu, "
+			"objects %d", coal->level, coal->bytes, coal->nucmd);
+    return;
+
+FAIL_PROV:
+    prov->nsec[0] = 0;
+    ztl()->pro->free_fn (prov);
+FAILURE:
+    ztl_wca_coal_fail (coal);
+}
+
+static void ztl_wca_coal_flush_all (void)
+{
+    uint32_t slot_i;
+
+    for (slot_i = 0; slot_i < core.config.coal_slots; slot_i++)
+	ztl_wca_coal_flush (slot_i);
+}
+
+/* Staged objects are flushed as soon as no coalesced write is in-flight.
+ * Objects arriving while a write is in-flight are committed together with
+ * the next write, bounded by coal_usec. Returns the time until the next
+ * staged object is due, 0 if nothing is staged */
+static uint64_t ztl_wca_coal_idle (void)
+{
+    uint32_t slot_i;
+    uint64_t now, age, due = 0, max = core.config.coal_usec;
+
+    now = xztl_time_us ();
+
+    for (slot_i = 0; slot_i < core.config.coal_slots; slot_i++) {
+	if (!coal_slot[slot_i])
+	    continue;
+
+	age = now - coal_slot[slot_i]->us;
+	if (!coal_inflight || age >= max) {
+	    ztl_wca_coal_flush (slot_i);
+	    continue;
+	}
+
+	if (!due || max - age < due)
+	    due = max - age;
+    }
+
+    if (coal_inflight)
+	ztl_wca_poke_ctx ();
+
+    return due;
+}
+
+/* Waits for a completed coalesced write if all buffers are in-flight */
+static struct ztl_wca_coal *ztl_wca_coal_get (void)
+{
+    struct ztl_wca_coal *coal;
+    uint32_t key, idle = 0;
+
+    while (1) {
+	key = xztl_poll_key (&wca_poll);
+
+	pthread_spin_lock (&coal_spin);
+	coal = STAILQ_FIRST (&coal_free);
+	if (coal)
+	    STAILQ_REMOVE_HEAD (&coal_free, entry);
+	pthread_spin_unlock (&coal_spin);
+
+	if (coal)
+	    return coal;
+
+	ztl_wca_poke_ctx ();
+	xztl_poll_idle (&wca_poll, key, &idle, ZTL_WCA_COAL_POKE_USEC);
+    }
+}
+
+/* Returns 0 if the user command was staged */
+static int ztl_wca_coal_stage (struct xztl_io_ucmd *ucmd)
+{
+    struct ztl_wca_coal *coal;
+    uint32_t slot_i, free_i, old_i, nslots;
+
+    if (ucmd->app_md || !ucmd->size || ucmd->size > coal_max)
+	return -1;
+
+    nslots = core.config.coal_slots;
+    free_i = nslots;
+    old_i  = 0;
+    for (slot_i = 0; slot_i < nslots; slot_i++) {
+	if (!coal_slot[slot_i]) {
+	    if (free_i == nslots)
+		free_i = slot_i;
+	    continue;
+	}
+	if (coal_slot[slot_i]->level == ucmd->prov_type)
+	    break;
+	if (!coal_slot[old_i] || coal_slot[slot_i]->us < coal_slot[old_i]->us)
+	    old_i = slot_i;
+    }
+
+    /* Make room for a new level by committing the oldest slot */
+    if (slot_i == nslots) {
+	if (free_i == nslots) {
+	    ztl_wca_coal_flush (old_i);
+	    free_i = old_i;
+	}
+	slot_i = free_i;
+    } else if (coal_slot[slot_i]->bytes + ucmd->size > coal_bytes) {
+	ztl_wca_coal_flush (slot_i);
+    }
+
+    coal = coal_slot[slot_i];
+    if (!coal) {
+	coal = ztl_wca_coal_get ();
+	coal->level = ucmd->prov_type;
+	coal->us = xztl_time_us ();
+	coal_slot[slot_i] = coal;
+    }
+
+    memcpy ((char *) coal->buf + coal->bytes, ucmd->buf, ucmd->size);
+
+    ucmd->prov       = NULL;
+    ucmd->nmcmd      = 1;
+    ucmd->ncb        = 0;
+    ucmd->completed  = 0;
+    ucmd->moffset[0] = coal->bytes;
+
+    coal->bytes += ucmd->size;
+    coal->nucmd++;
+    STAILQ_INSERT_TAIL (&coal->ucmd_head, ucmd, entry);
+
+    if (coal->bytes == coal_bytes)
+	ztl_wca_coal_flush (slot_i);
+
+    return 0;
+}
+
 static void ztl_wca_process_ucmd (struct xztl_io_ucmd *ucmd)
 {
     struct app_pro_addr *prov;
     struct xztl_mp_entry *mp_cmd;
     struct xztl_io_mcmd *mcmd;
     uint32_t nsec, nsec_zn, ncmd, cmd_i, zn_i, submitted;
-    int zn_cmd_id[ZTL_PRO_STRIPE * 2];
+    int zn_cmd_id[APP_PRO_MAX_OFFS];
     uint64_t boff;
     int ret, ncmd_zn, zncmd_i;
 
     ZDEBUG (ZDEBUG_WCA, "ztl-wca: Processing user write. ID %lu", ucmd->id);
 
-    nsec = ucmd->size / core.media->geo.nbytes;
-
-    /* We do not support non-aligned buffers */
-    if (ucmd->size % (core.media->geo.nbytes * ZTL_WCA_SEC_MCMD_MIN != 0)) {
-	log_erra ("ztl-wca: Buffer is not aligned to %d bytes: %lu bytes.",
-		    core.media->geo.nbytes * ZTL_WCA_SEC_MCMD_MIN, ucmd->size);
-	goto FAILURE;
-    }
+    /* The last sector is padded by the buffer contents, the mapping keeps
+     * the exact size for ZTL-managed objects */
+    nsec = ztl_wca_nsec (ucmd->size);
+    if (nsec % ZTL_WCA_SEC_MCMD_MIN != 0)
+	nsec += ZTL_WCA_SEC_MCMD_MIN - (nsec % ZTL_WCA_SEC_MCMD_MIN);
 
-    /* First we check the number of commands based on ZTL_WCA_SEC_MCMD */
-    ncmd = nsec / ZTL_WCA_SEC_MCMD;
-    if (nsec % ZTL_WCA_SEC_MCMD != 0)
+    /* First we check the number of commands based on the media write size */
+    ncmd = nsec / core.config.wca_sec_mcmd;
+    if (nsec % core.config.wca_sec_mcmd != 0)
 	ncmd++;
 
     if (ncmd > XZTL_IO_MAX_MCMD) {
@@ -281,6 +704,7 @@ static void ztl_wca_process_ucmd (struct xztl_io_ucmd *ucmd)
 						    nsec, ucmd->prov_type);
 	goto FAILURE;
     }
+    ucmd->us_stage[XZTL_UCMD_PROV] = xztl_time_us ();
 
     /* We check the number of commands again based on the provisioning */
     ncmd = ztl_wca_ncmd_prov_based (prov);
@@ -299,14 +723,14 @@ static void ztl_wca_process_ucmd (struct xztl_io_ucmd *ucmd)
 
     ZDEBUG (ZDEBUG_WCA, "ztl-wca: NMCMD: %d", ncmd);
 
-    for (zn_i = 0; zn_i < ZTL_PRO_STRIPE * 2; zn_i++)
+    for (zn_i = 0; zn_i < APP_PRO_MAX_OFFS; zn_i++)
 	zn_cmd_id[zn_i] = -1;
 
     /* Populate media commands */
     cmd_i = 0;
     for (zn_i = 0; zn_i < prov->naddr; zn_i++) {
-	ncmd_zn = prov->nsec[zn_i] / ZTL_WCA_SEC_MCMD;
-	if (prov->nsec[zn_i] % ZTL_WCA_SEC_MCMD != 0)
+	ncmd_zn = prov->nsec[zn_i] / core.config.wca_sec_mcmd;
+	if (prov->nsec[zn_i] % core.config.wca_sec_mcmd != 0)
 	    ncmd_zn++;
 
 	nsec_zn = prov->nsec[zn_i];
@@ -334,8 +758,8 @@ static void ztl_wca_process_ucmd (struct xztl_io_ucmd *ucmd)
 	    mcmd->sequence_zn = zn_i;
 	    mcmd->naddr     = 1;
 	    mcmd->status    = 0;
-	    mcmd->nsec[0]   = (nsec_zn >= ZTL_WCA_SEC_MCMD) ?
-					  ZTL_WCA_SEC_MCMD : nsec_zn;
+	    mcmd->nsec[0]   = (nsec_zn >= core.config.wca_sec_mcmd) ?
+					  core.config.wca_sec_mcmd : nsec_zn;
 
 	    mcmd->addr[0].g.grp  = prov->addr[zn_i].g.grp;
 	    mcmd->addr[0].g.zone = prov->addr[zn_i].g.zone;
@@ -366,7 +790,7 @@ static void ztl_wca_process_ucmd (struct xztl_io_ucmd *ucmd)
     ZDEBUG (ZDEBUG_WCA, "ztl-wca: Populated: %d", cmd_i);
 
     /* Submit media commands */
-    for (cmd_i = 0; cmd_i < ZTL_PRO_STRIPE * 2; cmd_i++)
+    for (cmd_i = 0; cmd_i < APP_PRO_MAX_OFFS; cmd_i++)
 	ucmd->minflight[cmd_i] = 0;
 
     pthread_spin_init(&ucmd->inflight_spin, 0);
@@ -396,6 +820,10 @@ static void ztl_wca_process_ucmd (struct xztl_io_ucmd *ucmd)
 		pthread_spin_unlock (&ucmd->inflight_spin);
 	    }
 
+	    /* Stamped before the last submission, it may complete first */
+	    if (submitted == ncmd - 1)
+		ucmd->us_stage[XZTL_UCMD_MSUBMIT] = xztl_time_us ();
+
 	    ret = xztl_media_submit_io (ucmd->mcmd[zn_cmd_id[zn_i]]);
 	    if (ret)
 		goto FAIL_SUBMIT;
@@ -404,7 +832,7 @@ static void ztl_wca_process_ucmd (struct xztl_io_ucmd *ucmd)
 	    submitted++;
 	    zn_cmd_id[zn_i]++;
 
-	    if (submitted % ZTL_PRO_STRIPE == 0)
+	    if (submitted % core.config.pro_stripe == 0)
 		ztl_wca_poke_ctx ();
 	}
 	usleep(1);
@@ -427,15 +855,17 @@ static void ztl_wca_process_ucmd (struct xztl_io_ucmd *ucmd)
 FAIL_SUBMIT:
     if (submitted) {
 	ucmd->status = XZTL_ZTL_WCA_S2_ERR;
+	pthread_spin_lock (&ucmd->inflight_spin);
 	for (cmd_i = 0; cmd_i < ncmd; cmd_i++) {
 	    if (!ucmd->mcmd[cmd_i]->submitted)
-		xztl_atomic_int16_update (&ucmd->ncb, ucmd->ncb + 1);
+		ucmd->ncb++;
 	}
 
 	/* Check for completion in case of completion concurrence */
 	if (ucmd->ncb == ucmd->nmcmd) {
 	    ucmd->completed = 1;
 	}
+	pthread_spin_unlock (&ucmd->inflight_spin);
     } else {
 	cmd_i = ncmd;
 	goto FAIL_MP;
@@ -480,20 +910,16 @@ FAILURE:
 static void *ztl_wca_write_th (void *arg)
 {
     struct xztl_io_ucmd *ucmd;
+    uint32_t key, idle = 0;
+    uint64_t due;
 
-#if ZTL_WRITE_AFFINITY
-    cpu_set_t cpuset;
-
-    /* Set affinity to writing core */
-    CPU_ZERO(&cpuset);
-    CPU_SET(ZTL_WRITE_CORE, &cpuset);
-    pthread_setaffinity_np (pthread_self(), sizeof(cpu_set_t), &cpuset);
-#endif
+    xztl_thread_place (XZTL_THREAD_WRITE);
 
     wca_running = 1;
 
     while (wca_running) {
-NEXT:
+	key = xztl_poll_key (&wca_poll);
+
 	if (!STAILQ_EMPTY (&ucmd_head)) {
 
 	    pthread_spin_lock (&ucmd_spin);
@@ -501,27 +927,103 @@ NEXT:
 	    STAILQ_REMOVE_HEAD (&ucmd_head, entry);
 	    pthread_spin_unlock (&ucmd_spin);
 
+	    ucmd->us_stage[XZTL_UCMD_DEQUEUE] = xztl_time_us ();
+	    idle = 0;
+
+	    if (!ztl_wca_coal_stage (ucmd))
+		continue;
+
+	    /* Keep submission order with previously staged objects */
+	    ztl_wca_coal_flush_all ();
 	    ztl_wca_process_ucmd (ucmd);
 
-	    goto NEXT;
+	    continue;
 	}
-	pthread_spin_unlock (&ucmd_spin);
 
+	due = ztl_wca_coal_idle ();
+
+	/* Coalesced writes complete only when the context is poked. Their
+	 * callback wakes the thread, the context is poked again after
+	 * ZTL_WCA_COAL_POKE_USEC at most */
+	if (coal_inflight && (!due || due > ZTL_WCA_COAL_POKE_USEC))
+	    due = ZTL_WCA_COAL_POKE_USEC;
+
+	xztl_poll_idle (&wca_poll, key, &idle, due);
+    }
+
+    /* Commit staged objects and wait for coalesced writes */
+    ztl_wca_coal_flush_all ();
+    while (coal_inflight) {
+	ztl_wca_poke_ctx ();
 	usleep (1);
     }
 
     return NULL;
 }
 
+static void ztl_wca_coal_exit (void)
+{
+    uint32_t buf_i;
+
+    for (buf_i = 0; buf_i < ZTL_WCA_COAL_BUFS_MAX; buf_i++) {
+	if (coal_bufs[buf_i].buf) {
+	    xztl_media_dma_free (coal_bufs[buf_i].buf);
+	    coal_bufs[buf_i].buf = NULL;
+	}
+    }
+
+    pthread_spin_destroy (&coal_spin);
+}
+
+static int ztl_wca_coal_init (void)
+{
+    struct ztl_wca_coal *coal;
+    uint64_t phys;
+    uint32_t buf_i;
+
+    coal_bytes = (uint64_t) core.config.wca_sec_mcmd * core.media->geo.nbytes;
+    coal_inflight = 0;
+
+    /* Only small objects are worth the copy */
+    coal_max = core.config.coal_max_bytes;
+    if (coal_max > coal_bytes / 2)
+	coal_max = coal_bytes / 2;
+
+    STAILQ_INIT (&coal_free);
+    if (pthread_spin_init (&coal_spin, 0))
+	return XZTL_ZTL_WCA_ERR;
+
+    for (buf_i = 0; buf_i < ZTL_WCA_COAL_SLOTS_MAX; buf_i++)
+	coal_slot[buf_i] = NULL;
+
+    if (!coal_max)
+	return 0;
+
+    for (buf_i = 0; buf_i < core.config.coal_bufs; buf_i++) {
+	coal = &coal_bufs[buf_i];
+	coal->buf = xztl_media_dma_alloc (coal_bytes, &phys);
+	if (!coal->buf) {
+	    ztl_wca_coal_exit ();
+	    return XZTL_ZTL_WCA_ERR;
+	}
+	ztl_wca_coal_put (coal);
+    }
+
+    return 0;
+}
+
 static int ztl_wca_init (void)
 {
     STAILQ_INIT (&ucmd_head);
 
+    if (ztl_wca_coal_init ())
+	return XZTL_ZTL_WCA_ERR;
+
     /* Initialize thread media context
      * If more write threads are to be used, we need more contexts */
     tctx = xztl_ctx_media_init (0, ZTL_MCMD_ENTS);
     if (!tctx)
-	return XZTL_ZTL_WCA_ERR;
+	goto COAL;
 
     if (pthread_spin_init (&ucmd_spin, 0))
 	goto TCTX;
@@ -537,15 +1039,19 @@ SPIN:
     pthread_spin_destroy (&ucmd_spin);
 TCTX:
     xztl_ctx_media_exit (tctx);
+COAL:
+    ztl_wca_coal_exit ();
     return XZTL_ZTL_WCA_ERR;
 }
 
 static void ztl_wca_exit (void)
 {
     wca_running = 0;
+    xztl_poll_wake (&wca_poll);
     pthread_join (wca_thread, NULL);
     pthread_spin_destroy (&ucmd_spin);
     xztl_ctx_media_exit (tctx);
+    ztl_wca_coal_exit ();
 
     log_info ("ztl-wca: Write-caching stopped.");
 }
@@ -556,7 +1062,8 @@ static struct app_wca_mod libztl_wca = {
     .init_fn     = ztl_wca_init,
     .exit_fn     = ztl_wca_exit,
     .submit_fn   = ztl_wca_submit,
-    .callback_fn = ztl_wca_callback
+    .callback_fn = ztl_wca_callback,
+    .outstanding_fn = ztl_wca_outstanding
 };
 
 void ztl_wca_register (void) {
@@ -41,6 +41,7 @@ static int ztl_zmd_create (struct app_group *grp)
         zn->addr.addr   = 0;
         zn->addr.g.grp  = grp->id;
         zn->addr.g.zone = zn_i;
+        zn->addr.g.punit = zn_i / g->zn_pu;
 	zn->addr.g.sect = (g->sec_grp * grp->id) + (g->sec_zn * zn_i);
 
 	zn->flags |= XZTL_ZMD_AVLB;
@@ -59,6 +60,7 @@ static int ztl_zmd_load_report (struct app_group *grp)
     int ret;
 
     cmd.opcode = XZTL_ZONE_MGMT_REPORT;
+    cmd.asynch = 0;
     cmd.addr.g.grp  = grp->id;
     cmd.addr.g.zone = core.media->geo.zn_grp * grp->id;
     cmd.nzones = core.media->geo.zn_grp;
@@ -99,8 +101,10 @@ static struct app_zmd_entry *ztl_zmd_get (struct app_group *grp, uint64_t zone,
     if (!zmd->tbl)
         return NULL;
 
+    /* Offsets are device wide, zone metadata is indexed within the group */
     if (by_offset)
-	zone = zone / core.media->geo.sec_zn;
+	zone = (zone - (uint64_t) core.media->geo.sec_grp * grp->id) /
+						    core.media->geo.sec_zn;
 
     return ((struct app_zmd_entry *) zmd->tbl) + zone;
 }
@@ -119,6 +119,7 @@ static int test_append_reset_zone (uint32_t zid)
     struct xztl_zn_mcmd cmd;
 
     cmd.opcode = XZTL_ZONE_MGMT_RESET;
+    cmd.asynch = 0;
     cmd.addr.g.zone = zid;
 
     return xztl_media_submit_zn (&cmd);
@@ -2,6 +2,7 @@
 #include <xztl.h>
 #include <xztl-media.h>
 #include <stdlib.h>
+#include <string.h>
 #include "CUnit/Basic.h"
 
 static int cunit_media_init (void)
@@ -48,6 +49,9 @@ static void test_media_set (void)
 {
     struct xztl_media media;
 
+    /* Unset geometry limits (sec_mcmd, sec_wgran) are read as 0: none */
+    memset (&media, 0x0, sizeof (struct xztl_media));
+
     media.init_fn   = test_media_init_fn;
     media.exit_fn   = test_media_exit_fn;
     media.submit_io = test_media_io_fn;
@@ -70,6 +74,52 @@ static void test_media_init (void)
     CU_ASSERT (xztl_media_init () == 0);
 }
 
+static uint32_t test_layer_submits, test_layer_dones;
+
+/* Fails writes, counts the commands seen by the layer */
+static int test_layer_submit_io (struct xztl_io_mcmd *cmd)
+{
+    test_layer_submits++;
+    return (cmd->opcode == XZTL_CMD_WRITE) ? XZTL_MEDIA_ERROR : 0;
+}
+
+static void test_layer_io_done (struct xztl_io_mcmd *cmd)
+{
+    test_layer_dones++;
+}
+
+static struct xztl_media_layer test_layer = {
+    .name      = "test",
+    .submit_io = test_layer_submit_io,
+    .io_done   = test_layer_io_done,
+};
+
+static void test_media_layer (void)
+{
+    struct xztl_io_mcmd cmd;
+
+    CU_ASSERT (xztl_media_layer_add (&test_layer) == 0);
+
+    memset (&cmd, 0x0, sizeof (struct xztl_io_mcmd));
+    cmd.synch   = 1;
+    cmd.naddr   = 1;
+    cmd.nsec[0] = 1;
+
+    cmd.opcode = XZTL_CMD_READ;
+    CU_ASSERT (xztl_media_submit_io (&cmd) == 0);
+
+    cmd.opcode = XZTL_CMD_WRITE;
+    CU_ASSERT (xztl_media_submit_io (&cmd) == XZTL_MEDIA_ERROR);
+
+    CU_ASSERT (test_layer_submits == 2);
+    CU_ASSERT (test_layer_dones == 2);
+
+    /* The layer stays in the chain until xztl_exit */
+    cmd.opcode = XZTL_CMD_READ;
+    xztl_media_submit_io (&cmd);
+    CU_ASSERT (test_layer_submits == 3);
+}
+
 static void test_media_exit (void)
 {
     CU_ASSERT (xztl_media_exit () == 0);
@@ -92,6 +142,7 @@ int main (void)
 
     if ((CU_add_test (pSuite, "Set the media layer", test_media_set) == NULL) ||
         (CU_add_test (pSuite, "Initialize media", test_media_init) == NULL) ||
+        (CU_add_test (pSuite, "Media layer chain", test_media_layer) == NULL) ||
 	(CU_add_test (pSuite, "Close media", test_media_exit) == NULL)) {
 	CU_cleanup_registry();
 	return CU_get_error();
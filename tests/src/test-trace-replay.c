@@ -0,0 +1,306 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <xztl.h>
+#include <xztl-media.h>
+#include <xztl-mempool.h>
+#include <ztl-media.h>
+
+/* Re-issues the media commands of a trace recorded with XZTL_TRACE_FILE.
+ * Submissions are replayed in timestamp order from a single context.
+ * Multi-address commands are replayed as one range from the first address,
+ * copy and zone report commands are skipped */
+
+#define REPLAY_DEPTH 64
+#define REPLAY_TID   0
+#define REPLAY_TIMEOUT_US (10 * 1000000) /* Max wait for completions */
+
+extern struct xztl_core core;
+
+static volatile uint64_t replay_outs;
+static uint64_t replay_errors;
+
+static int replay_rec_cmp (const void *a, const void *b)
+{
+    const struct xztl_trace_rec *ra = a, *rb = b;
+
+    return (ra->us > rb->us) - (ra->us < rb->us);
+}
+
+static struct xztl_trace_rec *replay_load (const char *path, uint64_t *nrec,
+							    uint32_t *nbytes)
+{
+    struct xztl_trace_hdr hdr;
+    struct xztl_trace_rec rec, *recs = NULL, *tmp;
+    uint64_t n = 0, max = 0;
+    FILE *fp;
+
+    fp = fopen (path, "r");
+    if (!fp) {
+	printf ("Could not open %s\n", path);
+	return NULL;
+    }
+
+    if (fread (&hdr, sizeof (hdr), 1, fp) != 1 ||
+	hdr.magic != XZTL_TRACE_MAGIC || hdr.version != XZTL_TRACE_VERSION ||
+	hdr.rec_sz != sizeof (struct xztl_trace_rec)) {
+	printf ("Invalid trace file %s\n", path);
+	goto CLOSE;
+    }
+
+    /* Only submissions are replayed */
+    while (fread (&rec, sizeof (rec), 1, fp) == 1) {
+	if (rec.event != XZTL_TRACE_IO_SUBMIT &&
+	    rec.event != XZTL_TRACE_ZN_SUBMIT)
+	    continue;
+
+	if (n == max) {
+	    max = (max) ? max * 2 : 65536;
+	    tmp = realloc (recs, max * sizeof (struct xztl_trace_rec));
+	    if (!tmp) {
+		printf ("Memory allocation failed\n");
+		free (recs);
+		recs = NULL;
+		goto CLOSE;
+	    }
+	    recs = tmp;
+	}
+	recs[n++] = rec;
+    }
+
+    /* Rings are written per thread, merge by time */
+    qsort (recs, n, sizeof (struct xztl_trace_rec), replay_rec_cmp);
+
+    *nrec   = n;
+    *nbytes = hdr.nbytes;
+
+CLOSE:
+    fclose (fp);
+    return recs;
+}
+
+static void replay_callback (void *arg)
+{
+    struct xztl_io_mcmd  *cmd;
+    struct xztl_mp_entry *mp_cmd;
+
+    cmd    = (struct xztl_io_mcmd *) arg;
+    mp_cmd = (struct xztl_mp_entry *) cmd->opaque;
+
+    if (cmd->status)
+	__sync_fetch_and_add (&replay_errors, 1);
+
+    xztl_mempool_put (mp_cmd, XZTL_MEMPOOL_MCMD, REPLAY_TID);
+    __sync_fetch_and_sub (&replay_outs, 1);
+}
+
+static void replay_poke_ctx (struct xztl_mthread_ctx *tctx)
+{
+    struct xztl_misc_cmd misc;
+
+    misc.opcode		  = XZTL_MISC_ASYNCH_POKE;
+    misc.asynch.ctx_ptr   = tctx;
+    misc.asynch.limit     = 0;
+    misc.asynch.count     = 0;
+
+    pthread_spin_lock (&tctx->qpair_spin);
+    xztl_media_submit_misc (&misc);
+    pthread_spin_unlock (&tctx->qpair_spin);
+}
+
+/* Reaps completions until at most 'outs' commands are in-flight. Returns
+ * non-zero if the commands do not complete within REPLAY_TIMEOUT_US */
+static int replay_wait (struct xztl_mthread_ctx *tctx, uint64_t outs)
+{
+    uint64_t start;
+
+    start = xztl_time_us ();
+    while (replay_outs > outs) {
+	replay_poke_ctx (tctx);
+	if (xztl_time_us () - start > REPLAY_TIMEOUT_US) {
+	    printf ("Timeout: %lu commands did not complete\n", replay_outs);
+	    return -1;
+	}
+    }
+
+    return 0;
+}
+
+static int replay_io (struct xztl_trace_rec *rec, struct xztl_mthread_ctx *tctx,
+								char *buf)
+{
+    struct xztl_mp_entry *mp_cmd;
+    struct xztl_io_mcmd  *cmd;
+
+    /* Completions return the command entries */
+    mp_cmd = xztl_mempool_get (XZTL_MEMPOOL_MCMD, REPLAY_TID);
+    if (!mp_cmd)
+	return -1;
+
+    cmd = (struct xztl_io_mcmd *) mp_cmd->opaque;
+    memset (cmd, 0x0, sizeof (struct xztl_io_mcmd));
+    cmd->opcode       = rec->opcode;
+    cmd->naddr        = 1;
+    cmd->synch        = 0;
+    cmd->async_ctx    = tctx;
+    cmd->prp[0]       = (uint64_t) buf;
+    cmd->nsec[0]      = rec->nsec;
+    cmd->addr[0].addr = rec->addr;
+    cmd->callback     = replay_callback;
+    cmd->opaque       = (void *) mp_cmd;
+
+    __sync_fetch_and_add (&replay_outs, 1);
+    if (xztl_media_submit_io (cmd)) {
+	__sync_fetch_and_sub (&replay_outs, 1);
+	xztl_mempool_put (mp_cmd, XZTL_MEMPOOL_MCMD, REPLAY_TID);
+	return -1;
+    }
+
+    return 0;
+}
+
+static int replay_zn (struct xztl_trace_rec *rec)
+{
+    struct xztl_zn_mcmd cmd;
+
+    memset (&cmd, 0x0, sizeof (struct xztl_zn_mcmd));
+    cmd.opcode    = rec->opcode;
+    cmd.addr.addr = rec->addr;
+    cmd.nzones    = rec->nsec;
+
+    return xztl_media_submit_zn (&cmd);
+}
+
+int main (int argc, const char **argv)
+{
+    struct xztl_mthread_ctx *tctx;
+    struct xztl_trace_rec *recs, *rec;
+    uint64_t nrec = 0, rec_i, max_nsec = 0, phys, skipped = 0, replayed = 0;
+    uint64_t start, target, now, span;
+    uint32_t nbytes = 0;
+    double speed = 1;
+    char *buf;
+    int ret;
+
+    if (argc < 3) {
+	printf ("Usage: %s <device> <trace file> [speed]\n", argv[0]);
+	printf ("  speed: 1 original timing (default), N times faster, "
+		"0 no delays\n");
+	return -1;
+    }
+
+    if (argc > 3)
+	speed = atof (argv[3]);
+
+    recs = replay_load (argv[2], &nrec, &nbytes);
+    if (!recs)
+	return -1;
+
+    if (!nrec) {
+	printf ("Trace has no submissions\n");
+	free (recs);
+	return 0;
+    }
+
+    for (rec_i = 0; rec_i < nrec; rec_i++) {
+	if (recs[rec_i].event == XZTL_TRACE_IO_SUBMIT &&
+	    recs[rec_i].nsec > max_nsec)
+	    max_nsec = recs[rec_i].nsec;
+    }
+
+    printf ("Device: %s\n", argv[1]);
+    printf ("Trace : %s (%lu commands)\n", argv[2], nrec);
+
+    xztl_time_init ();
+
+    znd_media_register (argv[1]);
+
+    ret = xztl_media_init ();
+    if (ret)
+	goto FREE;
+
+    ret = xztl_mempool_init ();
+    if (ret)
+	goto MEDIA;
+
+    if (nbytes && nbytes != core.media->geo.nbytes)
+	printf ("Warning: trace sector size %u, device %u\n",
+					    nbytes, core.media->geo.nbytes);
+
+    ret = -1;
+    tctx = xztl_ctx_media_init (REPLAY_TID, REPLAY_DEPTH);
+    if (!tctx)
+	goto MP;
+
+    buf = xztl_media_dma_alloc (max_nsec * core.media->geo.nbytes + 1,
+									&phys);
+    if (!buf)
+	goto CTX;
+
+    start = xztl_time_us ();
+    for (rec_i = 0; rec_i < nrec; rec_i++) {
+	rec = &recs[rec_i];
+
+	/* Keep the original gaps between submissions, scaled by speed */
+	if (speed > 0) {
+	    target = (uint64_t) ((rec->us - recs[0].us) / speed);
+	    now = xztl_time_us () - start;
+	    if (target > now)
+		usleep (target - now);
+	}
+
+	if (rec->event == XZTL_TRACE_IO_SUBMIT) {
+	    switch (rec->opcode) {
+		case XZTL_CMD_READ:
+		case XZTL_CMD_WRITE:
+		case XZTL_ZONE_APPEND:
+		    if (replay_wait (tctx, REPLAY_DEPTH - 1))
+			goto TIMEOUT;
+		    if (replay_io (rec, tctx, buf))
+			replay_errors++;
+		    replayed++;
+		    break;
+		default:
+		    skipped++;
+	    }
+	} else {
+	    if (rec->opcode == XZTL_ZONE_MGMT_REPORT) {
+		skipped++;
+		continue;
+	    }
+	    if (replay_zn (rec))
+		replay_errors++;
+	    replayed++;
+	}
+    }
+
+    /* Wait until all commands complete */
+    if (replay_wait (tctx, 0))
+	goto TIMEOUT;
+
+    now  = xztl_time_us () - start;
+    span = recs[nrec - 1].us - recs[0].us;
+
+    printf ("\n Replayed      : %lu commands\n", replayed);
+    printf (" Skipped       : %lu commands\n", skipped);
+    printf (" Errors        : %lu\n", replay_errors);
+    printf (" Trace span    : %.2lf ms\n", (double) span / 1000);
+    printf (" Replay time   : %.2lf ms\n\n", (double) now / 1000);
+
+    ret = (replay_errors) ? -1 : 0;
+
+    xztl_media_dma_free (buf);
+
+    /* On a timeout the buffer may still be in use by the device */
+TIMEOUT:
+CTX:
+    xztl_ctx_media_exit (tctx);
+MP:
+    xztl_mempool_exit ();
+MEDIA:
+    xztl_media_exit ();
+FREE:
+    free (recs);
+    return ret;
+}
@@ -67,6 +67,7 @@ static void test_znd_report (void)
     uint32_t znlbas;
 
     cmd.opcode = XZTL_ZONE_MGMT_REPORT;
+    cmd.asynch = 0;
     cmd.addr.g.zone = zone = 0;
     cmd.nzones = nzones = core.media->geo.zn_dev;
 
@@ -96,6 +97,7 @@ static void test_znd_manage_single (uint8_t op, uint8_t devop,
     int ret;
 
     cmd.opcode = op;
+    cmd.asynch = 0;
     cmd.addr.addr = 0;
     cmd.addr.g.zone = zone;
 
@@ -402,6 +404,94 @@ MP:
     cunit_znd_assert_int ("", ret);
 }
 
+static void test_znd_copy_zone (void)
+{
+    struct xztl_io_mcmd cmd;
+    uint16_t nlbas, zone_src, zone_dst;
+    int ret;
+
+    nlbas    = 16;
+    zone_src = 0;
+    zone_dst = 1;
+
+    /* Reset the destination zone before copying */
+    test_znd_manage_single (XZTL_ZONE_MGMT_RESET,
+			    XNVME_SPEC_ZND_STATE_EMPTY,
+			    zone_dst,
+			    "xztl_media_submit_znm:reset");
+
+    memset (&cmd, 0x0, sizeof (struct xztl_io_mcmd));
+
+    cmd.opcode  = XZTL_CMD_COPY;
+    cmd.synch   = 1;
+    cmd.naddr   = 1;
+    cmd.nsec[0] = nlbas;
+
+    /* Sectors written by the append test */
+    cmd.addr[0].g.sect  = zone_src * core.media->geo.sec_zn;
+    cmd.addr_dst.g.sect = zone_dst * core.media->geo.sec_zn;
+
+    ret = xztl_media_submit_io (&cmd);
+    cunit_znd_assert_int ("xztl_media_submit_io:copy", ret);
+    cunit_znd_assert_int ("xztl_media_submit_io:copy:status", cmd.status);
+    cunit_znd_assert_int_equal ("xztl_media_submit_io:copy:paddr",
+				cmd.paddr[0], cmd.addr_dst.g.sect);
+}
+
+static void test_znd_zn_callback (void *arg)
+{
+   struct xztl_zn_mcmd *cmd;
+
+   cmd = (struct xztl_zn_mcmd *) arg;
+   cunit_znd_assert_int ("xztl_media_submit_zn:cb", cmd->status);
+   outstanding--;
+}
+
+static void test_znd_reset_asynch (void)
+{
+    struct xztl_zn_mcmd      cmd;
+    struct xztl_mthread_ctx *tctx;
+    uint16_t tid, zone;
+    int ret;
+
+    tid  = 0;
+    zone = 1;
+
+    ret = xztl_mempool_init ();
+    cunit_znd_assert_int ("xztl_mempool_init", ret);
+    if (ret)
+	return;
+
+    tctx = xztl_ctx_media_init (tid, 128);
+    cunit_znd_assert_ptr ("xztl_ctx_media_init", tctx);
+    if (!tctx)
+	goto MP;
+
+    cmd.opcode    = XZTL_ZONE_MGMT_RESET;
+    cmd.asynch    = 1;
+    cmd.addr.addr = 0;
+    cmd.addr.g.zone = zone;
+    cmd.async_ctx = tctx;
+    cmd.callback  = test_znd_zn_callback;
+    cmd.opaque    = NULL;
+
+    outstanding = 1;
+    ret = xztl_media_submit_zn (&cmd);
+    cunit_znd_assert_int ("xztl_media_submit_zn:reset-asynch", ret);
+    if (ret)
+	outstanding = 0;
+
+    /* Poke the context for completions */
+    while (outstanding)
+	test_znd_poke_ctx (tctx);
+
+    ret = xztl_ctx_media_exit (tctx);
+    cunit_znd_assert_int ("xztl_ctx_media_exit", ret);
+MP:
+    ret = xztl_mempool_exit ();
+    cunit_znd_assert_int ("", ret);
+}
+
 int main (int argc, const char **argv)
 {
     int failed;
@@ -441,6 +531,10 @@ int main (int argc, const char **argv)
 		      test_znd_append_zone) == NULL) ||
         (CU_add_test (pSuite, "Read 16 sectors from a zone",
 		      test_znd_read_zone) == NULL) ||
+        (CU_add_test (pSuite, "Copy 16 sectors to another zone",
+		      test_znd_copy_zone) == NULL) ||
+        (CU_add_test (pSuite, "Reset a zone asynchronously",
+		      test_znd_reset_asynch) == NULL) ||
 	(CU_add_test (pSuite, "Close media",
 		      test_znd_media_exit) == NULL)) {
 	CU_cleanup_registry();
@@ -14,6 +14,16 @@
 /* Object Size */
 #define TEST_BUFFER_SZ (1024 * 1024 * 16) /* 16 MB */
 
+/* Small objects packed by the write-cache, 100 bytes to ~2 KB */
+#define TEST_SMALL_N	 64
+#define TEST_SMALL_ID	 1000
+#define TEST_SMALL_SZ	 4096
+#define TEST_SMALL_LEN(id) (100 + (id) * 29)
+
+/* Tiny objects kept inline in the mapping */
+#define TEST_TINY_N	 56
+#define TEST_TINY_ID	 2000
+
 static uint8_t *wbuf[TEST_N_BUFFERS];
 static uint8_t *rbuf[TEST_N_BUFFERS];
 
@@ -194,6 +204,102 @@ static void test_zrocks_random_read (void)
 	xztl_media_dma_free (wbuf[i]);
 }
 
+static void test_zrocks_small (void)
+{
+    uint64_t id, phys[2];
+    uint8_t *wsmall, *rsmall;
+    size_t size;
+    int ret;
+
+    wsmall = xztl_media_dma_alloc (TEST_SMALL_N * TEST_SMALL_SZ, &phys[0]);
+    cunit_zrocks_assert_ptr ("xztl_media_dma_alloc", wsmall);
+    rsmall = xztl_media_dma_alloc (TEST_SMALL_SZ, &phys[1]);
+    cunit_zrocks_assert_ptr ("xztl_media_dma_alloc", rsmall);
+    if (!wsmall || !rsmall)
+	goto FREE;
+
+    for (id = 0; id < TEST_SMALL_N; id++)
+	memset (&wsmall[id * TEST_SMALL_SZ], id + 1, TEST_SMALL_SZ);
+
+    /* Concurrent small writes are committed together */
+    #pragma omp parallel for
+    for (id = 0; id < TEST_SMALL_N; id++) {
+	int wret = zrocks_new (TEST_SMALL_ID + id,
+			&wsmall[id * TEST_SMALL_SZ], TEST_SMALL_LEN (id), 0);
+	cunit_zrocks_assert_int ("zrocks_new", wret);
+    }
+
+    for (id = 0; id < TEST_SMALL_N; id++) {
+	memset (rsmall, 0x0, TEST_SMALL_SZ);
+	ret = zrocks_read_obj (TEST_SMALL_ID + id, 0, rsmall,
+							TEST_SMALL_LEN (id));
+	cunit_zrocks_assert_int ("zrocks_read_obj", ret);
+	cunit_zrocks_assert_int ("zrocks_read_obj:check",
+		    memcmp (&wsmall[id * TEST_SMALL_SZ], rsmall,
+							TEST_SMALL_LEN (id)));
+
+	ret = zrocks_obj_size (TEST_SMALL_ID + id, &size);
+	cunit_zrocks_assert_int ("zrocks_obj_size", ret);
+	cunit_zrocks_assert_int ("zrocks_obj_size:check",
+					    size != TEST_SMALL_LEN (id));
+    }
+
+FREE:
+    if (wsmall)
+	xztl_media_dma_free (wsmall);
+    if (rsmall)
+	xztl_media_dma_free (rsmall);
+}
+
+static void test_zrocks_tiny (void)
+{
+    uint8_t wtiny[TEST_TINY_N], rtiny[TEST_TINY_N];
+    uint64_t id;
+    size_t size;
+    int ret;
+
+    for (id = 0; id < TEST_TINY_N; id++)
+	wtiny[id] = id + 1;
+
+    for (id = 0; id < TEST_TINY_N; id++) {
+	ret = zrocks_new (TEST_TINY_ID + id, wtiny, id + 1, 0);
+	cunit_zrocks_assert_int ("zrocks_new", ret);
+    }
+
+    for (id = 0; id < TEST_TINY_N; id++) {
+	memset (rtiny, 0x0, TEST_TINY_N);
+	ret = zrocks_read_obj (TEST_TINY_ID + id, 0, rtiny, id + 1);
+	cunit_zrocks_assert_int ("zrocks_read_obj", ret);
+	cunit_zrocks_assert_int ("zrocks_read_obj:check",
+					    memcmp (wtiny, rtiny, id + 1));
+    }
+
+    ret = zrocks_obj_size (TEST_TINY_ID + TEST_TINY_N - 1, &size);
+    cunit_zrocks_assert_int ("zrocks_obj_size", ret);
+    cunit_zrocks_assert_int ("zrocks_obj_size:check", size != TEST_TINY_N);
+
+    /* Reads beyond the object end are rejected */
+    ret = zrocks_read_obj (TEST_TINY_ID, 0, rtiny, 2);
+    CU_ASSERT (ret != 0);
+
+    /* Partial read of an inline object */
+    ret = zrocks_read_obj (TEST_TINY_ID + TEST_TINY_N - 1, 10, rtiny, 20);
+    cunit_zrocks_assert_int ("zrocks_read_obj", ret);
+    cunit_zrocks_assert_int ("zrocks_read_obj:check",
+					    memcmp (&wtiny[10], rtiny, 20));
+
+    for (id = 0; id < TEST_TINY_N; id++) {
+	ret = zrocks_delete (TEST_TINY_ID + id);
+	cunit_zrocks_assert_int ("zrocks_delete", ret);
+    }
+
+    /* Deleted objects are not found */
+    ret = zrocks_read_obj (TEST_TINY_ID, 0, rtiny, 1);
+    CU_ASSERT (ret != 0);
+    ret = zrocks_obj_size (TEST_TINY_ID, &size);
+    CU_ASSERT (ret != 0);
+}
+
 int main (int argc, const char **argv)
 {
     int failed;
@@ -225,6 +331,10 @@ int main (int argc, const char **argv)
 		      test_zrocks_read) == NULL) ||
 	(CU_add_test (pSuite, "ZRocks Random Read",
 		      test_zrocks_random_read) == NULL) ||
+	(CU_add_test (pSuite, "ZRocks Small Objects",
+		      test_zrocks_small) == NULL) ||
+	(CU_add_test (pSuite, "ZRocks Tiny Objects",
+		      test_zrocks_tiny) == NULL) ||
         (CU_add_test (pSuite, "Close ZRocks",
 		      test_zrocks_exit) == NULL)) {
 	CU_cleanup_registry();
@@ -4,6 +4,11 @@
 #include <ztl.h>
 #include "CUnit/Basic.h"
 
+/* Small open zone budget, so provisioning reclaims open zones */
+#define TEST_ZTL_OPEN_BUDGET 2
+
+extern struct xztl_core core;
+
 static const char **devname;
 
 static void cunit_ztl_assert_ptr (char *fn, void *ptr)
@@ -41,6 +46,8 @@ static void test_ztl_init (void)
     if (ret)
 	return;
 
+    core.media->geo.zn_open = TEST_ZTL_OPEN_BUDGET;
+
     /* Register ZTL modules */
     ztl_zmd_register ();
     ztl_pro_register ();
@@ -105,6 +112,50 @@ static void test_ztl_pro_new_free (void)
     ztl()->pro->free_fn (proe[0]);
 }
 
+/* Opening zones of more levels than the budget finishes open zones. The
+ * finished zones must be recyclable as any full zone */
+static void test_ztl_pro_reclaim (void)
+{
+    struct app_pro_addr *proe;
+    struct app_zmd_entry *zmde;
+    struct app_group *grp;
+    struct ztl_pro_grp *pro;
+    uint32_t nsec = 128, zn_i, nreclaimed = 0;
+    uint16_t level, grp_i;
+
+    for (level = 1; level <= TEST_ZTL_OPEN_BUDGET + 1; level++) {
+	proe = ztl()->pro->new_fn (nsec, level, 0);
+	cunit_ztl_assert_ptr ("ztl()->pro->new_fn", proe);
+	if (!proe)
+	    return;
+	ztl()->pro->free_fn (proe);
+    }
+
+    for (grp_i = 0; grp_i < core.media->geo.ngrps; grp_i++) {
+	grp = ztl()->groups.get_fn (grp_i);
+	pro = (struct ztl_pro_grp *) grp->pro;
+
+	/* Wait for the finish commands */
+	while (pro->nzn_inflight)
+	    usleep (1);
+
+	for (zn_i = 0; zn_i < core.media->geo.zn_grp; zn_i++) {
+	    zmde = ztl()->zmd->get_fn (grp, zn_i, 0);
+	    if (!(zmde->flags & XZTL_ZMD_USED) ||
+				(zmde->flags & XZTL_ZMD_OPEN))
+		continue;
+
+	    nreclaimed++;
+	    cunit_ztl_assert_int ("ztl()->pro->finish_zn_fn",
+			    ztl()->pro->finish_zn_fn (grp, zn_i, 0));
+	    cunit_ztl_assert_int ("ztl()->pro->put_zone_fn",
+			    ztl()->pro->put_zone_fn (grp, zn_i));
+	}
+    }
+
+    CU_ASSERT (nreclaimed > 0);
+}
+
 static void test_ztl_map_upsert_read (void)
 {
     uint64_t id, val, count, interval, old;
@@ -119,7 +170,8 @@ static void test_ztl_map_upsert_read (void)
     }
 
     for (id = 1; id <= count; id++) {
-	val = ztl()->map->read_fn (id * interval);
+	ret = ztl()->map->read_fn (id * interval, &val);
+	cunit_ztl_assert_int ("ztl()->map->read_fn", ret);
 	cunit_ztl_assert_int_equal ("ztl()->map->read", val, id * interval);
     }
 
@@ -131,8 +183,38 @@ static void test_ztl_map_upsert_read (void)
     cunit_ztl_assert_int ("ztl()->map->upsert_fn", ret);
     cunit_ztl_assert_int_equal ("ztl()->map->upsert_fn:old", old, id);
 
-    old = ztl()->map->read_fn (id);
+    ret = ztl()->map->read_fn (id, &old);
+    cunit_ztl_assert_int ("ztl()->map->read_fn", ret);
     cunit_ztl_assert_int_equal ("ztl()->map->read", old, val);
+
+    /* Removed IDs are not found */
+    ret = ztl()->map->upsert_fn (id, 0, &old, 0);
+    cunit_ztl_assert_int ("ztl()->map->upsert_fn", ret);
+
+    ret = ztl()->map->read_fn (id, &val);
+    CU_ASSERT (ret == ZTL_MAP_NOT_FOUND);
+}
+
+/* Percentiles are within the ~3% precision of the histogram buckets */
+static void test_ztl_stats_lat (void)
+{
+    struct xztl_stats_lat lat;
+    uint64_t usec;
+
+    xztl_stats_lat_get (XZTL_STATS_LAT_WRITE, &lat);
+    cunit_ztl_assert_int ("xztl_stats_lat_get:count", lat.count);
+
+    for (usec = 1; usec <= 1000; usec++)
+	xztl_stats_lat_add (XZTL_STATS_LAT_WRITE, usec);
+
+    xztl_stats_lat_get (XZTL_STATS_LAT_WRITE, &lat);
+    cunit_ztl_assert_int_equal ("xztl_stats_lat_get:count", lat.count, 1000);
+    cunit_ztl_assert_int_equal ("xztl_stats_lat_get:sum", lat.sum, 500500);
+    cunit_ztl_assert_int_equal ("xztl_stats_lat_get:max", lat.max, 1000);
+
+    CU_ASSERT (lat.p50 >= 500 && lat.p50 <= 500 + 500 / 32);
+    CU_ASSERT (lat.p99 >= 990 && lat.p99 <= 1000);
+    CU_ASSERT (lat.p999 >= 999 && lat.p999 <= 1000);
 }
 
 static int cunit_ztl_init (void)
@@ -167,10 +249,14 @@ int main (int argc, const char **argv)
 	return CU_get_error();
     }
 
-    if ((CU_add_test (pSuite, "Initialize ZTL",
+    if ((CU_add_test (pSuite, "Latency histogram",
+		      test_ztl_stats_lat) == NULL) ||
+	(CU_add_test (pSuite, "Initialize ZTL",
 		      test_ztl_init) == NULL) ||
 	(CU_add_test (pSuite, "New/Free prov offset",
 		      test_ztl_pro_new_free ) == NULL) ||
+	(CU_add_test (pSuite, "Reclaim/Recycle open zone",
+		      test_ztl_pro_reclaim ) == NULL) ||
 	(CU_add_test (pSuite, "Upsert/Read mapping",
 		      test_ztl_map_upsert_read ) == NULL) ||
         (CU_add_test (pSuite, "Close ZTL",
@@ -25,6 +25,7 @@ extern "C" {
 
 #include <stdint.h>
 #include <stdlib.h>
+#include <xztl.h>
 
 #define ZNS_ALIGMENT 4096
 
@@ -54,6 +55,29 @@ struct zrocks_map {
     };
 };
 
+/* Runtime configuration. Call 'zrocks_config_default' to fill the default
+ * values before changing fields. Environment variables (in parentheses)
+ * override the values given by the application. The xZTL fields are
+ * described in xztl.h */
+struct zrocks_config {
+    uint32_t buf_ents;       /* Read buffers (ZROCKS_BUF_ENTS) */
+    struct xztl_config xztl;
+};
+
+/**
+ * Fill a configuration structure with the default values
+ *
+ * @param cfg Pointer to the configuration structure
+ */
+void zrocks_config_default (struct zrocks_config *cfg);
+
+/**
+ * Read back the configuration in use, after environment overrides
+ *
+ * @param cfg Pointer to the configuration structure to be filled
+ */
+void zrocks_config_get (struct zrocks_config *cfg);
+
 /**
  * Initialize zrocks library
  *
@@ -66,6 +90,17 @@ struct zrocks_map {
  */
 int zrocks_init (const char *dev_name);
 
+/**
+ * Initialize zrocks library with a runtime configuration
+ *
+ * @param dev_name URI provided by the user (see zrocks_init)
+ * @param cfg Configuration, NULL uses the default values
+ *
+ * @return Returns zero if the calls succeed, or a negative value
+ * 	   if the call fails
+ */
+int zrocks_init_config (const char *dev_name, const struct zrocks_config *cfg);
+
 /**
  * Close zrocks library
  *
@@ -99,7 +134,9 @@ void zrocks_free (void *ptr);
  */
 
 /**
- * Creates a new variable-sized object belonging to a certain LSM-Tree level
+ * Creates a new variable-sized object belonging to a certain LSM-Tree level.
+ * Objects of a few dozen bytes are kept in memory with the mapping and are
+ * read without media I/O
  *
  * @param id Object ID
  * @param buf Pointer to a buffer containing data to be written
@@ -130,10 +167,21 @@ int zrocks_delete (uint64_t id);
  * @size - Size in bytes starting from offset
  *
  * @return Returns zero if the calls succeed, or a negative value
- * 	   if the call fails
+ * 	   if the call fails or the range is beyond the object size
  **/
 int zrocks_read_obj (uint64_t id, uint64_t offset, void *buf, size_t size);
 
+/**
+ * Get the size of an object
+ *
+ * @id - Unique integer identifier of the object
+ * @size - Pointer filled with the object size in bytes
+ *
+ * @return Returns zero if the calls succeed, or a negative value
+ * 	   if the object does not exist
+ **/
+int zrocks_obj_size (uint64_t id, size_t *size);
+
 
 /* >>> BLOCK INTERFACE FUNCTIONS
  * >>> Use these functions if your application provides recovery
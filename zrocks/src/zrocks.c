@@ -37,6 +37,8 @@ extern struct xztl_core core;
 /* Remove this lock if we find a way to get a thread ID starting from 0 */
 static pthread_spinlock_t zrocks_mp_spin;
 
+static uint32_t zrocks_buf_ents;
+
 void *zrocks_alloc (size_t size)
 {
     uint64_t phys;
@@ -48,27 +50,20 @@ void zrocks_free (void *ptr)
     xztl_media_dma_free (ptr);
 }
 
+/* The exact size is given to the write-cache. Small objects are packed with
+ * others at byte granularity, larger ones are padded to full sectors */
 static int __zrocks_write (struct xztl_io_ucmd *ucmd,
 			uint64_t id, void *buf, size_t size, uint16_t level)
 {
-    uint32_t misalign;
-    size_t new_sz, alignment;
-
-    alignment = ZNS_ALIGMENT * ZTL_WCA_SEC_MCMD_MIN;
-    misalign = size % alignment;
-
-    new_sz = (misalign != 0) ? size + (alignment - misalign) : size;
-
     if (ZROCKS_DEBUG)
-	log_infoa ("zrocks (write): ID %lu, level %d, size %lu, new size %lu, "
-		"aligment %lu, misalign %d\n", id, level, size, new_sz,
-		 alignment, misalign);
+	log_infoa ("zrocks (write): ID %lu, level %d, size %lu\n",
+							    id, level, size);
 
     ucmd->prov_type = level;
 
     ucmd->id        = id;
     ucmd->buf       = buf;
-    ucmd->size      = new_sz;
+    ucmd->size      = size;
     ucmd->status    = 0;
     ucmd->completed = 0;
     ucmd->callback  = NULL;
@@ -91,12 +86,25 @@ static int __zrocks_write (struct xztl_io_ucmd *ucmd,
 int zrocks_new (uint64_t id, void *buf, size_t size, uint16_t level)
 {
     struct xztl_io_ucmd ucmd;
+    uint64_t old;
     int ret;
 
     if (ZROCKS_DEBUG)
 	log_infoa ("zrocks (write_obj): ID %lu, level %d, size %lu\n",
 							    id, level, size);
 
+    /* Tiny objects are kept inline in the mapping if there is room */
+    if (size && size <= ZTL_MAP_TINY_BYTES) {
+	ret = ztl()->map->upsert_tiny_fn (id, buf, size, &old);
+	if (ret <= 0) {
+	    if (!ret) {
+		xztl_stats_inc (XZTL_STATS_APPEND_BYTES_U, size);
+		xztl_stats_inc (XZTL_STATS_APPEND_UCMD, 1);
+	    }
+	    return ret;
+	}
+    }
+
     ucmd.app_md = 0;
     ret = __zrocks_write (&ucmd, id, buf, size, level);
 
@@ -174,8 +182,8 @@ static int __zrocks_read (uint64_t offset, void *buf, size_t size) {
     }
     pthread_spin_unlock (&zrocks_mp_spin);
 
-    ncmd = sec_size / ZTL_READ_SEC_MCMD;
-    if (sec_size % ZTL_READ_SEC_MCMD != 0)
+    ncmd = sec_size / core.config.read_sec_mcmd;
+    if (sec_size % core.config.read_sec_mcmd != 0)
 	ncmd++;
 
     #pragma omp parallel for num_threads(ncmd)
@@ -187,13 +195,13 @@ static int __zrocks_read (uint64_t offset, void *buf, size_t size) {
 	cmd.synch   = 1;
 	cmd.addr[0].addr = 0;
 	cmd.nsec[0] = (cmd_i == ncmd - 1) ?
-			    sec_size - (cmd_i * ZTL_READ_SEC_MCMD) :
-			    ZTL_READ_SEC_MCMD;
+			    sec_size - (cmd_i * core.config.read_sec_mcmd) :
+			    core.config.read_sec_mcmd;
 
 	cmd.prp[0]  = (uint64_t) mp_entry->opaque +
-			    (cmd_i * ZTL_READ_SEC_MCMD * ZNS_ALIGMENT);
+			    (cmd_i * core.config.read_sec_mcmd * ZNS_ALIGMENT);
 
-	cmd.addr[0].g.sect = sec_off + (cmd_i * ZTL_READ_SEC_MCMD);
+	cmd.addr[0].g.sect = sec_off + (cmd_i * core.config.read_sec_mcmd);
 	cmd.status  = 0;
 
 	ret = xztl_media_submit_io (&cmd);
@@ -219,26 +227,65 @@ static int __zrocks_read (uint64_t offset, void *buf, size_t size) {
 
 int zrocks_read_obj (uint64_t id, uint64_t offset, void *buf, size_t size)
 {
+    struct app_map_entry map;
+    struct app_map_ext ext;
     int ret;
-    uint64_t objsec_off;
 
     if (ZROCKS_DEBUG)
 	log_infoa ("zrocks (read_obj): ID %lu, off %lu, size %lu\n",
 							id, offset, size);
 
-    /* This assumes a single zone offset per object */
-    objsec_off  = ztl()->map->read_fn (id);
+    /* This assumes a single zone offset per object. Packed objects start
+     * within the first sector */
+READ:
+    if (ztl()->map->read_ext_fn (id, &map, &ext))
+	return -1;
+
+    if (!map.addr || offset + size > ext.g.len) {
+	log_erra ("zrocks: Read beyond object. ID %lu, off %lu, sz %lu, "
+			    "obj sz %lu", id, offset, size, (uint64_t) ext.g.len);
+	return -1;
+    }
+
+    /* Inline objects are served from memory. The object may have been
+     * rewritten to media in between, the lookup is repeated until the
+     * mapping and the inline table agree */
+    if (map.addr && !map.g.nsec) {
+	ret = ztl()->map->read_tiny_fn (id, offset, buf, size);
+	if (ret > 0)
+	    goto READ;
+	if (!ret) {
+	    xztl_stats_inc (XZTL_STATS_READ_BYTES_U, size);
+	    xztl_stats_inc (XZTL_STATS_READ_UCMD, 1);
+	}
+	return ret;
+    }
 
     if (ZROCKS_DEBUG)
-	log_infoa ("  objsec_off %lx, userbytes_off %lu", objsec_off, offset);
+	log_infoa ("  objsec_off %lx, boff %d, userbytes_off %lu",
+			    (uint64_t) map.g.offset, ext.g.boff, offset);
 
-    ret = __zrocks_read ((objsec_off * ZNS_ALIGMENT) + offset, buf, size);
+    ret = __zrocks_read (((uint64_t) map.g.offset * ZNS_ALIGMENT) +
+						ext.g.boff + offset, buf, size);
     if (ret)
 	log_erra ("zrocks: Read failure. ID %lu, off 0x%lx, sz %lu. ret %d",
 							    id, offset, size, ret);
     return ret;
 }
 
+int zrocks_obj_size (uint64_t id, size_t *size)
+{
+    struct app_map_entry map;
+    struct app_map_ext ext;
+
+    if (ztl()->map->read_ext_fn (id, &map, &ext) || !map.addr)
+	return -1;
+
+    *size = ext.g.len;
+
+    return 0;
+}
+
 int zrocks_read (uint64_t offset, void *buf, uint64_t size)
 {
     int ret;
@@ -257,6 +304,7 @@ int zrocks_delete (uint64_t id)
 {
     uint64_t old;
 
+    /* Data lifetime is sampled by zrocks_trim, when the pieces die */
     return ztl()->map->upsert_fn (id, 0, &old, 0);
 }
 
@@ -269,12 +317,18 @@ int zrocks_trim (struct zrocks_map *map, uint16_t level)
     if (ZROCKS_DEBUG) log_infoa ("zrocks (trim): (0x%lu/%d)\n",
 					(uint64_t) map->g.offset, map->g.nsec);
 
-    /* We use a single group for now */
-    grp = ztl()->groups.get_fn (0);
+    grp = ztl()->groups.get_by_offset_fn (map->g.offset);
+    if (!grp) {
+	log_erra ("zrocks-trim: Group not found. off 0x%lx",
+					    (uint64_t) map->g.offset);
+	return -1;
+    }
 
     zmd = ztl()->zmd->get_fn (grp, map->g.offset, 1);
     xztl_atomic_int32_update (&zmd->ndeletes, zmd->ndeletes + 1);
 
+    ztl()->pro->death_fn (zmd, level);
+
     if (zmd->npieces == zmd->ndeletes) {
 
 	ret = ztl()->pro->finish_zn_fn (grp, zmd->addr.g.zone, level);
@@ -295,10 +349,50 @@ int zrocks_exit (void)
     return xztl_exit ();
 }
 
+void zrocks_config_default (struct zrocks_config *cfg)
+{
+    cfg->buf_ents = ZROCKS_BUF_ENTS;
+    xztl_config_default (&cfg->xztl);
+}
+
+void zrocks_config_get (struct zrocks_config *cfg)
+{
+    cfg->buf_ents = zrocks_buf_ents;
+    xztl_config_get (&cfg->xztl);
+}
+
 int zrocks_init (const char *dev_name)
 {
+    return zrocks_init_config (dev_name, NULL);
+}
+
+int zrocks_init_config (const char *dev_name, const struct zrocks_config *cfg)
+{
+    struct zrocks_config zcfg;
+    unsigned long env_val;
+    char *env, *end;
     int ret;
 
+    if (cfg)
+	memcpy (&zcfg, cfg, sizeof (struct zrocks_config));
+    else
+	zrocks_config_default (&zcfg);
+
+    env = getenv ("ZROCKS_BUF_ENTS");
+    if (env) {
+	env_val = strtoul (env, &end, 0);
+	if (end != env && *end == '\0' && env_val && env_val < XZTLMP_MAX_ENT)
+	    zcfg.buf_ents = env_val;
+	else
+	    log_erra ("zrocks: Invalid ZROCKS_BUF_ENTS: %s", env);
+    }
+
+    if (!zcfg.buf_ents || zcfg.buf_ents >= XZTLMP_MAX_ENT) {
+	log_erra ("zrocks: Invalid config buf_ents: %u", zcfg.buf_ents);
+	return -1;
+    }
+    zrocks_buf_ents = zcfg.buf_ents;
+
     /* Add libznd media layer */
     xztl_add_media (znd_media_register);
 
@@ -312,7 +406,7 @@ int zrocks_init (const char *dev_name)
     if (pthread_spin_init (&zrocks_mp_spin, 0))
 	return -1;
 
-    ret = xztl_init (dev_name);
+    ret = xztl_init_config (dev_name, &zcfg.xztl);
     if (ret) {
 	pthread_spin_destroy (&zrocks_mp_spin);
 	return -1;
@@ -320,12 +414,13 @@ int zrocks_init (const char *dev_name)
 
     if (xztl_mempool_create (ZROCKS_MEMORY,
 			     0,
-			     ZROCKS_BUF_ENTS,
+			     zrocks_buf_ents,
 			     ZROCKS_MAX_READ_SZ + ZNS_ALIGMENT,
 			     zrocks_alloc,
 			     zrocks_free)) {
 	xztl_exit ();
 	pthread_spin_destroy (&zrocks_mp_spin);
+	return -1;
     }
 
     return ret;